@@ -14,11 +14,28 @@
 #include <linux/major.h>
 #include <linux/blkdev.h>
 #include <linux/bio.h>
+#include <linux/hashtable.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
 #include <linux/mutex.h>
+#include <linux/percpu-rwsem.h>
 #include <linux/radix-tree.h>
+#include <linux/rcupdate.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+#include <linux/xarray.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/mm.h>
+#else
+#include <linux/sched.h>
+#endif
 #include <linux/fs.h>
+#include <linux/file.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 
 #include <asm/uaccess.h>
 
@@ -30,13 +47,78 @@
 #define PAGE_SECTORS        (1 << PAGE_SECTORS_SHIFT)
 #define DEFAULT_COW_RD_SIZE 512000
 #define DEVICE_NAME         "cow_brd"
+// Most chunks filled before they are inserted together.
+#define BRD_INSERT_BATCH    16
+// Spilling drops 1/2^BRD_SPILL_SLACK_SHIFT of the budget more than it has to.
+#define BRD_SPILL_SLACK_SHIFT 4
+
+// Contents are kept in chunks of 1 << chunk_order pages (compound pages when
+// chunk_order > 0), so large devices need fewer tree entries and allocations.
+static int chunk_order;
+#define CHUNK_SECTORS_SHIFT (PAGE_SECTORS_SHIFT + chunk_order)
+#define CHUNK_SECTORS       (PAGE_SECTORS << chunk_order)
+// Whether a chunk's sectors fit in the bitmap kept in its head page's
+// ->private. See brd_sectors_valid.
+#define CHUNK_TRACKED       (CHUNK_SECTORS <= BITS_PER_LONG)
+
+/*
+ * Stored in brd_pages in place of a chunk that reads as all zeros. It hides
+ * whatever the parent has there without taking any memory, and is never mapped
+ * or written. Zero chunks are not on dirty_pages, so they carry a mark in the
+ * tree for brd_recycle_pages to find them by.
+ */
+#define BRD_ZERO_CHUNK      ZERO_PAGE(0)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+#define BRD_ZERO_MARK       XA_MARK_0
+#define BRD_SHARED_MARK     XA_MARK_1
+#else
+#define BRD_ZERO_MARK       0
+#define BRD_SHARED_MARK     1
+#endif
+
+/*
+ * With the dedupe module parameter set, COW_BRD_DEDUPE lets snapshot devices
+ * share chunks that hold the same data at the same place, much like KSM. Each
+ * shared chunk has one of these, hashed both by contents and by page, and is
+ * in the brd_pages of every device using it with BRD_SHARED_MARK set. Like
+ * zero chunks, shared chunks are on no dirty_pages list, and a device copies
+ * one before writing to it. brd_shared_lock nests inside brd_lock.
+ */
+static bool dedupe;
+#define BRD_SHARED_HASH_BITS  12
+
+struct brd_shared_chunk {
+  struct hlist_node by_hash;
+  struct hlist_node by_page;
+  struct page *page;
+  u32 hash;
+  unsigned int refs;
+};
+
+static DEFINE_SPINLOCK(brd_shared_lock);
+static DEFINE_HASHTABLE(brd_shared_by_hash, BRD_SHARED_HASH_BITS);
+static DEFINE_HASHTABLE(brd_shared_by_page, BRD_SHARED_HASH_BITS);
+
+// Protects the list of devices and how they are chained to each other.
+static DEFINE_MUTEX(brd_devices_mutex);
+
+/*
+ * With a budget, a base disk keeps at most budget kbytes of chunks in memory.
+ * Past that its oldest chunks are written to spill_file, in a region of the
+ * file of its own, and read back in the next time anything needs them.
+ * Snapshot devices always stay in memory.
+ */
+static int budget;
+static char *spill_file;
+static struct file *brd_spill_file;
 
 /*
- * Each block ramdisk device has a radix_tree brd_pages of pages that stores
- * the pages containing the block device's contents. A brd page's ->index is
- * its offset in PAGE_SIZE units. This is similar to, but in no way connected
- * with, the kernel's pagecache or buffer cache (which sit above our block
- * device).
+ * Each block ramdisk device has a tree brd_pages of chunks that stores the
+ * pages containing the block device's contents. It is an xarray on 4.20 and
+ * later kernels and a radix_tree before that. A chunk's ->index (on its head
+ * page) is its offset in chunk sized units. This is similar to, but in no way
+ * connected with, the kernel's pagecache or buffer cache (which sit above our
+ * block device).
  */
 struct brd_device {
   int   brd_number;
@@ -45,6 +127,17 @@ struct brd_device {
   // Denotes whether or not a cow_ram is writable and snapshots are active.
   bool  is_writable;
   bool  is_snapshot;
+  // Number of devices whose parent_brd is this one. A snapshot device with
+  // children is a frozen image in a chain and must not change under them.
+  // While restoring is set the device is being emptied without
+  // brd_devices_mutex held and can't be given children. Both are protected
+  // by brd_devices_mutex.
+  int   nr_children;
+  bool  restoring;
+  // Number of times the device is open and whether it is being torn down by
+  // COW_BRD_DEL_SNAPSHOT. Protected by brd_lock.
+  int   nr_open;
+  bool  deleting;
 
   struct request_queue  *brd_queue;
   struct gendisk    *brd_disk;
@@ -55,11 +148,90 @@ struct brd_device {
    * of the block device.
    */
   spinlock_t    brd_lock;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+  struct xarray   brd_pages;
+#else
   struct radix_tree_root  brd_pages;
+#endif
+
+  /*
+   * Every chunk in brd_pages other than BRD_ZERO_CHUNK is also on dirty_pages
+   * (linked through the head page's lru) so a snapshot can be restored by
+   * walking just the chunks the last crash state wrote. Restored chunks go on
+   * free_pages to be reused by the next crash state instead of going back to
+   * the page allocator. All of these are protected by brd_lock.
+   */
+  struct list_head  dirty_pages;
+  struct list_head  free_pages;
+  unsigned long   nr_free_pages;
+  unsigned long   nr_zero_chunks;
+  unsigned long   nr_shared_chunks;
+
+  /*
+   * Counts for COW_BRD_GET_STATS, protected by brd_lock. nr_chunks is the
+   * length of dirty_pages.
+   */
+  unsigned long   nr_chunks;
+  unsigned long long  cow_copies;
+  unsigned long long  nr_restores;
+  u64     restore_ns;
+
+  // Workload log registered on a base disk with COW_BRD_REGISTER_LOG.
+  // Replaced under brd_devices_mutex and looked up under RCU.
+  struct brd_log __rcu  *log;
+
+  /*
+   * Only set up on base disks when spilling. spilled has a bit set for each
+   * chunk whose data is in spill_file, and nr_spilled of those are not in
+   * brd_pages. A chunk in brd_pages with its bit set has not been written
+   * since it was read back, so it can be dropped again without writing it
+   * out. Both are changed under brd_lock. spill_sem is held for read while
+   * anything reads or writes through the disk, including from its snapshot
+   * devices, and for write while chunks are dropped. It is a per-cpu rwsem so
+   * readers of a frozen base disk from many snapshot devices at once don't
+   * all bounce the same cache line.
+   */
+  unsigned long   *spilled;
+  unsigned long   nr_spilled;
+  loff_t      spill_base;
+  struct percpu_rw_semaphore spill_sem;
 };
 
 /*
- * Look up and return a brd's page for a given sector.
+ * Index in brd_pages of the chunk holding a given sector.
+ */
+static inline pgoff_t brd_chunk_index(sector_t sector)
+{
+  return sector >> CHUNK_SECTORS_SHIFT;
+}
+
+/*
+ * The page within chunk that holds a given sector.
+ */
+static inline struct page *brd_chunk_page(struct page *chunk, sector_t sector)
+{
+  return chunk + ((sector >> PAGE_SECTORS_SHIFT) & ((1 << chunk_order) - 1));
+}
+
+/*
+ * Number of chunks it takes to cover the whole device.
+ */
+static inline unsigned long brd_capacity_chunks(struct brd_device *brd)
+{
+  return DIV_ROUND_UP(get_capacity(brd->brd_disk), CHUNK_SECTORS);
+}
+
+static void brd_store_init(struct brd_device *brd)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+  xa_init(&brd->brd_pages);
+#else
+  INIT_RADIX_TREE(&brd->brd_pages, GFP_ATOMIC);
+#endif
+}
+
+/*
+ * Look up and return a brd's chunk for a given sector.
  */
 static DEFINE_MUTEX(brd_mutex);
 static struct page *brd_lookup_page(struct brd_device *brd, sector_t sector)
@@ -70,40 +242,94 @@ static struct page *brd_lookup_page(struct brd_device *brd, sector_t sector)
   /*
    * The page lifetime is protected by the fact that we have opened the
    * device node -- brd pages will never be deleted under us, so we
-   * don't need any further locking or refcounting.
+   * don't need any further locking or refcounting. The one exception is
+   * spilling chunks of a base disk, which is kept out by spill_sem.
+   *
+   * Parents in a chain are frozen, so reads through them never take any
+   * lock. Only the device being read may have writers inserting chunks.
    *
    * This is strictly true for the radix-tree nodes as well (ie. we
    * don't actually need the rcu_read_lock()), however that is not a
    * documented feature of the radix-tree API so it is better to be
    * safe here (we don't have total exclusion from radix tree updates
-   * here, only deletes).
+   * here, only deletes). xa_load takes the RCU read lock itself.
    */
+  idx = brd_chunk_index(sector);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+  page = xa_load(&brd->brd_pages, idx);
+#else
   rcu_read_lock();
-  idx = sector >> PAGE_SECTORS_SHIFT; /* sector to page index */
   page = radix_tree_lookup(&brd->brd_pages, idx);
   rcu_read_unlock();
+#endif
 
-  BUG_ON(page && page->index != idx);
+  BUG_ON(page && page != BRD_ZERO_CHUNK && page->index != idx);
 
   return page;
 }
 
 /*
- * Look up and return a brd's page for a given sector.
- * If one does not exist, allocate an empty page, and insert that. Then
- * return it.
+ * Bits in a chunk's sector bitmap for nr sectors starting at sector.
  */
-static struct page *brd_insert_page(struct brd_device *brd, sector_t sector)
+static inline unsigned long brd_sector_mask(sector_t sector, unsigned int nr)
 {
-  pgoff_t idx;
-  struct page *page;
+  unsigned long mask = (nr >= BITS_PER_LONG) ? ~0UL : (1UL << nr) - 1;
+
+  return mask << (sector & (CHUNK_SECTORS - 1));
+}
+
+/*
+ * Chunks of snapshot devices are not filled from the parent when they are
+ * made. Instead the head page's ->private has a bit set for each sector the
+ * device has written itself, and the other sectors are read from the parent.
+ * This is only done when the bitmap fits in an unsigned long. Otherwise, and
+ * on base disks, chunks are filled when they are made and always valid.
+ */
+static inline bool brd_sectors_valid(struct page *chunk, sector_t sector,
+    unsigned int nr)
+{
+  unsigned long mask;
+
+  if (!CHUNK_TRACKED)
+    return true;
+  mask = brd_sector_mask(sector, nr);
+  return (page_private(chunk) & mask) == mask;
+}
+
+static inline void brd_set_sectors_valid(struct page *chunk, sector_t sector,
+    unsigned int nr)
+{
+  unsigned int i;
+
+  if (!CHUNK_TRACKED || brd_sectors_valid(chunk, sector, nr))
+    return;
+  // The data has to be visible before the bits that say it is there. set_bit
+  // is atomic since other writers may be marking sectors in the same chunk.
+  smp_wmb();
+  for (i = 0; i < nr; i++)
+    set_bit((sector + i) & (CHUNK_SECTORS - 1), &chunk->private);
+}
+
+/*
+ * Get a chunk to hold data, reusing one freed by an earlier restore if there
+ * is one. The contents of the chunk are undefined.
+ */
+static struct page *brd_alloc_page(struct brd_device *brd)
+{
+  struct page *page = NULL;
   gfp_t gfp_flags;
-  void *dst, *parent_src = NULL;
-  struct page *parent_page = NULL;
 
-  page = brd_lookup_page(brd, sector);
-  if (page)
+  spin_lock(&brd->brd_lock);
+  if (!list_empty(&brd->free_pages)) {
+    page = list_first_entry(&brd->free_pages, struct page, lru);
+    list_del(&page->lru);
+    brd->nr_free_pages--;
+  }
+  spin_unlock(&brd->brd_lock);
+  if (page) {
+    set_page_private(page, 0);
     return page;
+  }
 
   /*
    * Must use NOIO because we don't want to recurse back into the
@@ -114,358 +340,1805 @@ static struct page *brd_insert_page(struct brd_device *brd, sector_t sector)
    * If XIP was reworked to use pfns and kmap throughout, this
    * restriction might be able to be lifted.
    */
-  gfp_flags = GFP_NOIO | __GFP_ZERO;
+  gfp_flags = GFP_NOIO | __GFP_COMP;
 #ifndef CONFIG_BLK_DEV_XIP
   gfp_flags |= __GFP_HIGHMEM;
 #endif
-  page = alloc_page(gfp_flags);
-  if (!page)
-    return NULL;
+  page = alloc_pages(gfp_flags, chunk_order);
+  if (page)
+    set_page_private(page, 0);
+  return page;
+}
 
-  if (radix_tree_preload(GFP_NOIO)) {
-    __free_page(page);
-    return NULL;
+/*
+ * Account for a chunk that was just put in brd_pages. Must be called with
+ * brd_lock held.
+ */
+static void brd_add_chunk(struct brd_device *brd, struct page *page)
+{
+  list_add(&page->lru, &brd->dirty_pages);
+  brd->nr_chunks++;
+  // Anything a snapshot device holds itself is a copy on write.
+  if (brd->parent_brd)
+    brd->cow_copies++;
+}
+
+/*
+ * Put a chunk that is no longer in brd_pages on the free list. Must be called
+ * with brd_lock held.
+ */
+static void brd_recycle_page(struct brd_device *brd, struct page *page)
+{
+  list_add(&page->lru, &brd->free_pages);
+  brd->nr_free_pages++;
+}
+
+static void copy_from_brd(void *dst, struct brd_device *brd, sector_t sector,
+    size_t n);
+
+/*
+ * Set up a new chunk for brd. When sectors are tracked on a snapshot device
+ * nothing needs to be copied. Otherwise the chunk is filled with what brd's
+ * ancestors hold at the same place (zeros on a base disk, since recycled
+ * chunks hold whatever the last crash state left in them). This is done
+ * before the chunk goes in the tree so readers never see it half filled.
+ */
+static void brd_fill_page(struct brd_device *brd, struct page *page)
+{
+  sector_t sector = (sector_t) page->index << CHUNK_SECTORS_SHIFT;
+  void *dst;
+  int i;
+
+  if (CHUNK_TRACKED && brd->parent_brd)
+    return;
+  for (i = 0; i < 1 << chunk_order; i++) {
+    dst = kmap_atomic(page + i);
+    copy_from_brd(dst, brd->parent_brd, sector + i * PAGE_SECTORS, PAGE_SIZE);
+    kunmap_atomic(dst);
+  }
+  brd_set_sectors_valid(page, sector, CHUNK_SECTORS);
+}
+
+/*
+ * Insert nr filled chunks into brd_pages under a single hold of brd_lock.
+ * Chunks that lost a race with another writer or could not be inserted are
+ * recycled.
+ */
+static int brd_store_insert(struct brd_device *brd, struct page **pages,
+    int nr)
+{
+  int i, error = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+  struct page *existing;
+  int reserved;
+
+  // Allocate the tree nodes up front so nothing needs to sleep once the lock
+  // is held.
+  for (reserved = 0; reserved < nr; reserved++) {
+    if (xa_reserve(&brd->brd_pages, pages[reserved]->index, GFP_NOIO))
+      break;
   }
 
   spin_lock(&brd->brd_lock);
-  idx = sector >> PAGE_SECTORS_SHIFT;
-  page->index = idx;
-  if (radix_tree_insert(&brd->brd_pages, idx, page)) {
-    __free_page(page);
-    page = radix_tree_lookup(&brd->brd_pages, idx);
-    BUG_ON(!page);
-    BUG_ON(page->index != idx);
+  for (i = 0; i < nr; i++) {
+    if (i < reserved) {
+      existing = xa_cmpxchg(&brd->brd_pages, pages[i]->index, NULL, pages[i],
+          GFP_ATOMIC);
+      if (!existing) {
+        brd_add_chunk(brd, pages[i]);
+        continue;
+      }
+      if (xa_is_err(existing)) {
+        xa_release(&brd->brd_pages, pages[i]->index);
+        error = -ENOMEM;
+      } else {
+        BUG_ON(existing != BRD_ZERO_CHUNK &&
+            existing->index != pages[i]->index);
+      }
+    } else {
+      error = -ENOMEM;
+    }
+    brd_recycle_page(brd, pages[i]);
   }
   spin_unlock(&brd->brd_lock);
+#else
+  int ret;
 
-  radix_tree_preload_end();
+  if (radix_tree_preload(GFP_NOIO)) {
+    spin_lock(&brd->brd_lock);
+    for (i = 0; i < nr; i++)
+      brd_recycle_page(brd, pages[i]);
+    spin_unlock(&brd->brd_lock);
+    return -ENOMEM;
+  }
 
-  // Copy over the data in the parent's page to the snapshot page if the parent
-  // has a page in this sector address.
-  if (brd->parent_brd) {
-    parent_page = brd_lookup_page(brd->parent_brd, sector);
-    // This page may not have originally existed in the parent.
-    if (parent_page) {
-      // Map both the parent and snapshot pages so that the kernel can access
-      // those addresses. The snapshot page and the parent page both already
-      // reside in radix trees, so even when we unmap the pages, the data and
-      // the page itself will still remain.
-      dst = kmap_atomic(page);
-      parent_src = kmap_atomic(parent_page);
-      memcpy(dst, parent_src, PAGE_SIZE);
-      kunmap_atomic(parent_src);
-      kunmap_atomic(dst);
+  spin_lock(&brd->brd_lock);
+  for (i = 0; i < nr; i++) {
+    ret = radix_tree_insert(&brd->brd_pages, pages[i]->index, pages[i]);
+    if (!ret) {
+      brd_add_chunk(brd, pages[i]);
+      continue;
     }
+    if (ret != -EEXIST)
+      error = ret;
+    brd_recycle_page(brd, pages[i]);
   }
+  spin_unlock(&brd->brd_lock);
 
-  return page;
+  radix_tree_preload_end();
+#endif
+
+  return error;
 }
 
-static void brd_free_page(struct brd_device *brd, sector_t sector)
+/*
+ * Make sure brd has its own chunk for every sector in the n bytes starting at
+ * sector. Missing chunks are allocated and filled from the parent without any
+ * locks held and then inserted up to BRD_INSERT_BATCH at a time, so a large
+ * write takes brd_lock once per batch instead of once per page.
+ */
+static int brd_insert_pages(struct brd_device *brd, sector_t sector, size_t n)
 {
-  struct page *page;
-  pgoff_t idx;
-
-  spin_lock(&brd->brd_lock);
-  idx = sector >> PAGE_SECTORS_SHIFT;
-  page = radix_tree_delete(&brd->brd_pages, idx);
-  spin_unlock(&brd->brd_lock);
-  if (page)
-    __free_page(page);
+  struct page *pages[BRD_INSERT_BATCH];
+  pgoff_t idx, last;
+  int nr, ret, error = 0;
+
+  if (!n)
+    return 0;
+  idx = brd_chunk_index(sector);
+  last = brd_chunk_index(sector + ((n - 1) >> SECTOR_SHIFT));
+  while (idx <= last && !error) {
+    for (nr = 0; idx <= last && nr < BRD_INSERT_BATCH; idx++) {
+      if (brd_lookup_page(brd, (sector_t) idx << CHUNK_SECTORS_SHIFT))
+        continue;
+      pages[nr] = brd_alloc_page(brd);
+      if (!pages[nr]) {
+        error = -ENOMEM;
+        break;
+      }
+      pages[nr]->index = idx;
+      brd_fill_page(brd, pages[nr]);
+      nr++;
+    }
+    ret = brd_store_insert(brd, pages, nr);
+    if (!error)
+      error = ret;
+  }
+  return error;
 }
 
-static void brd_zero_page(struct brd_device *brd, sector_t sector)
+/*
+ * Remove a chunk from brd_pages. Must be called with brd_lock held.
+ */
+static struct page *brd_store_delete(struct brd_device *brd, pgoff_t idx)
 {
-  struct page *page;
-
-  page = brd_lookup_page(brd, sector);
-  if (page)
-    clear_highpage(page);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+  return xa_erase(&brd->brd_pages, idx);
+#else
+  return radix_tree_delete(&brd->brd_pages, idx);
+#endif
 }
 
 /*
- * Free all backing store pages and radix tree. This must only be called when
- * there are no other users of the device.
+ * Find the first chunk in brd_pages at or after *idx and move *idx to it.
  */
-#define FREE_BATCH 16
-static void brd_free_pages(struct brd_device *brd)
+static struct page *brd_store_next(struct brd_device *brd, pgoff_t *idx)
 {
-  unsigned long pos = 0;
-  struct page *pages[FREE_BATCH];
-  int nr_pages;
-
-  do {
-    int i;
-
-    nr_pages = radix_tree_gang_lookup(&brd->brd_pages,
-        (void **)pages, pos, FREE_BATCH);
-
-    for (i = 0; i < nr_pages; i++) {
-      void *ret;
+  struct page *page = NULL;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+  void **slot;
+  unsigned long index;
+#endif
 
-      BUG_ON(pages[i]->index < pos);
-      pos = pages[i]->index;
-      ret = radix_tree_delete(&brd->brd_pages, pos);
-      BUG_ON(!ret || ret != pages[i]);
-      __free_page(pages[i]);
-    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+  page = xa_find(&brd->brd_pages, idx, ULONG_MAX, XA_PRESENT);
+#else
+  // Zero chunks have no ->index, so ask the tree where the entry is.
+  rcu_read_lock();
+  if (radix_tree_gang_lookup_slot(&brd->brd_pages, &slot, &index, *idx, 1)) {
+    page = radix_tree_deref_slot(slot);
+    *idx = index;
+  }
+  rcu_read_unlock();
+#endif
+  return page;
+}
 
-    pos++;
+/*
+ * Whether brd's chunk at idx is shared with other devices.
+ */
+static bool brd_chunk_shared(struct brd_device *brd, pgoff_t idx)
+{
+  bool shared;
 
-    /*
-     * This assumes radix_tree_gang_lookup always returns as
-     * many pages as possible. If the radix-tree code changes,
-     * so will this have to.
-     */
-  } while (nr_pages == FREE_BATCH);
+  if (!brd->nr_shared_chunks)
+    return false;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+  shared = xa_get_mark(&brd->brd_pages, idx, BRD_SHARED_MARK);
+#else
+  rcu_read_lock();
+  shared = radix_tree_tag_get(&brd->brd_pages, idx, BRD_SHARED_MARK);
+  rcu_read_unlock();
+#endif
+  return shared;
 }
 
 /*
- * copy_to_brd_setup must be called before copy_to_brd. It may sleep.
+ * Drop a reference to a shared chunk, freeing it along with the last one.
  */
-static int copy_to_brd_setup(struct brd_device *brd, sector_t sector, size_t n)
+static void brd_put_shared(struct page *page)
 {
-  unsigned int offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
-  size_t copy;
+  struct brd_shared_chunk *sc;
 
-  copy = min_t(size_t, n, PAGE_SIZE - offset);
-  if (!brd_insert_page(brd, sector))
-    return -ENOMEM;
-  if (copy < n) {
-    sector += copy >> SECTOR_SHIFT;
-    if (!brd_insert_page(brd, sector))
-      return -ENOMEM;
+  spin_lock(&brd_shared_lock);
+  hash_for_each_possible(brd_shared_by_page, sc, by_page,
+      (unsigned long) page) {
+    if (sc->page == page)
+      break;
+  }
+  BUG_ON(!sc);
+  if (--sc->refs) {
+    sc = NULL;
+  } else {
+    hash_del(&sc->by_hash);
+    hash_del(&sc->by_page);
+  }
+  spin_unlock(&brd_shared_lock);
+
+  if (sc) {
+    set_page_private(sc->page, 0);
+    __free_pages(sc->page, chunk_order);
+    kfree(sc);
   }
-  return 0;
 }
 
-static void discard_from_brd(struct brd_device *brd,
-      sector_t sector, size_t n)
+/*
+ * Let go of an entry that was just taken out of brd_pages. Must be called with
+ * brd_lock held.
+ */
+static void brd_release_chunk(struct brd_device *brd, struct page *page,
+    bool shared)
 {
-  while (n >= PAGE_SIZE) {
-    /*
-     * Don't want to actually discard pages here because
-     * re-allocating the pages can result in writeback
-     * deadlocks under heavy load.
-     */
-    if (0)
-      brd_free_page(brd, sector);
-    else
-      brd_zero_page(brd, sector);
-    sector += PAGE_SIZE >> SECTOR_SHIFT;
-    n -= PAGE_SIZE;
+  if (!page)
+    return;
+  if (page == BRD_ZERO_CHUNK) {
+    brd->nr_zero_chunks--;
+  } else if (shared) {
+    brd->nr_shared_chunks--;
+    brd_put_shared(page);
+  } else {
+    list_del(&page->lru);
+    brd->nr_chunks--;
+    brd_recycle_page(brd, page);
   }
 }
 
 /*
- * Copy n bytes from src to the brd starting at sector. Does not sleep.
+ * Put page in brd_pages at idx in place of the entry that is there, clearing
+ * its marks. Must be called with brd_lock held, and after radix_tree_preload
+ * on kernels without xarray.
  */
-static void copy_to_brd(struct brd_device *brd, const void *src,
-      sector_t sector, size_t n)
+static void brd_store_replace(struct brd_device *brd, pgoff_t idx,
+    struct page *page)
 {
-  struct page *page;
-  void *dst;
-  unsigned int offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
-  size_t copy;
-
-  copy = min_t(size_t, n, PAGE_SIZE - offset);
-  page = brd_lookup_page(brd, sector);
-  BUG_ON(!page);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+  // The slot is already there, so this never allocates.
+  xa_store(&brd->brd_pages, idx, page, GFP_ATOMIC);
+  xa_clear_mark(&brd->brd_pages, idx, BRD_ZERO_MARK);
+  xa_clear_mark(&brd->brd_pages, idx, BRD_SHARED_MARK);
+#else
+  radix_tree_delete(&brd->brd_pages, idx);
+  radix_tree_insert(&brd->brd_pages, idx, page);
+#endif
+}
 
-  dst = kmap_atomic(page);
-  memcpy(dst + offset, src, copy);
-  kunmap_atomic(dst);
+/*
+ * Make the chunk holding sector read as zeros, dropping whatever brd had
+ * written there. A snapshot device gets a zero chunk so the parent's data
+ * stays hidden. A base disk has nothing under it and just loses the chunk.
+ *
+ * The dropped chunk is recycled rather than freed, since allocating pages
+ * again under heavy load can deadlock writeback. Readers or writers of the
+ * same sectors racing with this may see the chunk after it is reused.
+ */
+static int brd_set_zero_chunk(struct brd_device *brd, sector_t sector)
+{
+  pgoff_t idx = brd_chunk_index(sector);
+  struct page *old;
+  bool shared;
+  int error = 0;
 
-  if (copy < n) {
-    src += copy;
-    sector += copy >> SECTOR_SHIFT;
-    copy = n - copy;
-    page = brd_lookup_page(brd, sector);
-    BUG_ON(!page);
+  if (!brd->parent_brd) {
+    spin_lock(&brd->brd_lock);
+    brd_release_chunk(brd, brd_store_delete(brd, idx), false);
+    spin_unlock(&brd->brd_lock);
+    return 0;
+  }
 
-    dst = kmap_atomic(page);
-    memcpy(dst, src, copy);
-    kunmap_atomic(dst);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+  if (xa_reserve(&brd->brd_pages, idx, GFP_NOIO))
+    return -ENOMEM;
+  spin_lock(&brd->brd_lock);
+  shared = brd_chunk_shared(brd, idx);
+  old = xa_store(&brd->brd_pages, idx, BRD_ZERO_CHUNK, GFP_ATOMIC);
+  if (xa_is_err(old)) {
+    xa_release(&brd->brd_pages, idx);
+    old = NULL;
+    error = -ENOMEM;
+  } else {
+    xa_set_mark(&brd->brd_pages, idx, BRD_ZERO_MARK);
+    xa_clear_mark(&brd->brd_pages, idx, BRD_SHARED_MARK);
   }
+#else
+  if (radix_tree_preload(GFP_NOIO))
+    return -ENOMEM;
+  spin_lock(&brd->brd_lock);
+  shared = brd_chunk_shared(brd, idx);
+  old = radix_tree_delete(&brd->brd_pages, idx);
+  error = radix_tree_insert(&brd->brd_pages, idx, BRD_ZERO_CHUNK);
+  if (!error)
+    radix_tree_tag_set(&brd->brd_pages, idx, BRD_ZERO_MARK);
+#endif
+  if (!error)
+    brd->nr_zero_chunks++;
+  brd_release_chunk(brd, old, shared);
+  spin_unlock(&brd->brd_lock);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+  radix_tree_preload_end();
+#endif
+  return error;
 }
 
 /*
- * Copy n bytes to dst from the brd starting at sector. Does not sleep.
+ * Give brd a chunk of its own at sector in place of old, a zero chunk or a
+ * shared chunk, holding the same data so it can be written in place.
  */
-static void copy_from_brd(void *dst, struct brd_device *brd, sector_t sector,
-    size_t n)
+static int brd_own_chunk(struct brd_device *brd, sector_t sector,
+    struct page *old)
 {
+  pgoff_t idx = brd_chunk_index(sector);
   struct page *page;
-  void *src;
-  unsigned int offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
-  size_t copy;
+  bool shared;
+  int i;
 
-  copy = min_t(size_t, n, PAGE_SIZE - offset);
-  page = brd_lookup_page(brd, sector);
-  if (page) {
-    // Present in the new radix tree so this page has been modified.
-    src = kmap_atomic(page);
-    memcpy(dst, src + offset, copy);
-    kunmap_atomic(src);
-  } else if (brd->parent_brd &&
-      (page = brd_lookup_page(brd->parent_brd, sector))) {
-    // Present in the old radix tree so this page has not been modified.
-    src = kmap_atomic(page);
-    memcpy(dst, src + offset, copy);
-    kunmap_atomic(src);
+  page = brd_alloc_page(brd);
+  if (!page)
+    return -ENOMEM;
+  page->index = idx;
+  for (i = 0; i < 1 << chunk_order; i++) {
+    if (old == BRD_ZERO_CHUNK)
+      clear_highpage(page + i);
+    else
+      copy_highpage(page + i, old + i);
+  }
+  brd_set_sectors_valid(page, (sector_t) idx << CHUNK_SECTORS_SHIFT,
+      CHUNK_SECTORS);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+  if (radix_tree_preload(GFP_NOIO)) {
+    spin_lock(&brd->brd_lock);
+    brd_recycle_page(brd, page);
+    spin_unlock(&brd->brd_lock);
+    return -ENOMEM;
+  }
+#endif
+  spin_lock(&brd->brd_lock);
+  shared = brd_chunk_shared(brd, idx);
+  if (brd_lookup_page(brd, sector) == old &&
+      (old == BRD_ZERO_CHUNK || shared)) {
+    brd_store_replace(brd, idx, page);
+    brd_add_chunk(brd, page);
+    brd_release_chunk(brd, old, shared);
   } else {
-    // Page doesn't exist in either radix tree so it must never have been
-    // written.
-    memset(dst, 0, copy);
+    // Someone else got to it first.
+    brd_recycle_page(brd, page);
   }
+  spin_unlock(&brd->brd_lock);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+  radix_tree_preload_end();
+#endif
+  return 0;
+}
+
+/*
+ * Make sure chunk, brd's chunk holding sector if it has one, can be written
+ * in place.
+ */
+static int brd_writable_chunk(struct brd_device *brd, sector_t sector,
+    struct page *chunk)
+{
+  if (chunk == BRD_ZERO_CHUNK ||
+      (chunk && brd_chunk_shared(brd, brd_chunk_index(sector))))
+    return brd_own_chunk(brd, sector, chunk);
+  return 0;
+}
+
+/*
+ * Remove every zero chunk, or every shared chunk, from brd_pages. Must be
+ * called with brd_lock held.
+ */
+static void brd_drop_marked_chunks(struct brd_device *brd, bool shared)
+{
+  unsigned long *count = shared ? &brd->nr_shared_chunks :
+    &brd->nr_zero_chunks;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+  pgoff_t idx = 0;
+
+  while (*count && xa_find(&brd->brd_pages, &idx, ULONG_MAX,
+        shared ? BRD_SHARED_MARK : BRD_ZERO_MARK))
+    brd_release_chunk(brd, xa_erase(&brd->brd_pages, idx), shared);
+#else
+  struct radix_tree_iter iter;
+  void **slot;
+  pgoff_t idx[BRD_INSERT_BATCH];
+  int nr, i;
+
+  // The tree can't be changed while it is being walked, so gather a batch of
+  // indices at a time.
+  while (*count) {
+    nr = 0;
+    radix_tree_for_each_tagged(slot, &brd->brd_pages, &iter, 0,
+        shared ? BRD_SHARED_MARK : BRD_ZERO_MARK) {
+      idx[nr++] = iter.index;
+      if (nr == BRD_INSERT_BATCH)
+        break;
+    }
+    if (!nr)
+      break;
+    for (i = 0; i < nr; i++)
+      brd_release_chunk(brd, brd_store_delete(brd, idx[i]), shared);
+  }
+#endif
+  WARN_ON(*count);
+  *count = 0;
+}
+
+/*
+ * Hash of a chunk's contents and where it is.
+ */
+static u32 brd_chunk_hash(struct page *page)
+{
+  u32 hash = page->index;
+  void *mem;
+  int i;
+
+  for (i = 0; i < 1 << chunk_order; i++) {
+    mem = kmap_atomic(page + i);
+    hash = jhash2(mem, PAGE_SIZE / sizeof(u32), hash);
+    kunmap_atomic(mem);
+  }
+  return hash;
+}
+
+static bool brd_chunks_equal(struct page *a, struct page *b)
+{
+  void *mem_a, *mem_b;
+  bool equal = a->index == b->index;
+  int i;
+
+  for (i = 0; i < 1 << chunk_order && equal; i++) {
+    mem_a = kmap_atomic(a + i);
+    mem_b = kmap_atomic(b + i);
+    equal = !memcmp(mem_a, mem_b, PAGE_SIZE);
+    kunmap_atomic(mem_b);
+    kunmap_atomic(mem_a);
+  }
+  return equal;
+}
+
+/*
+ * Share the chunks brd has written with other snapshot devices holding the
+ * same data at the same place, keeping one copy of each. Chunks only partly
+ * written are left alone since they still read from the parent. The device
+ * must not be written while this runs.
+ */
+static int brd_dedupe(struct brd_device *brd)
+{
+  LIST_HEAD(chunks);
+  LIST_HEAD(keep);
+  struct brd_shared_chunk *sc, *new_sc = NULL;
+  struct page *page;
+  u32 hash;
+  int error = 0;
+
+  spin_lock(&brd->brd_lock);
+  list_splice_init(&brd->dirty_pages, &chunks);
+  spin_unlock(&brd->brd_lock);
+
+  while (!list_empty(&chunks)) {
+    page = list_first_entry(&chunks, struct page, lru);
+    list_move(&page->lru, &keep);
+    if (error || !brd_sectors_valid(page,
+          (sector_t) page->index << CHUNK_SECTORS_SHIFT, CHUNK_SECTORS))
+      continue;
+    if (!new_sc)
+      new_sc = kmalloc(sizeof(*new_sc), GFP_KERNEL);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+    if (new_sc && radix_tree_preload(GFP_NOIO)) {
+      kfree(new_sc);
+      new_sc = NULL;
+    }
+#endif
+    if (!new_sc) {
+      error = -ENOMEM;
+      continue;
+    }
+    hash = brd_chunk_hash(page);
+
+    spin_lock(&brd_shared_lock);
+    hash_for_each_possible(brd_shared_by_hash, sc, by_hash, hash) {
+      if (sc->hash == hash && sc->page->index == page->index)
+        break;
+    }
+    if (sc)
+      sc->refs++;
+    spin_unlock(&brd_shared_lock);
+
+    // Chunks can be large, so they are compared without brd_shared_lock.
+    // The reference keeps sc->page around, and shared chunks never change.
+    if (sc && !brd_chunks_equal(sc->page, page)) {
+      brd_put_shared(sc->page);
+      sc = NULL;
+    }
+    if (!sc) {
+      // A hash collision just leaves two entries with the same hash.
+      sc = new_sc;
+      new_sc = NULL;
+      sc->page = page;
+      sc->hash = hash;
+      sc->refs = 1;
+      spin_lock(&brd_shared_lock);
+      hash_add(brd_shared_by_hash, &sc->by_hash, hash);
+      hash_add(brd_shared_by_page, &sc->by_page, (unsigned long) page);
+      spin_unlock(&brd_shared_lock);
+    }
+
+    spin_lock(&brd->brd_lock);
+    list_del(&page->lru);
+    brd->nr_chunks--;
+    if (sc->page != page) {
+      brd_store_replace(brd, page->index, sc->page);
+      brd_recycle_page(brd, page);
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+    xa_set_mark(&brd->brd_pages, sc->page->index, BRD_SHARED_MARK);
+#else
+    radix_tree_tag_set(&brd->brd_pages, sc->page->index, BRD_SHARED_MARK);
+#endif
+    brd->nr_shared_chunks++;
+    spin_unlock(&brd->brd_lock);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+    radix_tree_preload_end();
+#endif
+  }
+  kfree(new_sc);
+
+  spin_lock(&brd->brd_lock);
+  list_splice(&keep, &brd->dirty_pages);
+  spin_unlock(&brd->brd_lock);
+  return error;
+}
+
+/*
+ * Zero nr sectors starting at sector, all in the same chunk. A snapshot
+ * device needs a chunk of its own for this unless it already reads as zeros.
+ */
+static int brd_zero_sectors(struct brd_device *brd, sector_t sector,
+    unsigned int nr)
+{
+  struct page *page;
+  void *dst;
+  unsigned int offset, len;
+  int error;
+
+  page = brd_lookup_page(brd, sector);
+  if (!page) {
+    if (!brd->parent_brd)
+      return 0;
+    error = brd_insert_pages(brd, sector, nr << SECTOR_SHIFT);
+    if (error)
+      return error;
+    page = brd_lookup_page(brd, sector);
+  }
+  // Already all zeros, possibly from a discard racing with this one.
+  if (!page || page == BRD_ZERO_CHUNK)
+    return 0;
+  if (brd_chunk_shared(brd, brd_chunk_index(sector))) {
+    error = brd_own_chunk(brd, sector, page);
+    if (error)
+      return error;
+    page = brd_lookup_page(brd, sector);
+  }
+
+  while (nr) {
+    offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+    len = min_t(unsigned int, nr << SECTOR_SHIFT, PAGE_SIZE - offset);
+    dst = kmap_atomic(brd_chunk_page(page, sector));
+    memset(dst + offset, 0, len);
+    kunmap_atomic(dst);
+    brd_set_sectors_valid(page, sector, len >> SECTOR_SHIFT);
+    sector += len >> SECTOR_SHIFT;
+    nr -= len >> SECTOR_SHIFT;
+  }
+  return 0;
+}
+
+/*
+ * Empty the tree, moving its chunks to the free list. Only touches the
+ * chunks that were written since the last call. This must only be called when
+ * there are no other users of the device.
+ */
+static void brd_recycle_pages(struct brd_device *brd)
+{
+  struct page *page;
+  void *ret;
+
+  spin_lock(&brd->brd_lock);
+  while (!list_empty(&brd->dirty_pages)) {
+    page = list_first_entry(&brd->dirty_pages, struct page, lru);
+    list_del(&page->lru);
+    ret = brd_store_delete(brd, page->index);
+    BUG_ON(!ret || ret != page);
+    brd_recycle_page(brd, page);
+  }
+  brd->nr_chunks = 0;
+  brd_drop_marked_chunks(brd, false);
+  brd_drop_marked_chunks(brd, true);
+  spin_unlock(&brd->brd_lock);
+}
+
+/*
+ * brd_recycle_pages for a crash state restore, timed for COW_BRD_GET_STATS.
+ * The caller must have set brd->restoring under brd_devices_mutex, which is
+ * cleared again here. The chunks are recycled without the mutex held so
+ * snapshot devices can be restored at the same time.
+ */
+static void brd_restore(struct brd_device *brd)
+{
+  ktime_t start = ktime_get();
+  u64 ns;
+
+  brd_recycle_pages(brd);
+  ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+  spin_lock(&brd->brd_lock);
+  brd->nr_restores++;
+  brd->restore_ns += ns;
+  spin_unlock(&brd->brd_lock);
+
+  mutex_lock(&brd_devices_mutex);
+  brd->restoring = false;
+  mutex_unlock(&brd_devices_mutex);
+}
+
+/*
+ * Free all backing store chunks and the tree, including the chunks kept for
+ * reuse. This must only be called when there are no other users of the
+ * device.
+ */
+static void brd_free_pages(struct brd_device *brd)
+{
+  struct page *page, *next;
+
+  brd_recycle_pages(brd);
+  spin_lock(&brd->brd_lock);
+  list_for_each_entry_safe(page, next, &brd->free_pages, lru) {
+    list_del(&page->lru);
+    set_page_private(page, 0);
+    __free_pages(page, chunk_order);
+  }
+  brd->nr_free_pages = 0;
+  spin_unlock(&brd->brd_lock);
+}
+
+/*
+ * The base disk at the top of brd's chain.
+ */
+static struct brd_device *brd_base(struct brd_device *brd)
+{
+  while (brd->parent_brd)
+    brd = brd->parent_brd;
+  return brd;
+}
+
+/*
+ * Read or write a whole chunk of a base disk at its place in spill_file.
+ */
+static int brd_spill_rw(struct brd_device *brd, struct page *page, bool write)
+{
+  loff_t pos = brd->spill_base +
+    ((loff_t) page->index << (PAGE_SHIFT + chunk_order));
+  unsigned int noio, i;
+  ssize_t ret = 0;
+  void *buf;
+
+  // The filesystem spill_file is on must not reclaim memory by writing to us.
+  noio = memalloc_noio_save();
+  for (i = 0; i < 1 << chunk_order && ret >= 0; i++) {
+    buf = kmap(page + i);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+    if (write)
+      ret = kernel_write(brd_spill_file, buf, PAGE_SIZE, &pos);
+    else
+      ret = kernel_read(brd_spill_file, buf, PAGE_SIZE, &pos);
+#else
+    if (write)
+      ret = kernel_write(brd_spill_file, buf, PAGE_SIZE, pos);
+    else
+      ret = kernel_read(brd_spill_file, pos, buf, PAGE_SIZE);
+    pos += PAGE_SIZE;
+#endif
+    kunmap(page + i);
+    if (ret >= 0 && ret != PAGE_SIZE)
+      ret = -EIO;
+  }
+  memalloc_noio_restore(noio);
+  return ret < 0 ? ret : 0;
+}
+
+/*
+ * Start reading or writing through brd. If its base disk spills, this holds
+ * the base's spill_sem for read and returns the base, which must be handed
+ * to brd_spill_release when done. Otherwise it returns NULL.
+ */
+static struct brd_device *brd_spill_hold(struct brd_device *brd)
+{
+  struct brd_device *base = brd_base(brd);
+
+  if (!base->spilled)
+    return NULL;
+  percpu_down_read(&base->spill_sem);
+  return base;
+}
+
+/*
+ * Read the chunks of base covering the n bytes starting at sector back in
+ * from spill_file. If the base itself is about to write them, their copies
+ * in spill_file go out of date. Does nothing if base is NULL.
+ */
+static int brd_unspill(struct brd_device *base, sector_t sector, size_t n,
+    bool write)
+{
+  struct page *page;
+  pgoff_t idx, last;
+  int error = 0;
+
+  if (!base || !n)
+    return 0;
+  idx = brd_chunk_index(sector);
+  last = brd_chunk_index(sector + ((n - 1) >> SECTOR_SHIFT));
+  for (; idx <= last && !error; idx++) {
+    sector = (sector_t) idx << CHUNK_SECTORS_SHIFT;
+    if (test_bit(idx, base->spilled) && !brd_lookup_page(base, sector)) {
+      page = brd_alloc_page(base);
+      if (!page)
+        return -ENOMEM;
+      page->index = idx;
+      error = brd_spill_rw(base, page, false);
+      if (error) {
+        spin_lock(&base->brd_lock);
+        brd_recycle_page(base, page);
+        spin_unlock(&base->brd_lock);
+        break;
+      }
+      brd_set_sectors_valid(page, sector, CHUNK_SECTORS);
+      error = brd_store_insert(base, &page, 1);
+      // Another reader may have brought it back first.
+      if (!error && brd_lookup_page(base, sector) == page) {
+        spin_lock(&base->brd_lock);
+        base->nr_spilled--;
+        spin_unlock(&base->brd_lock);
+      }
+    }
+    if (!error && write) {
+      spin_lock(&base->brd_lock);
+      __clear_bit(idx, base->spilled);
+      spin_unlock(&base->brd_lock);
+    }
+  }
+  return error;
+}
+
+/*
+ * Drop the hold from brd_spill_hold, then get base back within budget by
+ * dropping its oldest chunks, writing out the ones spill_file is behind on.
+ * Taking spill_sem for write waits for an RCU grace period, so a little more
+ * than needed is dropped each time to keep that from happening on every bio.
+ */
+static void brd_spill_release(struct brd_device *base)
+{
+  unsigned long max_chunks, target;
+  struct page *page;
+  bool clean;
+  int error = 0;
+
+  if (!base)
+    return;
+  percpu_up_read(&base->spill_sem);
+  max_chunks = (unsigned long) budget >> (PAGE_SHIFT - 10 + chunk_order);
+  if (base->nr_chunks <= max_chunks)
+    return;
+  target = max_chunks - min(max_chunks,
+      max_t(unsigned long, max_chunks >> BRD_SPILL_SLACK_SHIFT,
+        BRD_INSERT_BATCH));
+
+  percpu_down_write(&base->spill_sem);
+  while (!error) {
+    spin_lock(&base->brd_lock);
+    if (base->nr_chunks <= target) {
+      spin_unlock(&base->brd_lock);
+      break;
+    }
+    page = list_last_entry(&base->dirty_pages, struct page, lru);
+    clean = test_bit(page->index, base->spilled);
+    spin_unlock(&base->brd_lock);
+
+    // Nothing else can be using the chunk with spill_sem held for write.
+    if (!clean)
+      error = brd_spill_rw(base, page, true);
+    if (error)
+      break;
+    spin_lock(&base->brd_lock);
+    list_del(&page->lru);
+    base->nr_chunks--;
+    BUG_ON(brd_store_delete(base, page->index) != page);
+    __set_bit(page->index, base->spilled);
+    base->nr_spilled++;
+    spin_unlock(&base->brd_lock);
+    set_page_private(page, 0);
+    __free_pages(page, chunk_order);
+  }
+  percpu_up_write(&base->spill_sem);
+
+  if (error)
+    printk_ratelimited(KERN_WARNING DEVICE_NAME ": unable to spill to %s "
+        "(%d)\n", spill_file, error);
+}
+
+/*
+ * Drop everything a base disk holds, both in memory and in spill_file.
+ * Assumes no snapshots are being used right now.
+ */
+static void brd_wipe(struct brd_device *brd)
+{
+  if (brd->spilled)
+    percpu_down_write(&brd->spill_sem);
+  brd_free_pages(brd);
+  if (brd->spilled) {
+    spin_lock(&brd->brd_lock);
+    bitmap_zero(brd->spilled, brd_capacity_chunks(brd));
+    brd->nr_spilled = 0;
+    spin_unlock(&brd->brd_lock);
+    percpu_up_write(&brd->spill_sem);
+  }
+}
+
+/*
+ * Make n bytes starting at sector read as zeros, for both discards and write
+ * zeroes. Whole chunks are dropped through brd_set_zero_chunk and the ends
+ * are zeroed in place. Sectors of a snapshot device never read the parent's
+ * data again after this.
+ */
+static int discard_from_brd(struct brd_device *brd,
+      sector_t sector, size_t n)
+{
+  unsigned int nr;
+  int error = 0;
+
+  n >>= SECTOR_SHIFT;
+  while (n && !error) {
+    nr = min_t(size_t, n, CHUNK_SECTORS - (sector & (CHUNK_SECTORS - 1)));
+    if (nr == CHUNK_SECTORS)
+      error = brd_set_zero_chunk(brd, sector);
+    else
+      error = brd_zero_sectors(brd, sector, nr);
+    sector += nr;
+    n -= nr;
+  }
+  return error;
+}
+
+/*
+ * Copy n bytes from src to the brd starting at sector. The chunks must
+ * already be in place from brd_prepare_write, which leaves out the ones only
+ * zeros are written to. Does not sleep.
+ */
+static void copy_to_brd(struct brd_device *brd, const void *src,
+      sector_t sector, size_t n)
+{
+  struct page *page;
+  void *dst;
+  unsigned int offset;
+  size_t copy;
+
+  while (n) {
+    offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+    copy = min_t(size_t, n, PAGE_SIZE - offset);
+    page = brd_lookup_page(brd, sector);
+    if (page && page != BRD_ZERO_CHUNK) {
+      dst = kmap_atomic(brd_chunk_page(page, sector));
+      memcpy(dst + offset, src, copy);
+      kunmap_atomic(dst);
+      brd_set_sectors_valid(page, sector, copy >> SECTOR_SHIFT);
+    } else {
+      // Only zeros may be left without a chunk to go in.
+      WARN_ON_ONCE(memchr_inv(src, 0, copy));
+    }
+
+    src += copy;
+    sector += copy >> SECTOR_SHIFT;
+    n -= copy;
+  }
+}
+
+/*
+ * Copy n bytes to dst from the brd starting at sector. Sectors brd has not
+ * written come from its parent, and so on up the chain. Ancestors are frozen,
+ * so what they hold will not change under us. Does not sleep.
+ */
+static void copy_from_brd(void *dst, struct brd_device *brd, sector_t sector,
+    size_t n)
+{
+  struct page *page;
+  void *src;
+  unsigned int offset, i;
+  size_t copy;
+
+  if (!brd) {
+    // Past the top of the chain so it must never have been written.
+    memset(dst, 0, n);
+    return;
+  }
+
+  while (n) {
+    offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+    copy = min_t(size_t, n, PAGE_SIZE - offset);
+    page = brd_lookup_page(brd, sector);
+    if (page == BRD_ZERO_CHUNK) {
+      memset(dst, 0, copy);
+    } else if (!page) {
+      copy_from_brd(dst, brd->parent_brd, sector, copy);
+    } else if (brd_sectors_valid(page, sector, copy >> SECTOR_SHIFT)) {
+      // Pairs with the barrier in brd_set_sectors_valid.
+      smp_rmb();
+      src = kmap_atomic(brd_chunk_page(page, sector));
+      memcpy(dst, src + offset, copy);
+      kunmap_atomic(src);
+    } else {
+      // Only some of these sectors were written here.
+      smp_rmb();
+      src = kmap_atomic(brd_chunk_page(page, sector));
+      for (i = 0; i < copy >> SECTOR_SHIFT; i++) {
+        if (brd_sectors_valid(page, sector + i, 1))
+          memcpy(dst + (i << SECTOR_SHIFT),
+              src + offset + (i << SECTOR_SHIFT), 1 << SECTOR_SHIFT);
+        else
+          copy_from_brd(dst + (i << SECTOR_SHIFT), brd->parent_brd,
+              sector + i, 1 << SECTOR_SHIFT);
+      }
+      kunmap_atomic(src);
+    }
+
+    dst += copy;
+    sector += copy >> SECTOR_SHIFT;
+    n -= copy;
+  }
+}
+
+/*
+ * Helper for brd_prepare_bvec for the part of a bvec that falls in a single
+ * chunk. *run is the first sector of the stretch of data before it that still
+ * needs chunks.
+ */
+static int brd_prepare_chunk(struct brd_device *brd, struct page *page,
+      unsigned int len, unsigned int off, sector_t sector, sector_t *run)
+{
+  struct page *chunk;
+  void *mem;
+  bool empty, whole, zero;
+  int error;
+
+  chunk = brd_lookup_page(brd, sector);
+  // Whether these sectors read as zeros without a chunk to hold them.
+  empty = chunk == BRD_ZERO_CHUNK || (!chunk && !brd->parent_brd);
+  whole = len == CHUNK_SECTORS << SECTOR_SHIFT &&
+    !(sector & (CHUNK_SECTORS - 1));
+  if (empty || whole) {
+    // Real data almost always has a non-zero byte near the start, so this
+    // rarely reads far.
+    mem = kmap_atomic(page);
+    zero = !memchr_inv(mem + off, 0, len);
+    kunmap_atomic(mem);
+    if (zero) {
+      error = brd_insert_pages(brd, *run, (sector - *run) << SECTOR_SHIFT);
+      *run = sector + (len >> SECTOR_SHIFT);
+      if (error || empty)
+        return error;
+      return brd_set_zero_chunk(brd, sector);
+    }
+  }
+  return brd_writable_chunk(brd, sector, chunk);
+}
+
+/*
+ * Helper for brd_prepare_write. A bvec can start anywhere in a chunk, so it is
+ * split where it crosses into the next one and each part is set up on its
+ * own.
+ */
+static int brd_prepare_bvec(struct brd_device *brd, struct page *page,
+      unsigned int len, unsigned int off, sector_t sector, sector_t *run)
+{
+  unsigned int n;
+  int error = 0;
+
+  while (len && !error) {
+    n = min_t(unsigned int, len,
+        (CHUNK_SECTORS - (sector & (CHUNK_SECTORS - 1))) << SECTOR_SHIFT);
+    error = brd_prepare_chunk(brd, page, n, off, sector, run);
+    off += n;
+    len -= n;
+    sector += n >> SECTOR_SHIFT;
+  }
+  return error;
+}
+
+/*
+ * Get brd ready for a write bio before its data is copied in. Chunks the bio
+ * fills with zeros become zero chunks, and zeros written where brd already
+ * reads as zeros are skipped, so zeroing a device by writing to it takes no
+ * memory. Everything else written gets a chunk, inserted in batches covering
+ * as many contiguous sectors as possible.
+ */
+static int brd_prepare_write(struct brd_device *brd, struct bio *bio)
+{
+  sector_t sector = bio->BI_SECTOR;
+  sector_t run = sector;
+  int error;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
+  struct bio_vec *bvec;
+  int iter;
+
+  bio_for_each_segment(bvec, bio, iter) {
+    error = brd_prepare_bvec(brd, bvec->bv_page, bvec->bv_len,
+        bvec->bv_offset, sector, &run);
+    if (error)
+      return error;
+    sector += bvec->bv_len >> SECTOR_SHIFT;
+  }
+#else
+  struct bio_vec bvec;
+  struct bvec_iter iter;
+
+  bio_for_each_segment(bvec, bio, iter) {
+    error = brd_prepare_bvec(brd, bvec.bv_page, bvec.bv_len, bvec.bv_offset,
+        sector, &run);
+    if (error)
+      return error;
+    sector += bvec.bv_len >> SECTOR_SHIFT;
+  }
+#endif
+  return brd_insert_pages(brd, run, (sector - run) << SECTOR_SHIFT);
+}
+
+/*
+ * Process a single bvec of a bio. For writes the chunks must already be in
+ * place from brd_prepare_write.
+ */
+static void brd_do_bvec(struct brd_device *brd, struct page *page,
+      unsigned int len, unsigned int off, bool is_write,
+      sector_t sector)
+{
+  void *mem;
+
+  mem = kmap_atomic(page);
+  if (!is_write) {
+    copy_from_brd(mem + off, brd, sector, len);
+    flush_dcache_page(page);
+  } else {
+    flush_dcache_page(page);
+    copy_to_brd(brd, mem + off, sector, len);
+  }
+  kunmap_atomic(mem);
+}
+
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(4, 4, 0)
+static void brd_make_request(struct request_queue *q, struct bio *bio) {
+#else
+static blk_qc_t brd_make_request(struct request_queue *q, struct bio *bio) {
+#endif
+  struct brd_device *brd = bio->BI_DISK->private_data;
+  struct brd_device *base = NULL;
+  bool rw;
+  sector_t sector;
+  int err = -EIO;
+
+  sector = bio->BI_SECTOR;
+  if (bio_end_sector(bio) > get_capacity(bio->BI_DISK)) {
+    goto out_err;
+  }
+
+  rw = BIO_IS_WRITE(bio);
+
+  if ((rw || bio->BI_RW & BIO_DISCARD_FLAG) && !brd->is_writable) {
+    goto out_err;
+  }
+
+  // Anything the bio touches that the base disk spilled is read back first.
+  base = brd_spill_hold(brd);
+  err = brd_unspill(base, sector, bio->BI_SIZE,
+      base == brd && (rw || bio->BI_RW & BIO_DISCARD_FLAG));
+  if (err) {
+    goto out_err;
+  }
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 9, 0)
+  if (unlikely(bio->BI_RW & BIO_DISCARD_FLAG)) {
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0)
+  if (unlikely(bio_op(bio) == BIO_DISCARD_FLAG)) {
+#else
+  if (unlikely(bio_op(bio) == BIO_DISCARD_FLAG ||
+        bio_op(bio) == REQ_OP_WRITE_ZEROES)) {
+#endif
+    err = discard_from_brd(brd, sector, bio->BI_SIZE);
+    if (err) {
+      goto out_err;
+    }
+    goto out;
+  }
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
+  struct bio_vec *bvec;
+  int iter;
+  // Set up every chunk the bio writes to at once instead of a page at a time.
+  if (rw) {
+    err = brd_prepare_write(brd, bio);
+    if (err) {
+      goto out_err;
+    }
+  }
+  bio_for_each_segment(bvec, bio, iter) {
+    unsigned int len = bvec->bv_len;
+    brd_do_bvec(brd, bvec->bv_page, len, bvec->bv_offset, rw, sector);
+    sector += len >> SECTOR_SHIFT;
+  }
+#else
+  struct bio_vec bvec;
+  struct bvec_iter iter;
+  // Set up every chunk the bio writes to at once instead of a page at a time.
+  if (rw) {
+    err = brd_prepare_write(brd, bio);
+    if (err) {
+      goto out_err;
+    }
+  }
+  bio_for_each_segment(bvec, bio, iter) {
+    unsigned int len = bvec.bv_len;
+    brd_do_bvec(brd, bvec.bv_page, len, bvec.bv_offset, rw, sector);
+    sector += len >> SECTOR_SHIFT;
+  }
+#endif
+
+out:
+  brd_spill_release(base);
+  BIO_ENDIO(bio, err);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+  return;
+#else
+  return BLK_QC_T_NONE;
+#endif
+out_err:
+  brd_spill_release(base);
+  BIO_IO_ERR(bio, err);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+  return BLK_QC_T_NONE;
+#endif
+}
+
+#ifdef CONFIG_BLK_DEV_XIP
+/*
+ * Look up and return a brd's chunk for a given sector.
+ * If one does not exist, allocate one filled from the parent, and insert that.
+ * Then return it.
+ */
+static struct page *brd_insert_page(struct brd_device *brd, sector_t sector)
+{
+  struct page *page;
+  sector_t first;
+  void *dst;
+  unsigned int i;
+
+  page = brd_lookup_page(brd, sector);
+  if (!page) {
+    if (brd_insert_pages(brd, sector, 1 << SECTOR_SHIFT))
+      return NULL;
+    page = brd_lookup_page(brd, sector);
+  }
+  if (brd_writable_chunk(brd, sector, page))
+    return NULL;
+  page = brd_lookup_page(brd, sector);
+
+  // The caller gets to the memory directly, so every sector has to be there.
+  first = (sector_t) page->index << CHUNK_SECTORS_SHIFT;
+  for (i = 0; i < CHUNK_SECTORS; i++) {
+    if (brd_sectors_valid(page, first + i, 1))
+      continue;
+    dst = kmap_atomic(brd_chunk_page(page, first + i));
+    copy_from_brd(dst + (((first + i) & (PAGE_SECTORS-1)) << SECTOR_SHIFT),
+        brd->parent_brd, first + i, 1 << SECTOR_SHIFT);
+    kunmap_atomic(dst);
+    brd_set_sectors_valid(page, first + i, 1);
+  }
+  return page;
+}
+
+static int brd_direct_access(struct block_device *bdev, sector_t sector,
+      void **kaddr, unsigned long *pfn)
+{
+  struct brd_device *brd = bdev->bd_disk->private_data;
+  struct page *page;
+
+  if (!brd)
+    return -ENODEV;
+  // Spilled chunks can't be handed out to be used directly.
+  if (brd_base(brd)->spilled)
+    return -EOPNOTSUPP;
+  if (sector & (PAGE_SECTORS-1))
+    return -EINVAL;
+  if (sector + PAGE_SECTORS > get_capacity(bdev->bd_disk))
+    return -ERANGE;
+  page = brd_insert_page(brd, sector);
+  if (!page)
+    return -ENOMEM;
+  page = brd_chunk_page(page, sector);
+  *kaddr = page_address(page);
+  *pfn = page_to_pfn(page);
+
+  return 0;
+}
+#endif
+
+/*
+ * Copy out the device's pages that hold something other than zeros, starting
+ * with the page at batch.start. Pages that only the parent has are not
+ * included. The device must not be written while this runs.
+ */
+static int brd_get_pages(struct brd_device *brd, void __user *arg)
+{
+  struct cow_brd_page_batch batch;
+  unsigned long long __user *offsets;
+  char __user *data;
+  struct brd_device *base;
+  pgoff_t idx, end = brd_capacity_chunks(brd);
+  sector_t sector;
+  void *buf;
+  int error = 0;
+
+  if (copy_from_user(&batch, arg, sizeof(batch)))
+    return -EFAULT;
+  // Pages of snapshot devices may only hold some of their sectors, so each
+  // one is read through copy_from_brd.
+  buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+  if (!buf)
+    return -ENOMEM;
+  offsets = (unsigned long long __user *) (uintptr_t) batch.offsets;
+  data = (char __user *) (uintptr_t) batch.data;
+
+  batch.count = 0;
+  sector = (batch.start >> SECTOR_SHIFT) & ~((sector_t) PAGE_SECTORS - 1);
+  base = brd_spill_hold(brd);
+  while (batch.count < batch.max && !error) {
+    idx = brd_chunk_index(sector);
+    if (!brd_store_next(brd, &idx))
+      idx = end;
+    // Chunks a base disk only has in spill_file count too.
+    if (brd->spilled)
+      idx = min_t(pgoff_t, idx,
+          find_next_bit(brd->spilled, end, brd_chunk_index(sector)));
+    if (idx >= end)
+      break;
+    if (idx != brd_chunk_index(sector))
+      sector = (sector_t) idx << CHUNK_SECTORS_SHIFT;
+
+    error = brd_unspill(base, sector, PAGE_SIZE, false);
+    if (error)
+      break;
+    copy_from_brd(buf, brd, sector, PAGE_SIZE);
+    if (memchr_inv(buf, 0, PAGE_SIZE)) {
+      if (put_user((unsigned long long) sector << SECTOR_SHIFT,
+            offsets + batch.count) ||
+          copy_to_user(data + batch.count * PAGE_SIZE, buf, PAGE_SIZE))
+        error = -EFAULT;
+      else
+        batch.count++;
+    }
+    sector += PAGE_SECTORS;
+  }
+  brd_spill_release(base);
+  kfree(buf);
+
+  batch.start = (unsigned long long) sector << SECTOR_SHIFT;
+  if (!error && copy_to_user(arg, &batch, sizeof(batch)))
+    error = -EFAULT;
+  return error;
+}
+
+/*
+ * Write the pages in a batch filled by COW_BRD_GET_PAGES back to the device.
+ */
+static int brd_put_pages(struct brd_device *brd, void __user *arg)
+{
+  struct cow_brd_page_batch batch;
+  unsigned long long __user *offsets;
+  char __user *data;
+  unsigned long long offset;
+  struct brd_device *base;
+  struct page *page;
+  sector_t sector;
+  void *dst;
+  unsigned int i;
+  int error = 0;
+
+  if (!brd->is_writable)
+    return -EROFS;
+  if (copy_from_user(&batch, arg, sizeof(batch)))
+    return -EFAULT;
+  offsets = (unsigned long long __user *) (uintptr_t) batch.offsets;
+  data = (char __user *) (uintptr_t) batch.data;
+
+  base = brd_spill_hold(brd);
+  for (i = 0; i < batch.count && !error; i++) {
+    if (get_user(offset, offsets + i)) {
+      error = -EFAULT;
+      break;
+    }
+    sector = offset >> SECTOR_SHIFT;
+    if (offset & (PAGE_SIZE - 1) ||
+        sector + PAGE_SECTORS > get_capacity(brd->brd_disk)) {
+      error = -EINVAL;
+      break;
+    }
+
+    error = brd_unspill(base, sector, PAGE_SIZE, base == brd);
+    if (!error)
+      error = brd_insert_pages(brd, sector, PAGE_SIZE);
+    if (!error)
+      error = brd_writable_chunk(brd, sector, brd_lookup_page(brd, sector));
+    if (error)
+      break;
+    page = brd_lookup_page(brd, sector);
+    dst = kmap(brd_chunk_page(page, sector));
+    if (copy_from_user(dst, data + i * PAGE_SIZE, PAGE_SIZE))
+      error = -EFAULT;
+    kunmap(brd_chunk_page(page, sector));
+    if (!error)
+      brd_set_sectors_valid(page, sector, PAGE_SECTORS);
+  }
+  brd_spill_release(base);
+  return error;
+}
+
+/*
+ * Fill in a struct cow_brd_stats for brd.
+ */
+static int brd_get_stats(struct brd_device *brd, void __user *arg)
+{
+  struct cow_brd_stats stats;
+  unsigned long long overridden;
+
+  memset(&stats, 0, sizeof(stats));
+  stats.capacity_pages = get_capacity(brd->brd_disk) >> PAGE_SECTORS_SHIFT;
+  stats.chunk_pages = 1 << chunk_order;
+  spin_lock(&brd->brd_lock);
+  stats.own_pages = (unsigned long long) brd->nr_chunks << chunk_order;
+  stats.zero_pages = (unsigned long long) brd->nr_zero_chunks << chunk_order;
+  stats.shared_pages =
+    (unsigned long long) brd->nr_shared_chunks << chunk_order;
+  stats.free_pages = (unsigned long long) brd->nr_free_pages << chunk_order;
+  stats.cow_copies = brd->cow_copies;
+  stats.spilled_pages = (unsigned long long) brd->nr_spilled << chunk_order;
+  stats.restores = brd->nr_restores;
+  stats.restore_ns = brd->restore_ns;
+  spin_unlock(&brd->brd_lock);
+
+  overridden = stats.own_pages + stats.zero_pages + stats.shared_pages;
+  if (brd->parent_brd && stats.capacity_pages > overridden)
+    stats.inherited_pages = stats.capacity_pages - overridden;
+
+  if (copy_to_user(arg, &stats, sizeof(stats)))
+    return -EFAULT;
+  return 0;
+}
+
+/*
+ * Make sure brd has a chunk it can write in place for every sector in the n
+ * bytes starting at sector.
+ */
+static int brd_prepare_range(struct brd_device *brd, sector_t sector,
+    size_t n)
+{
+  sector_t end = sector + (n >> SECTOR_SHIFT);
+  int error;
+
+  error = brd_insert_pages(brd, sector, n);
+  while (!error && sector < end) {
+    error = brd_writable_chunk(brd, sector, brd_lookup_page(brd, sector));
+    sector = (sector | (CHUNK_SECTORS - 1)) + 1;
+  }
+  return error;
+}
+
+/*
+ * Copy size bytes from user memory at src to the device starting at sector.
+ */
+static int brd_write_user(struct brd_device *brd, sector_t sector,
+    const char __user *src, unsigned int size)
+{
+  struct page *page;
+  void *dst;
+  unsigned int offset, len;
+  int error;
+
+  error = brd_insert_pages(brd, sector, size);
+  while (size && !error) {
+    offset = (sector & (PAGE_SECTORS-1)) << SECTOR_SHIFT;
+    len = min_t(unsigned int, size, PAGE_SIZE - offset);
+    error = brd_writable_chunk(brd, sector, brd_lookup_page(brd, sector));
+    if (error)
+      break;
+    page = brd_lookup_page(brd, sector);
+    if (!page)
+      return -EIO;
+
+    // copy_from_user can fault, so this can't use kmap_atomic.
+    dst = kmap(brd_chunk_page(page, sector));
+    if (copy_from_user(dst + offset, src, len))
+      error = -EFAULT;
+    kunmap(brd_chunk_page(page, sector));
+    if (error)
+      break;
+    brd_set_sectors_valid(page, sector, len >> SECTOR_SHIFT);
+
+    src += len;
+    sector += len >> SECTOR_SHIFT;
+    size -= len;
+  }
+  return error;
+}
+
+/*
+ * Apply a crash state given as a struct cow_brd_write_vec directly to brd's
+ * pages, without going through the block layer or the page cache. Pages of
+ * the device left in the page cache are dropped afterwards so later reads
+ * see the new contents.
+ */
+static int brd_write_vec(struct brd_device *brd, struct block_device *bdev,
+    void __user *arg)
+{
+  struct cow_brd_write_vec vec;
+  struct cow_brd_write __user *writes;
+  struct cow_brd_write w;
+  struct brd_device *base;
+  sector_t sector;
+  int error = 0;
+
+  if (!brd->is_writable)
+    return -EROFS;
+  if (copy_from_user(&vec, arg, sizeof(vec)))
+    return -EFAULT;
+  writes = (struct cow_brd_write __user *) (uintptr_t) vec.writes;
+
+  base = brd_spill_hold(brd);
+  for (vec.done = 0; vec.done < vec.count; vec.done++) {
+    if (copy_from_user(&w, writes + vec.done, sizeof(w))) {
+      error = -EFAULT;
+      break;
+    }
+    sector = w.offset >> SECTOR_SHIFT;
+    if ((w.offset | w.size) & ((1 << SECTOR_SHIFT) - 1) ||
+        sector + (w.size >> SECTOR_SHIFT) > get_capacity(brd->brd_disk)) {
+      error = -EINVAL;
+      break;
+    }
+    if (w.op != HWM_OP_WRITE_STUB)
+      error = brd_unspill(base, sector, w.size, base == brd);
+    if (error)
+      break;
+    switch (w.op) {
+      case HWM_OP_WRITE:
+        error = brd_write_user(brd, sector,
+            (const char __user *) (uintptr_t) w.data, w.size);
+        break;
+      case HWM_OP_DISCARD:
+      case HWM_OP_WRITE_ZEROES:
+        error = discard_from_brd(brd, sector, w.size);
+        break;
+      case HWM_OP_WRITE_STUB:
+        // The data was never recorded.
+        break;
+      default:
+        error = -EINVAL;
+    }
+    if (error)
+      break;
+  }
+  brd_spill_release(base);
+
+  invalidate_bdev(bdev);
+  if (copy_to_user(arg, &vec, sizeof(vec)) && !error)
+    error = -EFAULT;
+  return error;
+}
+
+/*
+ * A copy of a recorded workload kept with a base disk, so crash states of it
+ * can be built with COW_BRD_APPLY_STATE without copying the data in from
+ * user space each time. The data of each entry is at its data offset in data.
+ * Devices applying a crash state hold a reference so the log can be replaced
+ * while they do.
+ */
+struct brd_log_entry {
+  sector_t sector;
+  size_t data;
+  unsigned int size;
+  unsigned int op;
+};
+
+struct brd_log {
+  struct kref ref;
+  unsigned int count;
+  struct brd_log_entry *entries;
+  char *data;
+};
+
+static void brd_log_release(struct kref *ref)
+{
+  struct brd_log *log = container_of(ref, struct brd_log, ref);
+
+  // Wait out anyone who found the log under RCU before it was replaced and
+  // is about to see its count is already zero.
+  synchronize_rcu();
+  vfree(log->entries);
+  vfree(log->data);
+  kfree(log);
+}
 
-  if (copy < n) {
-    dst += copy;
-    sector += copy >> SECTOR_SHIFT;
-    copy = n - copy;
-    page = brd_lookup_page(brd, sector);
-    if (page) {
-      // Present in the new radix tree so this page has been modified.
-      src = kmap_atomic(page);
-      memcpy(dst, src, copy);
-      kunmap_atomic(src);
-    } else if (brd->parent_brd &&
-        (page = brd_lookup_page(brd->parent_brd, sector))) {
-      // Present in the old radix tree so this page has not been modified.
-      src = kmap_atomic(page);
-      memcpy(dst, src, copy);
-      kunmap_atomic(src);
-    } else {
-      // Page doesn't exist in either radix tree so it must never have been
-      // written.
-      memset(dst, 0, copy);
-    }
-  }
+static void brd_put_log(struct brd_log *log)
+{
+  if (log)
+    kref_put(&log->ref, brd_log_release);
 }
 
 /*
- * Process a single bvec of a bio.
+ * Copy the entries described by a struct cow_brd_write_vec, and the data they
+ * point to, into a new log.
  */
-static int brd_do_bvec(struct brd_device *brd, struct page *page,
-      unsigned int len, unsigned int off, bool is_write,
-      sector_t sector)
+static struct brd_log *brd_copy_log(struct brd_device *brd,
+    struct cow_brd_write_vec *vec)
 {
-  void *mem;
-  int err = 0;
+  struct cow_brd_write __user *writes;
+  struct cow_brd_write w;
+  struct brd_log_entry *e;
+  struct brd_log *log;
+  size_t total = 0;
+  unsigned int i;
+  int error = 0;
+
+  log = kzalloc(sizeof(*log), GFP_KERNEL);
+  if (!log)
+    return ERR_PTR(-ENOMEM);
+  kref_init(&log->ref);
+  log->count = vec->count;
+  log->entries = vmalloc((size_t) vec->count * sizeof(*log->entries));
+  if (!log->entries) {
+    error = -ENOMEM;
+    goto out;
+  }
 
-  if (is_write) {
-    err = copy_to_brd_setup(brd, sector, len);
-    if (err)
+  // Find out how much data there is before copying it all in.
+  writes = (struct cow_brd_write __user *) (uintptr_t) vec->writes;
+  for (i = 0; i < vec->count; i++) {
+    if (copy_from_user(&w, writes + i, sizeof(w))) {
+      error = -EFAULT;
+      goto out;
+    }
+    if ((w.offset | w.size) & ((1 << SECTOR_SHIFT) - 1) ||
+        (w.offset >> SECTOR_SHIFT) + (w.size >> SECTOR_SHIFT) >
+        get_capacity(brd->brd_disk)) {
+      error = -EINVAL;
       goto out;
+    }
+    e = &log->entries[i];
+    e->sector = w.offset >> SECTOR_SHIFT;
+    e->size = w.size;
+    e->op = w.op;
+    e->data = total;
+    if (w.op == HWM_OP_WRITE)
+      total += w.size;
   }
 
-  mem = kmap_atomic(page);
-  if (!is_write) {
-    copy_from_brd(mem + off, brd, sector, len);
-    flush_dcache_page(page);
-  } else {
-    flush_dcache_page(page);
-    copy_to_brd(brd, mem + off, sector, len);
+  log->data = vmalloc(max_t(size_t, total, 1));
+  if (!log->data) {
+    error = -ENOMEM;
+    goto out;
   }
-  kunmap_atomic(mem);
+  for (i = 0; i < vec->count; i++) {
+    e = &log->entries[i];
+    if (e->op != HWM_OP_WRITE)
+      continue;
+    if (copy_from_user(&w, writes + i, sizeof(w)) ||
+        copy_from_user(log->data + e->data,
+          (const void __user *) (uintptr_t) w.data, e->size)) {
+      error = -EFAULT;
+      goto out;
+    }
+  }
+  return log;
 
 out:
-  return err;
+  brd_put_log(log);
+  return ERR_PTR(error);
 }
 
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(4, 4, 0)
-static void brd_make_request(struct request_queue *q, struct bio *bio) {
-#else
-static blk_qc_t brd_make_request(struct request_queue *q, struct bio *bio) {
-#endif
-  struct brd_device *brd = bio->BI_DISK->private_data;
-  bool rw;
-  sector_t sector;
-  int err = -EIO;
-
-  sector = bio->BI_SECTOR;
-  if (bio_end_sector(bio) > get_capacity(bio->BI_DISK)) {
-    goto out_err;
+/*
+ * Replace the log registered with the base disk brd.
+ */
+static int brd_register_log(struct brd_device *brd, void __user *arg)
+{
+  struct cow_brd_write_vec vec;
+  struct brd_log *log = NULL, *old;
+
+  if (copy_from_user(&vec, arg, sizeof(vec)))
+    return -EFAULT;
+  if (vec.count) {
+    log = brd_copy_log(brd, &vec);
+    if (IS_ERR(log))
+      return PTR_ERR(log);
   }
 
-  rw = BIO_IS_WRITE(bio);
+  mutex_lock(&brd_devices_mutex);
+  old = rcu_dereference_protected(brd->log,
+      lockdep_is_held(&brd_devices_mutex));
+  rcu_assign_pointer(brd->log, log);
+  mutex_unlock(&brd_devices_mutex);
+  brd_put_log(old);
+  return 0;
+}
 
-  if ((rw || bio->BI_RW & BIO_DISCARD_FLAG) && !brd->is_writable) {
-    goto out_err;
-  }
+/*
+ * Write the crash state described by a struct cow_brd_state to brd, taking
+ * the data from the log registered with its base disk.
+ */
+static int brd_apply_state(struct brd_device *brd, struct block_device *bdev,
+    void __user *arg)
+{
+  struct cow_brd_state state;
+  struct cow_brd_state_piece __user *pieces;
+  struct cow_brd_state_piece piece;
+  struct brd_device *base;
+  struct brd_log *log;
+  struct brd_log_entry *e;
+  sector_t sector;
+  int error = 0;
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 9, 0)
-  if (unlikely(bio->BI_RW & BIO_DISCARD_FLAG)) {
-#else
-  if (unlikely(bio_op(bio) == BIO_DISCARD_FLAG)) {
-#endif
-    err = 0;
-    discard_from_brd(brd, sector, bio->BI_SIZE);
-    goto out;
-  }
+  if (!brd->is_writable)
+    return -EROFS;
+  if (copy_from_user(&state, arg, sizeof(state)))
+    return -EFAULT;
 
-#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)
-  struct bio_vec *bvec;
-  int iter;
-  bio_for_each_segment(bvec, bio, iter) {
-    unsigned int len = bvec->bv_len;
-    err = brd_do_bvec(brd, bvec->bv_page, len,
-          bvec->bv_offset, rw, sector);
-    if (err) {
-      goto out_err;
+  // Devices applying crash states at the same time only share a reference
+  // count here.
+  rcu_read_lock();
+  log = rcu_dereference(brd_base(brd)->log);
+  if (log && !kref_get_unless_zero(&log->ref))
+    log = NULL;
+  rcu_read_unlock();
+  if (!log)
+    return -ENOENT;
+
+  pieces = (struct cow_brd_state_piece __user *) (uintptr_t) state.pieces;
+  base = brd_spill_hold(brd);
+  for (state.done = 0; state.done < state.count; state.done++) {
+    if (copy_from_user(&piece, pieces + state.done, sizeof(piece))) {
+      error = -EFAULT;
+      break;
     }
-    sector += len >> SECTOR_SHIFT;
-  }
-#else
-  struct bio_vec bvec;
-  struct bvec_iter iter;
-  bio_for_each_segment(bvec, bio, iter) {
-    unsigned int len = bvec.bv_len;
-    err = brd_do_bvec(brd, bvec.bv_page, len,
-          bvec.bv_offset, rw, sector);
-    if (err) {
-      goto out_err;
+    if (piece.index >= log->count) {
+      error = -EINVAL;
+      break;
     }
-    sector += len >> SECTOR_SHIFT;
+    e = &log->entries[piece.index];
+    if ((piece.offset | piece.size) & ((1 << SECTOR_SHIFT) - 1) ||
+        piece.offset > e->size || piece.size > e->size - piece.offset) {
+      error = -EINVAL;
+      break;
+    }
+    sector = e->sector + (piece.offset >> SECTOR_SHIFT);
+    if (e->op != HWM_OP_WRITE_STUB)
+      error = brd_unspill(base, sector, piece.size, base == brd);
+    if (error)
+      break;
+    switch (e->op) {
+      case HWM_OP_WRITE:
+        error = brd_prepare_range(brd, sector, piece.size);
+        if (!error)
+          copy_to_brd(brd, log->data + e->data + piece.offset, sector,
+              piece.size);
+        break;
+      case HWM_OP_DISCARD:
+      case HWM_OP_WRITE_ZEROES:
+        error = discard_from_brd(brd, sector, piece.size);
+        break;
+      default:
+        // Stubs of writes whose data was never recorded.
+        break;
+    }
+    if (error)
+      break;
   }
-#endif
+  brd_spill_release(base);
+  brd_put_log(log);
 
-out:
-  BIO_ENDIO(bio, err);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
-  return;
-#else
-  return BLK_QC_T_NONE;
-#endif
-out_err:
-  BIO_IO_ERR(bio, err);
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
-  return BLK_QC_T_NONE;
-#endif
+  invalidate_bdev(bdev);
+  if (copy_to_user(arg, &state, sizeof(state)) && !error)
+    error = -EFAULT;
+  return error;
 }
 
-#ifdef CONFIG_BLK_DEV_XIP
-static int brd_direct_access(struct block_device *bdev, sector_t sector,
-      void **kaddr, unsigned long *pfn)
+static const struct block_device_operations brd_fops;
+static int brd_new_snapshot(struct brd_device *base, void __user *arg);
+static int brd_del_snapshot(struct brd_device *base, unsigned int number);
+
+/*
+ * Make the device open at fd the parent of the snapshot device brd and drop
+ * everything brd has written so it reads the same as its new parent. The new
+ * parent must be a frozen cow_brd device on the same base disk. brd itself
+ * must not be the parent of anything, which also means it can't be one of
+ * the new parent's ancestors.
+ */
+static int brd_set_parent(struct brd_device *brd, unsigned int fd)
 {
-  struct brd_device *brd = bdev->bd_disk->private_data;
-  struct page *page;
+  struct fd f;
+  struct inode *inode;
+  struct brd_device *parent, *base, *parent_base;
+  int error = 0;
 
-  if (!brd)
-    return -ENODEV;
-  if (sector & (PAGE_SECTORS-1))
+  f = fdget(fd);
+  if (!f.file)
+    return -EBADF;
+  inode = file_inode(f.file);
+  if (!S_ISBLK(inode->i_mode) ||
+      I_BDEV(inode)->bd_disk->fops != &brd_fops) {
+    fdput(f);
     return -EINVAL;
-  if (sector + PAGE_SECTORS > get_capacity(bdev->bd_disk))
-    return -ERANGE;
-  page = brd_insert_page(brd, sector);
-  if (!page)
-    return -ENOMEM;
-  *kaddr = page_address(page);
-  *pfn = page_to_pfn(page);
+  }
+  parent = I_BDEV(inode)->bd_disk->private_data;
 
-  return 0;
+  mutex_lock(&brd_devices_mutex);
+  for (base = brd; base->parent_brd; base = base->parent_brd)
+    ;
+  for (parent_base = parent; parent_base->parent_brd;
+      parent_base = parent_base->parent_brd)
+    ;
+  if (parent == brd || base != parent_base || parent->is_writable) {
+    error = -EINVAL;
+    goto out;
+  }
+  if (brd->nr_children || brd->restoring || parent->restoring) {
+    error = -EBUSY;
+    goto out;
+  }
+
+  brd->parent_brd->nr_children--;
+  brd->parent_brd = parent;
+  parent->nr_children++;
+  brd->restoring = true;
+
+out:
+  mutex_unlock(&brd_devices_mutex);
+  fdput(f);
+  if (!error)
+    brd_restore(brd);
+  return error;
 }
-#endif
 
 static int brd_ioctl(struct block_device *bdev, fmode_t mode,
       unsigned int cmd, unsigned long arg)
@@ -475,29 +2148,90 @@ static int brd_ioctl(struct block_device *bdev, fmode_t mode,
 
   switch (cmd) {
     case COW_BRD_SNAPSHOT:
+      // On a snapshot device this freezes it so it can be the parent of
+      // other snapshot devices.
+      brd->is_writable = false;
+      break;
+    case COW_BRD_UNSNAPSHOT:
+      mutex_lock(&brd_devices_mutex);
+      // Children of a frozen snapshot device rely on it not changing.
+      if (brd->is_snapshot && brd->nr_children) {
+        error = -EBUSY;
+      } else {
+        brd->is_writable = true;
+      }
+      mutex_unlock(&brd_devices_mutex);
+      break;
+    case COW_BRD_RESTORE_SNAPSHOT:
+      if (!brd->is_snapshot) {
+        return -ENOTTY;
+      }
+      mutex_lock(&brd_devices_mutex);
+      if (brd->nr_children || brd->restoring) {
+        error = -EBUSY;
+      } else {
+        brd->restoring = true;
+      }
+      mutex_unlock(&brd_devices_mutex);
+      // Keep the pages around since the next crash state will need about as
+      // many.
+      if (!error) {
+        brd_restore(brd);
+      }
+      break;
+    case COW_BRD_SET_PARENT:
+      if (!brd->is_snapshot) {
+        return -ENOTTY;
+      }
+      error = brd_set_parent(brd, arg);
+      break;
+    case COW_BRD_NEW_SNAPSHOT:
       if (brd->is_snapshot) {
         return -ENOTTY;
       }
-      brd->is_writable = false;
+      error = brd_new_snapshot(brd, (void __user *) arg);
       break;
-    case COW_BRD_UNSNAPSHOT:
+    case COW_BRD_DEL_SNAPSHOT:
       if (brd->is_snapshot) {
         return -ENOTTY;
       }
-      brd->is_writable = true;
+      error = brd_del_snapshot(brd, arg);
       break;
-    case COW_BRD_RESTORE_SNAPSHOT:
+    case COW_BRD_GET_PAGES:
+      error = brd_get_pages(brd, (void __user *) arg);
+      break;
+    case COW_BRD_PUT_PAGES:
+      error = brd_put_pages(brd, (void __user *) arg);
+      break;
+    case COW_BRD_REGISTER_LOG:
+      if (brd->is_snapshot) {
+        return -ENOTTY;
+      }
+      error = brd_register_log(brd, (void __user *) arg);
+      break;
+    case COW_BRD_APPLY_STATE:
+      error = brd_apply_state(brd, bdev, (void __user *) arg);
+      break;
+    case COW_BRD_WRITE_VEC:
+      error = brd_write_vec(brd, bdev, (void __user *) arg);
+      break;
+    case COW_BRD_GET_STATS:
+      error = brd_get_stats(brd, (void __user *) arg);
+      break;
+    case COW_BRD_DEDUPE:
       if (!brd->is_snapshot) {
         return -ENOTTY;
       }
-      brd_free_pages(brd);
+      if (!dedupe) {
+        return -EOPNOTSUPP;
+      }
+      error = brd_dedupe(brd);
       break;
     case COW_BRD_WIPE:
       if (brd->is_snapshot) {
         return -ENOTTY;
       }
-      // Assumes no snapshots are being used right now.
-      brd_free_pages(brd);
+      brd_wipe(brd);
       break;
     default:
       error = -ENOTTY;
@@ -506,8 +2240,33 @@ static int brd_ioctl(struct block_device *bdev, fmode_t mode,
   return error;
 }
 
+static int brd_open(struct block_device *bdev, fmode_t mode)
+{
+  struct brd_device *brd = bdev->bd_disk->private_data;
+  int error = 0;
+
+  spin_lock(&brd->brd_lock);
+  if (brd->deleting)
+    error = -ENXIO;
+  else
+    brd->nr_open++;
+  spin_unlock(&brd->brd_lock);
+  return error;
+}
+
+static void brd_release(struct gendisk *disk, fmode_t mode)
+{
+  struct brd_device *brd = disk->private_data;
+
+  spin_lock(&brd->brd_lock);
+  brd->nr_open--;
+  spin_unlock(&brd->brd_lock);
+}
+
 static const struct block_device_operations brd_fops = {
   .owner =    THIS_MODULE,
+  .open =     brd_open,
+  .release =  brd_release,
   .ioctl =    brd_ioctl,
 #ifdef CONFIG_BLK_DEV_XIP
   .direct_access =  brd_direct_access,
@@ -532,6 +2291,17 @@ module_param(disk_size, int, S_IRUGO);
 MODULE_PARM_DESC(disk_size, "Size of each RAM disk in kbytes.");
 module_param(max_part, int, S_IRUGO);
 MODULE_PARM_DESC(max_part, "Maximum number of partitions per RAM disk");
+module_param(chunk_order, int, S_IRUGO);
+MODULE_PARM_DESC(chunk_order, "Back RAM disks with chunks of 2^chunk_order "
+    "pages (4 for 64K and 9 for 2M chunks with 4K pages)");
+module_param(dedupe, bool, S_IRUGO);
+MODULE_PARM_DESC(dedupe, "Let COW_BRD_DEDUPE share identical chunks between "
+    "snapshot devices");
+module_param(budget, int, S_IRUGO);
+MODULE_PARM_DESC(budget, "Most memory in kbytes each RAM disk keeps its pages "
+    "in, with the rest in spill_file (0 for no limit)");
+module_param(spill_file, charp, S_IRUGO);
+MODULE_PARM_DESC(spill_file, "File RAM disk pages past the budget go to");
 MODULE_LICENSE("GPL");
 MODULE_ALIAS_BLOCKDEV_MAJOR(RAMDISK_MAJOR);
 
@@ -550,7 +2320,6 @@ __setup("ramdisk_size=", ramdisk_size);
  * (should share code eventually).
  */
 static LIST_HEAD(brd_devices);
-static DEFINE_MUTEX(brd_devices_mutex);
 
 static struct brd_device *brd_alloc(int i)
 {
@@ -567,7 +2336,9 @@ static struct brd_device *brd_alloc(int i)
   brd->is_snapshot  = i >= num_disks;
 
   spin_lock_init(&brd->brd_lock);
-  INIT_RADIX_TREE(&brd->brd_pages, GFP_ATOMIC);
+  brd_store_init(brd);
+  INIT_LIST_HEAD(&brd->dirty_pages);
+  INIT_LIST_HEAD(&brd->free_pages);
 
   brd->brd_queue = blk_alloc_queue(GFP_KERNEL);
   if (!brd->brd_queue)
@@ -588,6 +2359,10 @@ static struct brd_device *brd_alloc(int i)
 #else
   queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, brd->brd_queue);
 #endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
+  // Handled like discards instead of the block layer writing zero pages.
+  blk_queue_max_write_zeroes_sectors(brd->brd_queue, UINT_MAX);
+#endif
 
   disk = brd->brd_disk = alloc_disk(1 << part_shift);
   if (!disk)
@@ -606,8 +2381,23 @@ static struct brd_device *brd_alloc(int i)
   }
   set_capacity(disk, disk_size * 2);
 
+  if (brd_spill_file && !brd->is_snapshot) {
+    brd->spilled = vzalloc(BITS_TO_LONGS(brd_capacity_chunks(brd)) *
+        sizeof(unsigned long));
+    if (!brd->spilled)
+      goto out_free_disk;
+    brd->spill_base = (loff_t) i * brd_capacity_chunks(brd) <<
+      (PAGE_SHIFT + chunk_order);
+    if (percpu_init_rwsem(&brd->spill_sem)) {
+      vfree(brd->spilled);
+      goto out_free_disk;
+    }
+  }
+
   return brd;
 
+out_free_disk:
+  put_disk(disk);
 out_free_queue:
   blk_cleanup_queue(brd->brd_queue);
 out_free_dev:
@@ -621,6 +2411,11 @@ static void brd_free(struct brd_device *brd)
   put_disk(brd->brd_disk);
   blk_cleanup_queue(brd->brd_queue);
   brd_free_pages(brd);
+  if (brd->spilled) {
+    percpu_free_rwsem(&brd->spill_sem);
+    vfree(brd->spilled);
+  }
+  brd_put_log(rcu_dereference_protected(brd->log, 1));
   kfree(brd);
 }
 
@@ -644,6 +2439,7 @@ static struct brd_device *brd_init_one(int i)
       list_for_each_entry(parent_brd, &brd_devices, brd_list) {
         if (parent_brd->brd_number == i % num_disks) {
           brd->parent_brd = parent_brd;
+          parent_brd->nr_children++;
           break;
         }
       }
@@ -662,6 +2458,106 @@ static void brd_del_one(struct brd_device *brd)
   brd_free(brd);
 }
 
+/*
+ * Must be called with brd_devices_mutex held.
+ */
+static struct brd_device *brd_find(int i)
+{
+  struct brd_device *brd;
+
+  list_for_each_entry(brd, &brd_devices, brd_list) {
+    if (brd->brd_number == i)
+      return brd;
+  }
+  return NULL;
+}
+
+/*
+ * Add a new snapshot device of the base disk and tell user space its number
+ * and name. Snapshot devices of base disk b are numbered b + k * num_disks,
+ * so the new one takes the lowest such number not in use.
+ */
+static int brd_new_snapshot(struct brd_device *base, void __user *arg)
+{
+  struct cow_brd_snapshot snap;
+  struct brd_device *brd;
+  int i;
+
+  mutex_lock(&brd_devices_mutex);
+  for (i = base->brd_number + num_disks; brd_find(i); i += num_disks)
+    ;
+  if ((i + 1UL) << part_shift > 1UL << MINORBITS) {
+    mutex_unlock(&brd_devices_mutex);
+    return -ENOSPC;
+  }
+  brd = brd_alloc(i);
+  if (!brd) {
+    mutex_unlock(&brd_devices_mutex);
+    return -ENOMEM;
+  }
+
+  memset(&snap, 0, sizeof(snap));
+  snap.number = i;
+  strlcpy(snap.name, brd->brd_disk->disk_name, sizeof(snap.name));
+  if (copy_to_user(arg, &snap, sizeof(snap))) {
+    mutex_unlock(&brd_devices_mutex);
+    brd_free(brd);
+    return -EFAULT;
+  }
+
+  brd->parent_brd = base;
+  base->nr_children++;
+  list_add_tail(&brd->brd_list, &brd_devices);
+  mutex_unlock(&brd_devices_mutex);
+
+  add_disk(brd->brd_disk);
+  return 0;
+}
+
+/*
+ * Tear down a snapshot device made from base. It must not be open or have
+ * any snapshot devices branched off of it.
+ */
+static int brd_del_snapshot(struct brd_device *base, unsigned int number)
+{
+  struct brd_device *brd, *root;
+  int error = 0;
+
+  mutex_lock(&brd_devices_mutex);
+  brd = brd_find(number);
+  if (!brd || !brd->is_snapshot) {
+    error = -ENXIO;
+    goto out;
+  }
+  for (root = brd; root->parent_brd; root = root->parent_brd)
+    ;
+  if (root != base) {
+    error = -EINVAL;
+    goto out;
+  }
+
+  spin_lock(&brd->brd_lock);
+  if (brd->nr_open || brd->nr_children)
+    error = -EBUSY;
+  else
+    brd->deleting = true;
+  spin_unlock(&brd->brd_lock);
+  if (error)
+    goto out;
+
+  list_del(&brd->brd_list);
+  brd->parent_brd->nr_children--;
+  mutex_unlock(&brd_devices_mutex);
+
+  del_gendisk(brd->brd_disk);
+  brd_free(brd);
+  return 0;
+
+out:
+  mutex_unlock(&brd_devices_mutex);
+  return error;
+}
+
 static struct kobject *brd_probe(dev_t dev, int *part, void *data)
 {
   struct brd_device *brd;
@@ -692,9 +2588,30 @@ static int __init brd_init(void)
   unsigned long range;
   struct brd_device *brd, *next, *parent_brd;
 
+  if (chunk_order < 0 || chunk_order >= MAX_ORDER) {
+    printk(KERN_WARNING DEVICE_NAME ": chunk_order must be below %d\n",
+        MAX_ORDER);
+    return -EINVAL;
+  }
+
+  if (budget < 0 || (budget && !spill_file)) {
+    printk(KERN_WARNING DEVICE_NAME ": budget needs a spill_file\n");
+    return -EINVAL;
+  }
+  if (budget) {
+    brd_spill_file = filp_open(spill_file,
+        O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0600);
+    if (IS_ERR(brd_spill_file)) {
+      printk(KERN_WARNING DEVICE_NAME ": unable to open %s\n", spill_file);
+      return PTR_ERR(brd_spill_file);
+    }
+  }
+
   major_num = register_blkdev(major_num, DEVICE_NAME);
   if (major_num <= 0) {
     printk(KERN_WARNING DEVICE_NAME ": unable to get major number\n");
+    if (brd_spill_file)
+      filp_close(brd_spill_file, NULL);
     return -EIO;
   }
 
@@ -752,6 +2669,7 @@ static int __init brd_init(void)
       list_for_each_entry(parent_brd, &brd_devices, brd_list) {
         if (parent_brd->brd_number == i % num_disks) {
           brd->parent_brd = parent_brd;
+          parent_brd->nr_children++;
           break;
         }
       }
@@ -778,6 +2696,8 @@ out_free:
     brd_free(brd);
   }
   unregister_blkdev(major_num, DEVICE_NAME);
+  if (brd_spill_file)
+    filp_close(brd_spill_file, NULL);
 
   return -ENOMEM;
 }
@@ -794,6 +2714,8 @@ static void __exit brd_exit(void)
 
   blk_unregister_region(MKDEV(major_num, 0), range);
   unregister_blkdev(major_num, DEVICE_NAME);
+  if (brd_spill_file)
+    filp_close(brd_spill_file, NULL);
   printk(KERN_INFO DEVICE_NAME ": module unloaded\n");
 }
 
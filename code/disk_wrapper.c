@@ -1,14 +1,29 @@
 #include <linux/blkdev.h>
 #include <linux/errno.h>
 #include <linux/fs.h>
+#include <linux/hashtable.h>
 #include <linux/init.h>
 #include <linux/ioctl.h>
+#include <linux/jhash.h>
 #include <linux/kernel.h>
 #include <linux/ktime.h>
+#include <linux/llist.h>
+#include <linux/log2.h>
+#include <linux/mempool.h>
+#include <linux/miscdevice.h>
 #include <linux/mm.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/poll.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "disk_wrapper_ioctl.h"
 #include "bio_alias.h"
@@ -19,11 +34,56 @@ MODULE_LICENSE("GPL");
 MODULE_AUTHOR("ashmrtn");
 MODULE_DESCRIPTION("test hello world");
 
-static char* target_device_path = "";
-module_param(target_device_path, charp, 0);
+// Most wrapper devices one instance of the module can make.
+#define HWM_MAX_DEVICES 16
 
-static char* flags_device_path = "";
-module_param(flags_device_path, charp, 0);
+// A wrapper device /dev/hwm<i> is made for each of the comma separated target
+// devices. Each is given the queue flags of the flags device at the same
+// position, or of the only flags device if just one is given.
+static char* target_device_path[HWM_MAX_DEVICES];
+static int num_target_devices;
+module_param_array(target_device_path, charp, &num_target_devices, 0);
+MODULE_PARM_DESC(target_device_path, "devices to wrap");
+
+static char* flags_device_path[HWM_MAX_DEVICES];
+static int num_flags_devices;
+module_param_array(flags_device_path, charp, &num_flags_devices, 0);
+MODULE_PARM_DESC(flags_device_path, "devices to copy queue flags from");
+
+// Size of the data area of the log ring. Rounded up to a power of two. 0
+// disables the ring so all entries stay on the in-kernel list.
+static unsigned int ring_size_kb = 16384;
+module_param(ring_size_kb, uint, 0);
+MODULE_PARM_DESC(ring_size_kb, "size of each /dev/hwm_ring<i> log ring in KiB");
+
+// Pages held in reserve for logged data so recording doesn't lose bios when
+// the page allocator can't keep up.
+static unsigned int pool_pages = 4096;
+module_param(pool_pages, uint, 0);
+MODULE_PARM_DESC(pool_pages, "pages each device keeps for logged data");
+
+// Once a device's log holds more than log_mem_kb of data, older entries are
+// written to the file or device at the same position in spill_path and read
+// back from there when user-land drains the log. 0 means no limit.
+static unsigned int log_mem_kb = 0;
+module_param(log_mem_kb, uint, 0644);
+MODULE_PARM_DESC(log_mem_kb, "KiB of logged data to keep in memory");
+
+static char* spill_path[HWM_MAX_DEVICES];
+static int num_spill_paths;
+module_param_array(spill_path, charp, &num_spill_paths, 0);
+MODULE_PARM_DESC(spill_path, "files or devices to spill logged data to");
+
+// Store only one copy of pages with the same contents in a recording. Ignored
+// on devices that spill to stay under log_mem_kb.
+static bool dedupe_data = false;
+module_param(dedupe_data, bool, 0644);
+MODULE_PARM_DESC(dedupe_data, "share logged pages with identical contents");
+
+// Print every logged bio to the kernel log. Slows recording down a lot.
+static bool verbose = false;
+module_param(verbose, bool, 0644);
+MODULE_PARM_DESC(verbose, "print every logged bio to the kernel log");
 
 const char* const flag_names[] = {
   "write", "fail fast dev", "fail fast transport", "fail fast driver", "sync",
@@ -34,20 +94,75 @@ const char* const flag_names[] = {
   "nr bits"
 };
 
+// Entry in the table of logged pages used to find duplicate data.
+struct hwm_dedupe_page {
+  struct hlist_node node;
+  u32 hash;
+  // Page this entry added to the table, NULL if the page was a duplicate or
+  // all zeros.
+  struct page* page;
+};
+
 struct disk_write_op {
   struct disk_write_op_meta metadata;
-  void* data;
+  // Logged data, split across order-0 pages from dev->page_pool so large
+  // bios don't need large contiguous allocations. Pages that are all zeros
+  // are left NULL.
+  struct page** pages;
+  unsigned int nr_pages;
+  // If set, the pages are shared through the dedupe table and the entry only
+  // owns the pages in these table entries.
+  struct hwm_dedupe_page* dedupe;
+  // Pages counted against log_mem_kb.
+  unsigned int owned_pages;
+  // Set once the data has been written to the spill file, in which case pages
+  // is NULL and page i of the data is at spill_offset + i * PAGE_SIZE unless
+  // bit i is set, meaning it is all zeros.
+  unsigned long* zero_map;
+  loff_t spill_offset;
+  // Data of HWM_OP_WRITE_STUB entries.
+  unsigned long long stub_hash;
+  // Order the entry was added to the log in across all CPUs.
+  unsigned long long seq;
   struct disk_write_op* next;
 };
 
+// Swapped in for the bi_end_io of a logged bio so its completion can be
+// recorded. Kept until HWM_GET_DONE hands the record to user-land.
+struct hwm_bio_hook {
+  struct llist_node node;
+  struct hwm_device* dev;
+  bio_end_io_t* end_io;
+  void* private;
+  struct hwm_done done;
+};
+
+static struct kmem_cache* hwm_hook_cache;
+
+// New log entries go on a list for the CPU that logged them so bios on
+// different CPUs don't fight over one lock. They are merged into the device's
+// list in seq order when user-land drains the log.
+struct hwm_cpu_log {
+  spinlock_t lock;
+  struct disk_write_op* head;
+  struct disk_write_op* tail;
+};
+
 static int major_num = 0;
 
-static struct hwm_device {
+// Everything one wrapper device needs, so several can record at once without
+// sharing any state.
+struct hwm_device {
+  int index;
   unsigned long size;
   spinlock_t lock;
   u8* data;
   struct gendisk* gd;
+  bool disk_added;
   bool log_on;
+  // Set with HWM_SET_FILTER, only changed while logging is off.
+  bool filter_on;
+  struct hwm_filter filter;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
   (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0) && \
@@ -72,6 +187,8 @@ static struct hwm_device {
 #error "Unsupported kernel version: CrashMonkey has not been tested with " \
   "your kernel version."
 #endif
+  // Source of disk_write_op.seq.
+  atomic64_t seq;
   // Pointer to first write op in the chain.
   struct disk_write_op* writes;
   // Pointer to last write op in the chain.
@@ -79,27 +196,306 @@ static struct hwm_device {
   // Pointer to log entry to be sent to user-land next.
   struct disk_write_op* current_log_write;
   unsigned long current_checkpoint;
-} Device;
+  mempool_t* page_pool;
+  spinlock_t dedupe_lock;
+  DECLARE_HASHTABLE(dedupe, 12);
+  // Kept per-CPU so counting stays cheap on the bio path.
+  struct hwm_stats __percpu *stats;
+  struct hwm_cpu_log __percpu *cpu_logs;
+
+  // Pages held by log entries and where to put them when there are too many.
+  atomic_long_t log_pages;
+  struct file* spill_file;
+  loff_t spill_end;
+  struct workqueue_struct* spill_wq;
+  struct work_struct spill_work;
+  // Held while reading or spilling entries on the list above.
+  struct mutex log_mutex;
+
+  // Ring that log entries are streamed into while user-land has
+  // /dev/hwm_ring<index> mapped. Entries go to the list above when the ring is
+  // not in use.
+  struct miscdevice ring_dev;
+  char ring_name[DISK_NAME_LEN];
+  spinlock_t ring_lock;
+  struct hwm_ring_header* ring;
+  char* ring_data;
+  unsigned long long ring_size;
+  // Kernel copy of the producer count so user-land can't corrupt it.
+  unsigned long long ring_producer;
+  bool ring_on;
+  atomic_t ring_open;
+  // Number of bios that reserved space in the ring and are still filling it.
+  atomic_t ring_writers;
+  wait_queue_head_t ring_wait;
+
+  // Source of disk_write_op_meta.submit_order and done_order.
+  atomic64_t order;
+  // Logged bios sent to the target device that haven't completed yet, and the
+  // completion records of those that have.
+  atomic_t inflight;
+  struct llist_head done;
+};
+
+static struct hwm_device* devices;
+static int num_devices;
 
 static bool should_log(struct bio *bio);
 
-static void free_logs(void) {
-  // Remove all writes.
-  ktime_t curr_time;
-  struct disk_write_op *first = NULL;
-  struct disk_write_op* w = Device.writes;
+static void reset_stats(struct hwm_device *dev) {
+  int cpu;
+  for_each_possible_cpu(cpu) {
+    memset(per_cpu_ptr(dev->stats, cpu), 0, sizeof(struct hwm_stats));
+  }
+}
+
+static int get_stats(struct hwm_device *dev, unsigned long arg) {
+  struct hwm_stats total;
+  unsigned long long *sum = (unsigned long long *) &total;
+  unsigned long long *counters;
+  unsigned int i;
+  int cpu;
+
+  memset(&total, 0, sizeof(struct hwm_stats));
+  for_each_possible_cpu(cpu) {
+    counters = (unsigned long long *) per_cpu_ptr(dev->stats, cpu);
+    for (i = 0; i < sizeof(struct hwm_stats) / sizeof(*sum); ++i) {
+      sum[i] += counters[i];
+    }
+  }
+  if (copy_to_user((void __user *) arg, &total, sizeof(struct hwm_stats))) {
+    return -EFAULT;
+  }
+  return 0;
+}
+
+static void free_done(struct hwm_device *dev) {
+  struct llist_node *list = llist_del_all(&dev->done);
+  struct hwm_bio_hook *hook;
+
+  while (list != NULL) {
+    hook = llist_entry(list, struct hwm_bio_hook, node);
+    list = list->next;
+    kmem_cache_free(hwm_hook_cache, hook);
+  }
+}
+
+static int get_done(struct hwm_device *dev, unsigned long arg) {
+  struct hwm_done_batch batch;
+  struct hwm_done __user *buf;
+  struct llist_node *list, *last;
+  struct hwm_bio_hook *hook;
+  int ret = 0;
+
+  if (copy_from_user(&batch, (void __user *) arg, sizeof(batch))) {
+    return -EFAULT;
+  }
+  buf = (struct hwm_done __user *) (unsigned long) batch.buf;
+  batch.count = 0;
+
+  list = llist_del_all(&dev->done);
+  while (list != NULL && batch.count < batch.max) {
+    hook = llist_entry(list, struct hwm_bio_hook, node);
+    if (copy_to_user(buf + batch.count, &hook->done,
+          sizeof(struct hwm_done))) {
+      ret = -EFAULT;
+      break;
+    }
+    ++batch.count;
+    list = list->next;
+    kmem_cache_free(hwm_hook_cache, hook);
+  }
+  // Whatever didn't fit waits for the next call.
+  if (list != NULL) {
+    for (last = list; last->next != NULL; last = last->next) {
+    }
+    llist_add_batch(list, last, &dev->done);
+  }
+
+  if (copy_to_user((void __user *) arg, &batch, sizeof(batch))) {
+    return -EFAULT;
+  }
+  return ret;
+}
+
+static unsigned int size_bucket(unsigned int size) {
+  unsigned int bucket = 1;
+  if (size == 0) {
+    return 0;
+  }
+  while (bucket < HWM_STATS_SIZE_BUCKETS - 1 &&
+      size > (HWM_STATS_MIN_BUCKET_SIZE << (bucket - 1))) {
+    ++bucket;
+  }
+  return bucket;
+}
+
+static void count_logged(struct hwm_device *dev,
+    struct disk_write_op_meta *meta) {
+  unsigned long long flags = meta->bi_rw;
+  this_cpu_inc(dev->stats->logged);
+  this_cpu_add(dev->stats->bytes, HWM_DATA_SIZE(*meta));
+  this_cpu_inc(dev->stats->sizes[size_bucket(HWM_DATA_SIZE(*meta))]);
+  while (flags != 0) {
+    this_cpu_inc(dev->stats->flags[__ffs64(flags)]);
+    flags &= flags - 1;
+  }
+}
+
+static void free_log_entry(struct hwm_device *dev,
+    struct disk_write_op *write) {
+  unsigned int i;
+  for (i = 0; write->pages != NULL && i < write->nr_pages; ++i) {
+    if (write->dedupe != NULL) {
+      if (write->dedupe[i].page != NULL) {
+        mempool_free(write->dedupe[i].page, dev->page_pool);
+      }
+    } else if (write->pages[i] != NULL) {
+      mempool_free(write->pages[i], dev->page_pool);
+    }
+  }
+  atomic_long_sub(write->owned_pages, &dev->log_pages);
+  kfree(write->dedupe);
+  kfree(write->zero_map);
+  kfree(write->pages);
+  kfree(write);
+}
+
+static ssize_t spill_write(struct hwm_device *dev, void *buf, size_t count,
+    loff_t pos) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 14, 0)
+  return kernel_write(dev->spill_file, buf, count, pos);
+#else
+  return kernel_write(dev->spill_file, buf, count, &pos);
+#endif
+}
+
+static ssize_t spill_read(struct hwm_device *dev, void *buf, size_t count,
+    loff_t pos) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 14, 0)
+  return kernel_read(dev->spill_file, pos, buf, count);
+#else
+  return kernel_read(dev->spill_file, buf, count, &pos);
+#endif
+}
+
+// Copy the data of a log entry that was spilled to user-land.
+static int copy_spilled_data_to_user(struct hwm_device *dev, void __user *dst,
+    struct disk_write_op *write) {
+  unsigned int copied = 0;
+  unsigned int len;
+  unsigned int i;
+  int ret = 0;
+  void *buf = (void *) __get_free_page(GFP_NOIO);
+
+  if (buf == NULL) {
+    return -ENOMEM;
+  }
+  for (i = 0; i < write->nr_pages; ++i) {
+    len = min_t(unsigned int, PAGE_SIZE, write->metadata.size - copied);
+    if (test_bit(i, write->zero_map)) {
+      if (clear_user(dst + copied, len)) {
+        ret = -EFAULT;
+        break;
+      }
+    } else {
+      if (spill_read(dev, buf, len, write->spill_offset + i * PAGE_SIZE) !=
+          len) {
+        printk(KERN_WARNING "hwm: unable to read back spilled log data\n");
+        ret = -EIO;
+        break;
+      }
+      if (copy_to_user(dst + copied, buf, len)) {
+        ret = -EFAULT;
+        break;
+      }
+    }
+    copied += len;
+  }
+  free_page((unsigned long) buf);
+  return ret;
+}
+
+// Copy the data of a log entry to user-land.
+static int copy_log_data_to_user(struct hwm_device *dev, void __user *dst,
+    struct disk_write_op *write) {
+  unsigned int copied = 0;
+  unsigned int len;
+  unsigned int i;
+
+  if (write->metadata.op == HWM_OP_WRITE_STUB) {
+    if (copy_to_user(dst, &write->stub_hash, sizeof(write->stub_hash))) {
+      return -EFAULT;
+    }
+    return 0;
+  }
+  if (write->zero_map != NULL) {
+    return copy_spilled_data_to_user(dev, dst, write);
+  }
+  for (i = 0; i < write->nr_pages; ++i) {
+    len = min_t(unsigned int, PAGE_SIZE, write->metadata.size - copied);
+    if (write->pages[i] == NULL) {
+      if (clear_user(dst + copied, len)) {
+        return -EFAULT;
+      }
+    } else if (copy_to_user(dst + copied, page_address(write->pages[i]),
+          len)) {
+      return -EFAULT;
+    }
+    copied += len;
+  }
+  return 0;
+}
+
+static void free_log_list(struct hwm_device *dev, struct disk_write_op *w) {
   struct disk_write_op* tmp_w;
   while (w != NULL) {
-    kfree(w->data);
     tmp_w = w;
     w = w->next;
-    kfree(tmp_w);
+    free_log_entry(dev, tmp_w);
   }
+}
+
+// Frees every log entry without starting a new log.
+static void drop_logs(struct hwm_device *dev) {
+  struct disk_write_op *w;
+  struct hwm_cpu_log *log;
+  int cpu;
+
+  // Every entry is about to go away so just forget the table contents.
+  spin_lock(&dev->dedupe_lock);
+  hash_init(dev->dedupe);
+  spin_unlock(&dev->dedupe_lock);
+
+  free_log_list(dev, dev->writes);
+  for_each_possible_cpu(cpu) {
+    log = per_cpu_ptr(dev->cpu_logs, cpu);
+    spin_lock(&log->lock);
+    w = log->head;
+    log->head = NULL;
+    log->tail = NULL;
+    spin_unlock(&log->lock);
+    free_log_list(dev, w);
+  }
+  atomic64_set(&dev->seq, 0);
+  dev->spill_end = 0;
+  dev->writes = NULL;
+  dev->current_write = NULL;
+  dev->current_log_write = NULL;
+}
+
+static void free_logs(struct hwm_device *dev) {
+  // Remove all writes.
+  ktime_t curr_time;
+  struct disk_write_op *first = NULL;
+
+  drop_logs(dev);
 
   // Create default first checkpoint at start of log.
   first = kzalloc(sizeof(struct disk_write_op), GFP_NOIO);
   if (first == NULL) {
-    printk(KERN_WARNING "hwm: error allocating default checkpoint\n");
+    printk(KERN_WARNING "hwm%d: error allocating default checkpoint\n",
+        dev->index);
     return;
   }
   curr_time = ktime_get();
@@ -107,32 +503,623 @@ static void free_logs(void) {
   first->metadata.bi_flags = HWM_CHECKPOINT_FLAG;
   first->metadata.bi_rw = HWM_CHECKPOINT_FLAG;
   first->metadata.time_ns = ktime_to_ns(curr_time);
-  Device.current_write = first;
-  Device.writes = first;
-  Device.current_log_write = first;
-  Device.current_checkpoint = 1;
+  dev->current_write = first;
+  dev->writes = first;
+  dev->current_log_write = first;
+  dev->current_checkpoint = 1;
+}
+
+static struct disk_write_op *merge_sorted_logs(struct disk_write_op *a,
+    struct disk_write_op *b) {
+  struct disk_write_op head;
+  struct disk_write_op *tail = &head;
+  while (a != NULL && b != NULL) {
+    if (a->seq < b->seq) {
+      tail->next = a;
+      a = a->next;
+    } else {
+      tail->next = b;
+      b = b->next;
+    }
+    tail = tail->next;
+  }
+  tail->next = (a != NULL) ? a : b;
+  return head.next;
+}
+
+/*
+ * Move the entries on the per-CPU lists onto the end of the device list in seq
+ * order. Entries are given their seq under the lock of the list they go on, so
+ * once a list's lock is held every entry on it with a seq at or below a
+ * previously read value of dev->seq is there. Later entries are left for the
+ * next merge so nothing can be merged ahead of an entry that is still being
+ * added.
+ */
+static void merge_cpu_logs(struct hwm_device *dev) {
+  const unsigned long long cut = atomic64_read(&dev->seq);
+  struct disk_write_op *merged = NULL;
+  struct disk_write_op *first;
+  struct disk_write_op *last;
+  struct disk_write_op *w;
+  struct hwm_cpu_log *log;
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    log = per_cpu_ptr(dev->cpu_logs, cpu);
+    spin_lock(&log->lock);
+    first = log->head;
+    last = NULL;
+    for (w = log->head; w != NULL && w->seq <= cut; w = w->next) {
+      last = w;
+    }
+    if (last == NULL) {
+      spin_unlock(&log->lock);
+      continue;
+    }
+    log->head = last->next;
+    if (log->head == NULL) {
+      log->tail = NULL;
+    }
+    last->next = NULL;
+    spin_unlock(&log->lock);
+    merged = merge_sorted_logs(merged, first);
+  }
+
+  if (merged == NULL) {
+    return;
+  }
+  for (last = merged; last->next != NULL; last = last->next) {
+  }
+
+  spin_lock(&dev->lock);
+  if (dev->current_write == NULL) {
+    // With the default first checkpoint, this case should never happen.
+    printk(KERN_WARNING "hwm: found empty list of previous disk ops\n");
+    dev->writes = merged;
+  } else {
+    dev->current_write->next = merged;
+  }
+  dev->current_write = last;
+  // If user-land already fetched everything, these are the next entries.
+  if (dev->current_log_write == NULL) {
+    dev->current_log_write = merged;
+  }
+  spin_unlock(&dev->lock);
+}
+
+/*
+ * Copy as many log entries as fit into the user buffer described by the
+ * disk_write_op_batch at arg, advancing current_log_write past each entry that
+ * was copied. Returns the number of entries copied, 0 if the log has been
+ * fully drained.
+ */
+static int get_log_batch(struct hwm_device *dev, unsigned long arg) {
+  struct disk_write_op_batch batch;
+  struct disk_write_op *write;
+  unsigned long long used = 0;
+  unsigned long long record_size;
+  unsigned int count = 0;
+
+  if (copy_from_user(&batch, (void __user *) arg, sizeof(batch))) {
+    return -EFAULT;
+  }
+  merge_cpu_logs(dev);
+
+  while (dev->current_log_write != NULL) {
+    write = dev->current_log_write;
+    record_size = HWM_LOG_BATCH_RECORD_SIZE(HWM_DATA_SIZE(write->metadata));
+    if (used + record_size > batch.buf_size) {
+      if (count == 0) {
+        // Tell user-land how big of a buffer it needs for the next entry.
+        batch.bytes = record_size;
+        if (copy_to_user((void __user *) arg, &batch, sizeof(batch))) {
+          return -EFAULT;
+        }
+        return -ENOSPC;
+      }
+      break;
+    }
+
+    if (copy_to_user((void __user *) (batch.buf + used), &write->metadata,
+          sizeof(struct disk_write_op_meta))) {
+      return -EFAULT;
+    }
+    if (copy_log_data_to_user(dev, (void __user *) (batch.buf + used +
+            sizeof(struct disk_write_op_meta)), write)) {
+      return -EFAULT;
+    }
+
+    used += record_size;
+    ++count;
+    spin_lock(&dev->lock);
+    dev->current_log_write = write->next;
+    spin_unlock(&dev->lock);
+  }
+
+  batch.bytes = used;
+  batch.count = count;
+  if (copy_to_user((void __user *) arg, &batch, sizeof(batch))) {
+    return -EFAULT;
+  }
+  return count;
+}
+
+/*
+ * Copy the data carried by bio into dst, which must have room for bio->BI_SIZE
+ * bytes.
+ */
+static void copy_bio_data(struct bio *bio, char *dst) {
+  int copied_data = 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 16, 0)
+  struct bio_vec *vec;
+  int iter;
+  bio_for_each_segment(vec, bio, iter) {
+    void *bio_data = kmap(vec->bv_page);
+    memcpy(dst + copied_data, bio_data + vec->bv_offset, vec->bv_len);
+    kunmap(vec->bv_page);
+    copied_data += vec->bv_len;
+  }
+#else
+  struct bio_vec vec;
+  struct bvec_iter iter;
+  bio_for_each_segment(vec, bio, iter) {
+    void *bio_data = kmap(vec.bv_page);
+    memcpy(dst + copied_data, bio_data + vec.bv_offset, vec.bv_len);
+    kunmap(vec.bv_page);
+    copied_data += vec.bv_len;
+  }
+#endif
+}
+
+/*
+ * Hash of the data carried by bio for HWM_OP_WRITE_STUB entries. The data is
+ * hashed a sector at a time so the result doesn't depend on how the bio is
+ * split into segments.
+ */
+static unsigned long long hash_bio_data(struct bio *bio) {
+  u32 hash = 0;
+  unsigned int done;
+  char *bio_data;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 16, 0)
+  struct bio_vec *vec;
+  int iter;
+  bio_for_each_segment(vec, bio, iter) {
+    bio_data = kmap(vec->bv_page);
+    for (done = 0; done < vec->bv_len; done += 512) {
+      hash = jhash(bio_data + vec->bv_offset + done,
+          min_t(unsigned int, 512, vec->bv_len - done), hash);
+    }
+    kunmap(vec->bv_page);
+  }
+#else
+  struct bio_vec vec;
+  struct bvec_iter iter;
+  bio_for_each_segment(vec, bio, iter) {
+    bio_data = kmap(vec.bv_page);
+    for (done = 0; done < vec.bv_len; done += 512) {
+      hash = jhash(bio_data + vec.bv_offset + done,
+          min_t(unsigned int, 512, vec.bv_len - done), hash);
+    }
+    kunmap(vec.bv_page);
+  }
+#endif
+  return hash;
+}
+
+/*
+ * Copy the data carried by bio into pages, which must have room for
+ * bio->BI_SIZE bytes.
+ */
+static void copy_bio_pages(struct bio *bio, struct page **pages) {
+  unsigned int copied_data = 0;
+  unsigned int page_offset;
+  unsigned int len;
+  unsigned int done;
+  char *bio_data;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 16, 0)
+  struct bio_vec *vec;
+  int iter;
+  bio_for_each_segment(vec, bio, iter) {
+    bio_data = kmap(vec->bv_page);
+    for (done = 0; done < vec->bv_len; done += len) {
+      page_offset = offset_in_page(copied_data);
+      len = min_t(unsigned int, vec->bv_len - done, PAGE_SIZE - page_offset);
+      memcpy(page_address(pages[copied_data >> PAGE_SHIFT]) + page_offset,
+          bio_data + vec->bv_offset + done, len);
+      copied_data += len;
+    }
+    kunmap(vec->bv_page);
+  }
+#else
+  struct bio_vec vec;
+  struct bvec_iter iter;
+  bio_for_each_segment(vec, bio, iter) {
+    bio_data = kmap(vec.bv_page);
+    for (done = 0; done < vec.bv_len; done += len) {
+      page_offset = offset_in_page(copied_data);
+      len = min_t(unsigned int, vec.bv_len - done, PAGE_SIZE - page_offset);
+      memcpy(page_address(pages[copied_data >> PAGE_SHIFT]) + page_offset,
+          bio_data + vec.bv_offset + done, len);
+      copied_data += len;
+    }
+    kunmap(vec.bv_page);
+  }
+#endif
+}
+
+/*
+ * Replace pages of the entry that match a page already in the log with that
+ * page. If memory for the table entries can't be had the entry keeps its own
+ * pages.
+ */
+static void dedupe_log_entry(struct hwm_device *dev,
+    struct disk_write_op *write) {
+  struct hwm_dedupe_page *dedupe;
+  struct hwm_dedupe_page *d;
+  struct page *found;
+  unsigned int i;
+
+  dedupe = kcalloc(write->nr_pages, sizeof(struct hwm_dedupe_page), GFP_NOIO);
+  if (dedupe == NULL) {
+    return;
+  }
+  // Hash outside the lock.
+  for (i = 0; i < write->nr_pages; ++i) {
+    if (write->pages[i] != NULL) {
+      dedupe[i].hash = jhash(page_address(write->pages[i]), PAGE_SIZE, 0);
+    }
+  }
+
+  spin_lock(&dev->dedupe_lock);
+  for (i = 0; i < write->nr_pages; ++i) {
+    if (write->pages[i] == NULL) {
+      continue;
+    }
+    found = NULL;
+    hash_for_each_possible(dev->dedupe, d, node, dedupe[i].hash) {
+      if (d->hash == dedupe[i].hash &&
+          memcmp(page_address(d->page), page_address(write->pages[i]),
+            PAGE_SIZE) == 0) {
+        found = d->page;
+        break;
+      }
+    }
+    if (found != NULL) {
+      mempool_free(write->pages[i], dev->page_pool);
+      write->pages[i] = found;
+      this_cpu_inc(dev->stats->dedupe_pages);
+    } else {
+      dedupe[i].page = write->pages[i];
+      hash_add(dev->dedupe, &dedupe[i].node, dedupe[i].hash);
+    }
+  }
+  write->dedupe = dedupe;
+  spin_unlock(&dev->dedupe_lock);
+}
+
+/*
+ * Make a new log entry with the given metadata and a copy of the data in bio
+ * (if bio is not NULL and the entry carries data). The entry is not yet part of
+ * the log.
+ */
+static struct disk_write_op *new_log_entry(struct hwm_device *dev,
+    struct disk_write_op_meta *meta, struct bio *bio) {
+  struct disk_write_op *write;
+  unsigned int i;
+
+  write = kzalloc(sizeof(struct disk_write_op), GFP_NOIO);
+  if (write == NULL) {
+    printk(KERN_WARNING "hwm: unable to make new write node\n");
+    this_cpu_inc(dev->stats->alloc_failures);
+    return NULL;
+  }
+  write->metadata = *meta;
+  if (bio != NULL && meta->op == HWM_OP_WRITE_STUB) {
+    write->stub_hash = hash_bio_data(bio);
+    return write;
+  }
+  if (bio == NULL || HWM_DATA_SIZE(*meta) == 0) {
+    return write;
+  }
+
+  write->pages = kcalloc(DIV_ROUND_UP(meta->size, PAGE_SIZE),
+      sizeof(struct page *), GFP_NOIO);
+  if (write->pages == NULL) {
+    printk(KERN_WARNING "hwm: unable to get memory for data logging\n");
+    this_cpu_inc(dev->stats->alloc_failures);
+    kfree(write);
+    return NULL;
+  }
+  write->nr_pages = DIV_ROUND_UP(meta->size, PAGE_SIZE);
+  // Waits for the page allocator or the reserve instead of failing.
+  for (i = 0; i < write->nr_pages; ++i) {
+    write->pages[i] = mempool_alloc(dev->page_pool, GFP_NOIO);
+    if (write->pages[i] == NULL) {
+      printk(KERN_WARNING "hwm: unable to get memory for data logging\n");
+      this_cpu_inc(dev->stats->alloc_failures);
+      free_log_entry(dev, write);
+      return NULL;
+    }
+  }
+  copy_bio_pages(bio, write->pages);
+
+  // All zero pages don't need to be kept around.
+  for (i = 0; i < write->nr_pages; ++i) {
+    if (memchr_inv(page_address(write->pages[i]), 0,
+          min_t(unsigned int, PAGE_SIZE, meta->size - i * PAGE_SIZE)) ==
+        NULL) {
+      mempool_free(write->pages[i], dev->page_pool);
+      write->pages[i] = NULL;
+      this_cpu_inc(dev->stats->zero_pages);
+    }
+  }
+  // Spilling can't free pages other entries share, so dedupe is turned off
+  // while there is a budget to spill down to.
+  if (dedupe_data && (log_mem_kb == 0 || dev->spill_wq == NULL)) {
+    dedupe_log_entry(dev, write);
+  } else if (dedupe_data) {
+    printk_once(KERN_WARNING "hwm: dedupe_data is ignored while log_mem_kb "
+        "is set\n");
+    this_cpu_inc(dev->stats->dedupe_refused);
+  }
+  for (i = 0; i < write->nr_pages; ++i) {
+    if (write->dedupe != NULL ? write->dedupe[i].page != NULL :
+        write->pages[i] != NULL) {
+      ++write->owned_pages;
+    }
+  }
+  atomic_long_add(write->owned_pages, &dev->log_pages);
+  return write;
+}
+
+// Add a complete log entry to the end of this CPU's list.
+static void append_log_entry(struct hwm_device *dev,
+    struct disk_write_op *write) {
+  struct hwm_cpu_log *log = per_cpu_ptr(dev->cpu_logs, get_cpu());
+
+  spin_lock(&log->lock);
+  write->seq = atomic64_inc_return(&dev->seq);
+  write->next = NULL;
+  if (log->tail == NULL) {
+    log->head = write;
+  } else {
+    log->tail->next = write;
+  }
+  log->tail = write;
+  spin_unlock(&log->lock);
+  put_cpu();
+}
+
+/*
+ * Put a log entry in the ring if user-land has it mapped. Entries too big for
+ * the ring or that don't fit in what is left of it go on the list and only
+ * leave a SPILLED record in the ring. Returns false if the ring is not in use,
+ * in which case the caller should put the entry on the list itself.
+ */
+static bool ring_log(struct hwm_device *dev, struct disk_write_op_meta *meta,
+    struct bio *bio) {
+  struct disk_write_op *spill = NULL;
+  struct hwm_ring_record *rec;
+  unsigned long long record_size =
+    HWM_RING_RECORD_SIZE(HWM_DATA_SIZE(*meta));
+  unsigned long long consumer;
+  unsigned long long pos;
+  unsigned long long pad;
+
+  if (!dev->ring_on) {
+    return false;
+  }
+
+  if (record_size > dev->ring_size / 2) {
+    spill = new_log_entry(dev, meta, bio);
+    if (spill == NULL) {
+      return false;
+    }
+    record_size = HWM_RING_RECORD_SIZE(0);
+    this_cpu_inc(dev->stats->ring_spills);
+  }
+
+  spin_lock(&dev->ring_lock);
+  while (true) {
+    if (!dev->ring_on) {
+      spin_unlock(&dev->ring_lock);
+      if (spill != NULL) {
+        append_log_entry(dev, spill);
+        return true;
+      }
+      return false;
+    }
+
+    // Records never wrap around the end of the data area.
+    pos = dev->ring_producer & (dev->ring_size - 1);
+    pad = 0;
+    if (pos + record_size > dev->ring_size) {
+      pad = dev->ring_size - pos;
+    }
+    consumer = *(volatile unsigned long long *) &dev->ring->consumer;
+    if (dev->ring_producer + pad + record_size - consumer <=
+        dev->ring_size) {
+      break;
+    }
+
+    spin_unlock(&dev->ring_lock);
+    // Rather than wait for user-land to make room, put the entry on the list
+    // and try again with a SPILLED record.
+    if (spill == NULL) {
+      spill = new_log_entry(dev, meta, bio);
+      if (spill != NULL) {
+        record_size = HWM_RING_RECORD_SIZE(0);
+        this_cpu_inc(dev->stats->ring_spills);
+        spin_lock(&dev->ring_lock);
+        continue;
+      }
+    }
+    // Only wait if there is no room even for that.
+    this_cpu_inc(dev->stats->ring_waits);
+    schedule_timeout_uninterruptible(1);
+    spin_lock(&dev->ring_lock);
+  }
+
+  if (pad > 0) {
+    rec = (struct hwm_ring_record *) (dev->ring_data + pos);
+    rec->length = pad;
+    rec->state = HWM_RING_REC_PAD;
+    dev->ring_producer += pad;
+    pos = 0;
+  }
+
+  rec = (struct hwm_ring_record *) (dev->ring_data + pos);
+  rec->length = record_size;
+  rec->state = HWM_RING_REC_BUSY;
+  if (spill != NULL) {
+    // Done under the ring lock so the list stays in the same order as the
+    // SPILLED records.
+    append_log_entry(dev, spill);
+    rec->metadata = *meta;
+    rec->state = HWM_RING_REC_SPILLED;
+  } else {
+    atomic_inc(&dev->ring_writers);
+  }
+  dev->ring_producer += record_size;
+  // The record header must be visible before the new producer count.
+  smp_wmb();
+  *(volatile unsigned long long *) &dev->ring->producer =
+    dev->ring_producer;
+  spin_unlock(&dev->ring_lock);
+
+  if (spill == NULL) {
+    rec->metadata = *meta;
+    if (bio != NULL && meta->op == HWM_OP_WRITE_STUB) {
+      *(unsigned long long *) (rec + 1) = hash_bio_data(bio);
+    } else if (bio != NULL && HWM_DATA_SIZE(*meta) > 0) {
+      copy_bio_data(bio, (char *) (rec + 1));
+    }
+    // The record contents must be visible before it is marked ready.
+    smp_wmb();
+    *(volatile unsigned int *) &rec->state = HWM_RING_REC_READY;
+    atomic_dec(&dev->ring_writers);
+  }
+  wake_up_interruptible(&dev->ring_wait);
+  return true;
+}
+
+static bool over_log_mem_limit(struct hwm_device *dev) {
+  return log_mem_kb > 0 && atomic_long_read(&dev->log_pages) >
+    ((long) log_mem_kb >> (PAGE_SHIFT - 10));
+}
+
+// Write the data of a log entry to the spill file and free its pages.
+static int spill_log_entry(struct hwm_device *dev,
+    struct disk_write_op *write) {
+  unsigned long *zero_map;
+  unsigned int i;
+
+  zero_map = kcalloc(BITS_TO_LONGS(write->nr_pages), sizeof(unsigned long),
+      GFP_NOIO);
+  if (zero_map == NULL) {
+    return -ENOMEM;
+  }
+  write->spill_offset = dev->spill_end;
+  for (i = 0; i < write->nr_pages; ++i) {
+    if (write->pages[i] == NULL) {
+      set_bit(i, zero_map);
+      continue;
+    }
+    if (spill_write(dev, page_address(write->pages[i]), PAGE_SIZE,
+          write->spill_offset + i * PAGE_SIZE) != PAGE_SIZE) {
+      printk(KERN_WARNING "hwm: unable to spill log data\n");
+      kfree(zero_map);
+      return -EIO;
+    }
+  }
+  dev->spill_end += (loff_t) write->nr_pages * PAGE_SIZE;
+
+  for (i = 0; i < write->nr_pages; ++i) {
+    if (write->pages[i] != NULL) {
+      mempool_free(write->pages[i], dev->page_pool);
+    }
+  }
+  kfree(write->pages);
+  write->pages = NULL;
+  write->zero_map = zero_map;
+  this_cpu_add(dev->stats->spilled_pages, write->owned_pages);
+  atomic_long_sub(write->owned_pages, &dev->log_pages);
+  write->owned_pages = 0;
+  return 0;
+}
+
+/*
+ * Spill the oldest entries user-land hasn't fetched yet until the log is back
+ * under log_mem_kb. Entries sharing pages through the dedupe table, logged
+ * before the budget was set, are left alone since later entries may still need
+ * their pages.
+ */
+static void spill_logs(struct work_struct *work) {
+  struct hwm_device *dev = container_of(work, struct hwm_device, spill_work);
+  struct disk_write_op *write;
+
+  mutex_lock(&dev->log_mutex);
+  merge_cpu_logs(dev);
+  for (write = dev->current_log_write; write != NULL && over_log_mem_limit(dev);
+      write = write->next) {
+    if (write->owned_pages == 0 || write->dedupe != NULL) {
+      continue;
+    }
+    if (spill_log_entry(dev, write)) {
+      break;
+    }
+  }
+  mutex_unlock(&dev->log_mutex);
+}
+
+static int set_filter(struct hwm_device *dev, unsigned long arg) {
+  struct hwm_filter filter;
+
+  if (dev->log_on) {
+    return -EBUSY;
+  }
+  if (arg == 0) {
+    printk(KERN_INFO "hwm%d: removing capture filter\n", dev->index);
+    dev->filter_on = false;
+    return 0;
+  }
+  if (copy_from_user(&filter, (void __user *) arg, sizeof(filter))) {
+    return -EFAULT;
+  }
+  if (filter.nr_ranges > HWM_FILTER_MAX_RANGES) {
+    return -EINVAL;
+  }
+  printk(KERN_INFO "hwm%d: setting capture filter\n", dev->index);
+  dev->filter = filter;
+  dev->filter_on = true;
+  return 0;
 }
 
 // TODO(ashmrtn): Add mutexes/locking to make thread-safe.
-static int disk_wrapper_ioctl(struct block_device* bdev, fmode_t mode,
+static int do_disk_wrapper_ioctl(struct block_device* bdev, fmode_t mode,
     unsigned int cmd, unsigned long arg) {
+  struct hwm_device *dev = bdev->bd_disk->private_data;
   int ret = 0;
   unsigned int not_copied;
   struct disk_write_op *checkpoint = NULL;
+  struct disk_write_op_meta meta;
   ktime_t curr_time;
 
   switch (cmd) {
     case HWM_LOG_OFF:
-      printk(KERN_INFO "hwm: turning off data logging\n");
-      Device.log_on = false;
+      printk(KERN_INFO "hwm%d: turning off data logging\n", dev->index);
+      dev->log_on = false;
       break;
     case HWM_LOG_ON:
-      printk(KERN_INFO "hwm: turning on data logging\n");
-      Device.log_on = true;
+      printk(KERN_INFO "hwm%d: turning on data logging\n", dev->index);
+      dev->log_on = true;
       break;
     case HWM_GET_LOG_META:
       //printk(KERN_INFO "hwm: getting next log entry meta\n");
-      if (Device.current_log_write == NULL) {
+      if (dev->current_log_write == NULL) {
+        merge_cpu_logs(dev);
+      }
+      if (dev->current_log_write == NULL) {
         printk(KERN_WARNING "hwm: no log entry here \n");
         return -ENODATA;
       }
@@ -155,12 +1142,12 @@ static int disk_wrapper_ioctl(struct block_device* bdev, fmode_t mode,
       while (not_copied != 0) {
         unsigned int offset = sizeof(struct disk_write_op_meta) - not_copied;
         not_copied = copy_to_user((void*) (arg + offset),
-            &(Device.current_log_write->metadata) + offset, not_copied);
+            &(dev->current_log_write->metadata) + offset, not_copied);
       }
       break;
     case HWM_GET_LOG_DATA:
       //printk(KERN_INFO "hwm: getting log entry data\n");
-      if (Device.current_log_write == NULL) {
+      if (dev->current_log_write == NULL) {
         printk(KERN_WARNING "hwm: no log entries to report data for\n");
         return -ENODATA;
       }
@@ -172,55 +1159,70 @@ static int disk_wrapper_ioctl(struct block_device* bdev, fmode_t mode,
 #else
       if (!access_ok(VERIFY_WRITE, (void*) arg,
 #endif
-            Device.current_log_write->metadata.size)) {
+            HWM_DATA_SIZE(dev->current_log_write->metadata))) {
         // TODO(ashmrtn): Find right error code.
         return -EFAULT;
       }
 
       // Copy written data.
-      not_copied = Device.current_log_write->metadata.size;
-      while (not_copied != 0) {
-        unsigned int offset =
-          Device.current_log_write->metadata.size - not_copied;
-        not_copied = copy_to_user((void*) (arg + offset),
-            Device.current_log_write->data + offset, not_copied);
+      if (copy_log_data_to_user(dev, (void __user *) arg,
+            dev->current_log_write)) {
+        return -EFAULT;
       }
       break;
     case HWM_NEXT_ENT:
       //printk(KERN_INFO "hwm: moving to next log entry\n");
-      if (Device.current_log_write == NULL) {
+      if (dev->current_log_write == NULL) {
         printk(KERN_WARNING "hwm: no next log entry\n");
         return -ENODATA;
       }
-      Device.current_log_write = Device.current_log_write->next;
+      spin_lock(&dev->lock);
+      dev->current_log_write = dev->current_log_write->next;
+      spin_unlock(&dev->lock);
+      break;
+    case HWM_GET_LOG_BATCH:
+      ret = get_log_batch(dev, arg);
       break;
     case HWM_CLR_LOG:
-      printk(KERN_INFO "hwm: clearing data logs\n");
-      free_logs();
+      printk(KERN_INFO "hwm%d: clearing data logs\n", dev->index);
+      free_logs(dev);
+      free_done(dev);
+      reset_stats(dev);
       break;
     case HWM_CHECKPOINT:
       curr_time = ktime_get();
-      printk(KERN_INFO "hwm: making checkpoint in log\n");
+      printk(KERN_INFO "hwm%d: making checkpoint in log\n", dev->index);
       // Create a new log entry that just says we got a checkpoint.
-      checkpoint = kzalloc(sizeof(struct disk_write_op), GFP_NOIO);
+      memset(&meta, 0, sizeof(struct disk_write_op_meta));
+      meta.bi_rw = HWM_CHECKPOINT_FLAG;
+      meta.bi_flags = HWM_CHECKPOINT_FLAG;
+      meta.time_ns = ktime_to_ns(curr_time);
+      checkpoint = new_log_entry(dev, &meta, NULL);
       if (checkpoint == NULL) {
         printk(KERN_WARNING "hwm: error allocating checkpoint\n");
         return -ENOMEM;
       }
 
-      checkpoint->metadata.bi_rw = HWM_CHECKPOINT_FLAG;
-      checkpoint->metadata.bi_flags = HWM_CHECKPOINT_FLAG;
-      checkpoint->metadata.time_ns = ktime_to_ns(curr_time);
-      // Aquire lock and add the new entry to the end of the list.
-      spin_lock(&Device.lock);
-      // Assuming spinlock keeps the compiler from reordering this before the
-      // lock is aquired...
-      checkpoint->metadata.write_sector = Device.current_checkpoint;
-      ++Device.current_checkpoint;
-      Device.current_write->next = checkpoint;
-      Device.current_write = checkpoint;
-      // Drop lock and return success.
-      spin_unlock(&Device.lock);
+      spin_lock(&dev->lock);
+      checkpoint->metadata.write_sector = dev->current_checkpoint;
+      ++dev->current_checkpoint;
+      spin_unlock(&dev->lock);
+
+      this_cpu_inc(dev->stats->checkpoints);
+      if (ring_log(dev, &checkpoint->metadata, NULL)) {
+        free_log_entry(dev, checkpoint);
+        break;
+      }
+      append_log_entry(dev, checkpoint);
+      break;
+    case HWM_GET_STATS:
+      ret = get_stats(dev, arg);
+      break;
+    case HWM_SET_FILTER:
+      ret = set_filter(dev, arg);
+      break;
+    case HWM_GET_DONE:
+      ret = get_done(dev, arg);
       break;
     default:
       ret = -EINVAL;
@@ -228,12 +1230,135 @@ static int disk_wrapper_ioctl(struct block_device* bdev, fmode_t mode,
   return ret;
 }
 
+static int disk_wrapper_ioctl(struct block_device* bdev, fmode_t mode,
+    unsigned int cmd, unsigned long arg) {
+  struct hwm_device *dev = bdev->bd_disk->private_data;
+  int ret;
+
+  switch (cmd) {
+    case HWM_GET_LOG_META:
+    case HWM_GET_LOG_DATA:
+    case HWM_NEXT_ENT:
+    case HWM_GET_LOG_BATCH:
+    case HWM_CLR_LOG:
+      // Keep entries from being spilled while they are read or freed.
+      mutex_lock(&dev->log_mutex);
+      ret = do_disk_wrapper_ioctl(bdev, mode, cmd, arg);
+      mutex_unlock(&dev->log_mutex);
+      return ret;
+    default:
+      return do_disk_wrapper_ioctl(bdev, mode, cmd, arg);
+  }
+}
+
 // The device operations structure.
 static const struct block_device_operations disk_wrapper_ops = {
   .owner   = THIS_MODULE,
   .ioctl   = disk_wrapper_ioctl,
 };
 
+static int hwm_ring_open(struct inode *inode, struct file *file) {
+  struct hwm_device *dev = NULL;
+  int i;
+
+  for (i = 0; i < num_devices; ++i) {
+    if (devices[i].ring_size > 0 &&
+        devices[i].ring_dev.minor == iminor(inode)) {
+      dev = &devices[i];
+      break;
+    }
+  }
+  if (dev == NULL) {
+    return -ENODEV;
+  }
+  file->private_data = dev;
+
+  // Only one consumer at a time.
+  if (atomic_cmpxchg(&dev->ring_open, 0, 1) != 0) {
+    return -EBUSY;
+  }
+
+  dev->ring = vmalloc_user(PAGE_SIZE + dev->ring_size);
+  if (dev->ring == NULL) {
+    printk(KERN_WARNING "hwm: unable to allocate log ring\n");
+    atomic_set(&dev->ring_open, 0);
+    return -ENOMEM;
+  }
+  dev->ring_data = (char *) dev->ring + PAGE_SIZE;
+  dev->ring_producer = 0;
+  dev->ring->data_size = dev->ring_size;
+  dev->ring->data_offset = PAGE_SIZE;
+  return 0;
+}
+
+static int hwm_ring_release(struct inode *inode, struct file *file) {
+  struct hwm_device *dev = file->private_data;
+
+  spin_lock(&dev->ring_lock);
+  dev->ring_on = false;
+  spin_unlock(&dev->ring_lock);
+
+  // Wait for bios that are still copying data into the ring.
+  while (atomic_read(&dev->ring_writers) > 0) {
+    schedule_timeout_uninterruptible(1);
+  }
+  vfree(dev->ring);
+  dev->ring = NULL;
+  dev->ring_data = NULL;
+  atomic_set(&dev->ring_open, 0);
+  printk(KERN_INFO "hwm%d: log ring closed\n", dev->index);
+  return 0;
+}
+
+/*
+ * Log entries only go to the ring once all of it has been mapped. Mapping just
+ * the header page lets user-land find out how big the ring is first.
+ */
+static int hwm_ring_mmap(struct file *file, struct vm_area_struct *vma) {
+  struct hwm_device *dev = file->private_data;
+  int ret;
+  unsigned long size = vma->vm_end - vma->vm_start;
+
+  if (vma->vm_pgoff != 0 ||
+      (size != PAGE_SIZE && size != PAGE_SIZE + dev->ring_size)) {
+    return -EINVAL;
+  }
+  ret = remap_vmalloc_range(vma, dev->ring, 0);
+  if (ret) {
+    return ret;
+  }
+  if (size == PAGE_SIZE) {
+    return 0;
+  }
+
+  spin_lock(&dev->ring_lock);
+  dev->ring_on = true;
+  spin_unlock(&dev->ring_lock);
+  printk(KERN_INFO "hwm%d: streaming log entries through log ring\n",
+      dev->index);
+  return 0;
+}
+
+static unsigned int hwm_ring_poll(struct file *file, poll_table *wait) {
+  struct hwm_device *dev = file->private_data;
+
+  poll_wait(file, &dev->ring_wait, wait);
+  if (dev->ring_producer !=
+      *(volatile unsigned long long *) &dev->ring->consumer) {
+    return POLLIN | POLLRDNORM;
+  }
+  return 0;
+}
+
+static const struct file_operations hwm_ring_fops = {
+  .owner   = THIS_MODULE,
+  .open    = hwm_ring_open,
+  .release = hwm_ring_release,
+  .mmap    = hwm_ring_mmap,
+  .poll    = hwm_ring_poll,
+  .llseek  = noop_llseek,
+};
+
 /*
  * Converts from kernel specific flags to flags that CrashMonkey uses.
  * Frustratingly, Linux switch to a completely differnt set of flags between 4.4
@@ -580,6 +1705,143 @@ static bool should_log(struct bio *bio) {
 #endif
 }
 
+static bool filter_match(struct hwm_filter *f,
+    struct disk_write_op_meta *meta) {
+  unsigned long long end;
+  unsigned int i;
+
+  if (f->ops != 0 && !(f->ops & (1U << meta->op))) {
+    return false;
+  }
+  if ((meta->bi_rw & f->required_flags) != f->required_flags ||
+      (meta->bi_rw & f->excluded_flags)) {
+    return false;
+  }
+  if (f->nr_ranges == 0) {
+    return true;
+  }
+  end = meta->write_sector + DIV_ROUND_UP(meta->size, 512);
+  for (i = 0; i < f->nr_ranges; ++i) {
+    if (meta->write_sector < f->ranges[i].end && end > f->ranges[i].start) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Apply the HWM_SET_FILTER filter to a bio about to be logged. Returns false if
+ * it should not be logged, and may turn it into a stub if it should.
+ */
+static bool filter_log(struct hwm_device *dev,
+    struct disk_write_op_meta *meta) {
+  struct hwm_filter *f = &dev->filter;
+
+  if (!dev->filter_on) {
+    return true;
+  }
+  if (!(meta->bi_rw & (HWM_FLUSH_FLAG | HWM_FLUSH_SEQ_FLAG | HWM_FUA_FLAG)) &&
+      !filter_match(f, meta)) {
+    return false;
+  }
+  if ((f->flags & HWM_FILTER_META_ONLY) && meta->op == HWM_OP_WRITE &&
+      meta->size > 0 && !(meta->bi_rw & HWM_META_FLAG)) {
+    meta->op = HWM_OP_WRITE_STUB;
+  }
+  return true;
+}
+
+/*
+ * Discards and write zeroes are logged as just the range they cover. Their
+ * BI_SIZE can be far bigger than the data a bio could carry (a whole extent
+ * from fstrim or a punch hole), and there is no data in them worth copying.
+ */
+static unsigned int bio_log_op(struct bio *bio) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+  // Also covers REQ_SECURE, which is only ever set along with REQ_DISCARD.
+  if (bio->BI_RW & REQ_DISCARD) {
+    return HWM_OP_DISCARD;
+  }
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0))
+  if (bio_op(bio) == REQ_OP_DISCARD || bio_op(bio) == REQ_OP_SECURE_ERASE) {
+    return HWM_OP_DISCARD;
+  }
+#elif (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0) \
+    && LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0)) || \
+      LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0) && \
+      LINUX_VERSION_CODE < KERNEL_VERSION(5, 5, 3) || \
+  (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 7))
+  if (bio_op(bio) == REQ_OP_DISCARD || bio_op(bio) == REQ_OP_SECURE_ERASE) {
+    return HWM_OP_DISCARD;
+  }
+  if (bio_op(bio) == REQ_OP_WRITE_ZEROES) {
+    return HWM_OP_WRITE_ZEROES;
+  }
+#else
+#error "Unsupported kernel version: CrashMonkey has not been tested with " \
+  "your kernel version."
+#endif
+  return HWM_OP_WRITE;
+}
+
+/*
+ * Completion of a logged bio. May run in interrupt context, so all it does is
+ * note the time and order, put the bio back the way it was and pass the
+ * completion on.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+static void hwm_end_io(struct bio *bio, int err) {
+#else
+static void hwm_end_io(struct bio *bio) {
+#endif
+  struct hwm_bio_hook *hook = bio->bi_private;
+  struct hwm_device *dev = hook->dev;
+
+  hook->done.done_order = atomic64_inc_return(&dev->order);
+  hook->done.done_ns = ktime_to_ns(ktime_get());
+  bio->bi_end_io = hook->end_io;
+  bio->bi_private = hook->private;
+  atomic_dec(&dev->inflight);
+  llist_add(&hook->node, &dev->done);
+
+  if (bio->bi_end_io != NULL) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 3, 0)
+    bio->bi_end_io(bio, err);
+#else
+    bio->bi_end_io(bio);
+#endif
+  }
+}
+
+/*
+ * Number the submit of a bio that is about to be logged and hook its
+ * completion. If there is no memory for the hook the bio is still logged, just
+ * without a completion record.
+ */
+static void track_bio(struct hwm_device *dev, struct bio *bio,
+    struct disk_write_op_meta *meta) {
+  struct hwm_bio_hook *hook;
+
+  meta->submit_order = atomic64_inc_return(&dev->order);
+  hook = kmem_cache_alloc(hwm_hook_cache, GFP_NOIO);
+  if (hook == NULL) {
+    meta->inflight = atomic_read(&dev->inflight);
+    this_cpu_inc(dev->stats->untracked);
+    return;
+  }
+  meta->inflight = atomic_inc_return(&dev->inflight) - 1;
+  hook->dev = dev;
+  hook->end_io = bio->bi_end_io;
+  hook->private = bio->bi_private;
+  hook->done.submit_order = meta->submit_order;
+  hook->done.done_order = 0;
+  hook->done.done_ns = 0;
+  bio->bi_end_io = hwm_end_io;
+  bio->bi_private = hook;
+}
+
 /*
  * Debug output to dmesg to see what is happening. Only tested on 3.13 and 4.4
  * kernels (and mostly accurrate on 4.4). Only enabled for <= 4.4 kernels
@@ -604,7 +1866,11 @@ static void print_rw_flags(unsigned long rw, unsigned long flags) {
 #endif
 }
 
-// TODO(ashmrtn): Currently not thread safe/reentrant. Make it so.
+/*
+ * Called in the context of whoever submitted the bio, so bios from different
+ * CPUs are logged and passed on in parallel. The only state shared between
+ * them is the sequence number and, while it is mapped, the log ring.
+ */
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
   (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0) && \
@@ -627,9 +1893,9 @@ static blk_qc_t disk_wrapper_bio(struct request_queue* q, struct bio* bio) {
 #error "Unsupported kernel version: CrashMonkey has not been tested with " \
   "your kernel version."
 #endif
-  int copied_data;
   struct disk_write_op *write;
-  struct hwm_device* hwm;
+  struct disk_write_op_meta meta;
+  struct hwm_device* dev = (struct hwm_device*) q->queuedata;
   ktime_t curr_time;
 
   /*
@@ -639,90 +1905,52 @@ static blk_qc_t disk_wrapper_bio(struct request_queue* q, struct bio* bio) {
   */
   // Log information about writes, fua, and flush/flush_seq events in kernel
   // memory.
-  if (Device.log_on && should_log(bio)) {
+  if (dev->log_on && should_log(bio)) {
     curr_time = ktime_get();
 
-    printk(KERN_INFO "hwm: bio rw of size %u headed for 0x%lx (sector 0x%lx)"
-                     " has flags:\n", bio->BI_SIZE, bio->BI_SECTOR * 512,
-           bio->BI_SECTOR);
-    print_rw_flags(bio->BI_RW, bio->bi_flags);
-
-    // Log data to disk logs.
-    write = kzalloc(sizeof(struct disk_write_op), GFP_NOIO);
-    if (write == NULL) {
-      printk(KERN_WARNING "hwm: unable to make new write node\n");
-      goto passthrough;
+    if (unlikely(verbose)) {
+      printk(KERN_INFO "hwm: bio rw of size %u headed for 0x%lx (sector 0x%lx)"
+                       " has flags:\n", bio->BI_SIZE, bio->BI_SECTOR * 512,
+             bio->BI_SECTOR);
+      print_rw_flags(bio->BI_RW, bio->bi_flags);
     }
 
-    write->metadata.bi_flags = convert_flags(bio->bi_flags);
-    write->metadata.bi_rw = convert_flags(bio->BI_RW);
-    write->metadata.write_sector = bio->BI_SECTOR;
-    write->metadata.size = bio->BI_SIZE;
-    write->metadata.time_ns = ktime_to_ns(curr_time);
+    memset(&meta, 0, sizeof(struct disk_write_op_meta));
+    meta.bi_flags = convert_flags(bio->bi_flags);
+    meta.bi_rw = convert_flags(bio->BI_RW);
+    meta.write_sector = bio->BI_SECTOR;
+    meta.size = bio->BI_SIZE;
+    meta.op = bio_log_op(bio);
+    meta.time_ns = ktime_to_ns(curr_time);
 
-    // Protect playing around with our list of logged bios.
-    spin_lock(&Device.lock);
-    if (Device.current_write == NULL) {
-      // With the default first checkpoint, this case should never happen.
-      printk(KERN_WARNING "hwm: found empty list of previous disk ops\n");
+    if (!filter_log(dev, &meta)) {
+      this_cpu_inc(dev->stats->filtered);
+      goto passthrough;
+    }
+    track_bio(dev, bio, &meta);
 
-      // This is the first write in the log.
-      Device.writes = write;
-      // Set the first write in the log so that it's picked up later.
-      Device.current_log_write = write;
-    } else {
-      // Some write(s) was/were already made so add this to the back of the
-      // chain and update pointers.
-      Device.current_write->next = write;
+    // Stream the entry to user-land if it is listening, otherwise keep it in
+    // kernel memory.
+    if (ring_log(dev, &meta, bio)) {
+      count_logged(dev, &meta);
+      goto passthrough;
     }
-    Device.current_write = write;
-    spin_unlock(&Device.lock);
 
-    write->data = kmalloc(write->metadata.size, GFP_NOIO);
-    if (write->data == NULL) {
-      printk(KERN_WARNING "hwm: unable to get memory for data logging\n");
-      kfree(write);
+    write = new_log_entry(dev, &meta, bio);
+    if (write == NULL) {
       goto passthrough;
     }
-    copied_data = 0;
-
-    #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 16, 0)
-    struct bio_vec *vec;
-    int iter;
-    bio_for_each_segment(vec, bio, iter) {
-      //printk(KERN_INFO "hwm: making new page for segment of data\n");
-
-      void *bio_data = kmap(vec->bv_page);
-      memcpy((void*) (write->data + copied_data), bio_data + vec->bv_offset,
-             vec->bv_len);
-      kunmap(bio_data);
-      copied_data += vec->bv_len;
-    }
-    #else
-    struct bio_vec vec;
-    struct bvec_iter iter;
-    bio_for_each_segment(vec, bio, iter) {
-      //printk(KERN_INFO "hwm: making new page for segment of data\n");
-
-      void *bio_data = kmap(vec.bv_page);
-      memcpy((void*) (write->data + copied_data), bio_data + vec.bv_offset,
-             vec.bv_len);
-      kunmap(bio_data);
-      copied_data += vec.bv_len;
-    }
-    #endif
-    // Sanity check which prints data copied to the log.
-    /*
-    printk(KERN_INFO "hwm: copied %ld bytes of from %lx data:"
-        "\n~~~\n%s\n~~~\n",
-        write->metadata.size, write->metadata.write_sector * 512,
-        write->data);
-    */
+    append_log_entry(dev, write);
+    count_logged(dev, &meta);
+    if (dev->spill_wq != NULL && over_log_mem_limit(dev)) {
+      queue_work(dev->spill_wq, &dev->spill_work);
+    }
+  } else {
+    this_cpu_inc(dev->stats->passthrough);
   }
 
  passthrough:
   // Pass request off to normal device driver.
-  hwm = (struct hwm_device*) q->queuedata;
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
   (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0) && \
@@ -731,11 +1959,11 @@ static blk_qc_t disk_wrapper_bio(struct request_queue* q, struct bio* bio) {
     LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)) || \
   (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0))
-  bio->bi_bdev = hwm->target_dev;
+  bio->bi_bdev = dev->target_dev;
   submit_bio(bio->BI_RW, bio);
 #elif (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0))
-  bio->bi_bdev = hwm->target_dev;
+  bio->bi_bdev = dev->target_dev;
   submit_bio(bio);
   return BLK_QC_T_NONE;
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0) && \
@@ -744,8 +1972,8 @@ static blk_qc_t disk_wrapper_bio(struct request_queue* q, struct bio* bio) {
      LINUX_VERSION_CODE < KERNEL_VERSION(5, 5, 3) || \
   (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 7))
-  bio->bi_disk = hwm->target_dev;
-  bio->bi_partno = hwm->target_partno;
+  bio->bi_disk = dev->target_dev;
+  bio->bi_partno = dev->target_partno;
   submit_bio(bio);
   return BLK_QC_T_NONE;
 #else
@@ -754,64 +1982,113 @@ static blk_qc_t disk_wrapper_bio(struct request_queue* q, struct bio* bio) {
 #endif
 }
 
+static void hwm_device_cleanup(struct hwm_device *dev) {
+  if (dev->ring_size > 0) {
+    misc_deregister(&dev->ring_dev);
+  }
+  if (dev->disk_added) {
+    del_gendisk(dev->gd);
+  }
+  if (dev->spill_wq != NULL) {
+    destroy_workqueue(dev->spill_wq);
+  }
+  if (dev->cpu_logs != NULL && dev->stats != NULL &&
+      dev->page_pool != NULL) {
+    drop_logs(dev);
+  }
+  free_done(dev);
+  if (dev->spill_file != NULL) {
+    filp_close(dev->spill_file, NULL);
+  }
+  if (dev->target_dev != NULL) {
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
+  (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(3, 17, 0)) || \
+  (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)) || \
+  (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)) || \
+  (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0))
+    blkdev_put(dev->target_dev, FMODE_READ);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0) || \
+     LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0) && \
+     LINUX_VERSION_CODE < KERNEL_VERSION(5, 5, 3) || \
+  (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0) && \
+    LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 7))
+    blkdev_put(dev->target_bd, FMODE_READ);
+#else
+#error "Unsupported kernel version: CrashMonkey has not been tested with " \
+  "your kernel version."
+#endif
+  }
+  if (dev->gd != NULL) {
+    if (dev->gd->queue != NULL) {
+      blk_cleanup_queue(dev->gd->queue);
+    }
+    put_disk(dev->gd);
+  }
+  if (dev->page_pool != NULL) {
+    mempool_destroy(dev->page_pool);
+  }
+  free_percpu(dev->cpu_logs);
+  free_percpu(dev->stats);
+}
+
+/*
+ * Set up wrapper device i around target_device_path[i]. dev must be zeroed.
+ * Anything set up before a failure is torn down by hwm_device_cleanup.
+ */
 // TODO(ashmrtn): Fix error when wrong device path is passed.
-static int __init disk_wrapper_init(void) {
+static int hwm_device_init(struct hwm_device *dev, int i) {
   unsigned int flush_flags;
   unsigned long queue_flags;
   struct block_device *flags_device, *target_device;
-  struct disk_write_op *first = NULL;
+  const char *flags_path = flags_device_path[num_flags_devices == 1 ? 0 : i];
   ktime_t curr_time;
-  printk(KERN_INFO "hwm: Hello World from module\n");
-  if (strlen(target_device_path) == 0) {
-    return -ENOTTY;
-  }
-  if (strlen(flags_device_path) == 0) {
-    return -ENOTTY;
-  }
-  printk(KERN_INFO "hwm: Wrapping device %s with flags device %s\n",
-      target_device_path, flags_device_path);
+  int cpu;
+
+  dev->index = i;
+  printk(KERN_INFO "hwm%d: Wrapping device %s with flags device %s\n", i,
+      target_device_path[i], flags_path);
   // Get memory for our starting disk epoch node.
-  Device.log_on = false;
+  dev->log_on = false;
   // Make a checkpoint marking the beginning of the log. This will be useful
   // when watches are implemented and people begin a watch at the very start of
   // a test.
-  Device.current_checkpoint = 1;
-  first = kzalloc(sizeof(struct disk_write_op), GFP_NOIO);
-  if (first == NULL) {
-    printk(KERN_WARNING "hwm: error allocating default checkpoint\n");
-    goto out;
+  dev->current_checkpoint = 1;
+  atomic64_set(&dev->seq, 0);
+  dev->stats = alloc_percpu(struct hwm_stats);
+  dev->cpu_logs = alloc_percpu(struct hwm_cpu_log);
+  if (dev->stats == NULL || dev->cpu_logs == NULL) {
+    printk(KERN_WARNING "hwm%d: unable to allocate per-CPU state\n", i);
+    return -ENOMEM;
+  }
+  dev->page_pool = mempool_create_page_pool(pool_pages, 0);
+  if (dev->page_pool == NULL) {
+    printk(KERN_WARNING "hwm%d: unable to reserve pages for logged data\n", i);
+    return -ENOMEM;
+  }
+  dev->writes = kzalloc(sizeof(struct disk_write_op), GFP_NOIO);
+  if (dev->writes == NULL) {
+    printk(KERN_WARNING "hwm%d: error allocating default checkpoint\n", i);
+    return -ENOMEM;
   }
 
   curr_time = ktime_get();
 
-  first->metadata.bi_rw = HWM_CHECKPOINT_FLAG;
-  first->metadata.bi_flags = HWM_CHECKPOINT_FLAG;
-  first->metadata.time_ns = ktime_to_ns(curr_time);
-  Device.writes = first;
-  Device.current_write = first;
-  Device.current_log_write = Device.current_write;
-
-  // Get registered.
-  major_num = register_blkdev(major_num, "hwm");
-  if (major_num <= 0) {
-    printk(KERN_WARNING "hwm: unable to get major number\n");
-    goto out;
-  }
+  dev->writes->metadata.bi_rw = HWM_CHECKPOINT_FLAG;
+  dev->writes->metadata.bi_flags = HWM_CHECKPOINT_FLAG;
+  dev->writes->metadata.time_ns = ktime_to_ns(curr_time);
+  dev->current_write = dev->writes;
+  dev->current_log_write = dev->current_write;
 
-  target_device = blkdev_get_by_path(target_device_path,
-      FMODE_READ, &Device);
+  target_device = blkdev_get_by_path(target_device_path[i], FMODE_READ, dev);
   if (!target_device || IS_ERR(target_device)) {
-    printk(KERN_WARNING "hwm: unable to grab underlying device\n");
-    goto out;
-  }
-  if (!target_device->bd_queue) {
-    printk(KERN_WARNING "hwm: attempt to wrap device with no request queue\n");
-    goto out;
-  }
-  if (!target_device->bd_queue->make_request_fn) {
-    printk(KERN_WARNING "hwm: attempt to wrap device with no "
-        "make_request_fn\n");
-    goto out;
+    printk(KERN_WARNING "hwm%d: unable to grab underlying device\n", i);
+    return -ENODEV;
   }
 
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
@@ -824,30 +2101,43 @@ static int __init disk_wrapper_init(void) {
     LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)) || \
   (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0))
-  Device.target_dev = target_device;
+  dev->target_dev = target_device;
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0) || \
      LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0) && \
      LINUX_VERSION_CODE < KERNEL_VERSION(5, 5, 3) || \
   (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 7))
-  Device.target_dev = target_device->bd_disk;
-  Device.target_partno = target_device->bd_partno;
-  Device.target_bd = target_device;
+  dev->target_dev = target_device->bd_disk;
+  dev->target_partno = target_device->bd_partno;
+  dev->target_bd = target_device;
 #else
 #error "Unsupported kernel version: CrashMonkey has not been tested with " \
   "your kernel version."
 #endif
 
+  if (!target_device->bd_queue) {
+    printk(KERN_WARNING "hwm%d: attempt to wrap device with no request "
+        "queue\n", i);
+    return -ENODEV;
+  }
+  if (!target_device->bd_queue->make_request_fn) {
+    printk(KERN_WARNING "hwm%d: attempt to wrap device with no "
+        "make_request_fn\n", i);
+    return -ENODEV;
+  }
+
   // Get the device we should copy flags from and copy those flags into locals.
-  flags_device = blkdev_get_by_path(flags_device_path, FMODE_READ, &Device);
+  flags_device = blkdev_get_by_path(flags_path, FMODE_READ, dev);
   if (!flags_device || IS_ERR(flags_device)) {
-    printk(KERN_WARNING "hwm: unable to grab device to clone flags\n");
-    goto out;
+    printk(KERN_WARNING "hwm%d: unable to grab device to clone flags\n", i);
+    return -ENODEV;
   }
   if (!flags_device->bd_queue) {
-    printk(KERN_WARNING "hwm: attempt to wrap device with no request queue\n");
-    goto out;
+    printk(KERN_WARNING "hwm%d: attempt to wrap device with no request "
+        "queue\n", i);
+    blkdev_put(flags_device, FMODE_READ);
+    return -ENODEV;
   }
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
@@ -864,28 +2154,48 @@ static int __init disk_wrapper_init(void) {
   blkdev_put(flags_device, FMODE_READ);
 
   // Set up our internal device.
-  spin_lock_init(&Device.lock);
+  spin_lock_init(&dev->lock);
+  spin_lock_init(&dev->dedupe_lock);
+  hash_init(dev->dedupe);
+  mutex_init(&dev->log_mutex);
+  atomic_long_set(&dev->log_pages, 0);
+  for_each_possible_cpu(cpu) {
+    spin_lock_init(&per_cpu_ptr(dev->cpu_logs, cpu)->lock);
+  }
+  spin_lock_init(&dev->ring_lock);
+  init_waitqueue_head(&dev->ring_wait);
+  atomic64_set(&dev->order, 0);
+  atomic_set(&dev->inflight, 0);
+  init_llist_head(&dev->done);
+  atomic_set(&dev->ring_open, 0);
+  atomic_set(&dev->ring_writers, 0);
+  dev->ring_on = false;
 
   // And the gendisk structure.
-  Device.gd = alloc_disk(1);
-  if (!Device.gd) {
-    goto out;
+  dev->gd = alloc_disk(1);
+  if (!dev->gd) {
+    return -ENOMEM;
   }
 
-  Device.gd->private_data = &Device;
-  Device.gd->major = major_num;
-  Device.gd->first_minor = target_device->bd_disk->first_minor;
-  Device.gd->minors = target_device->bd_disk->minors;
-  set_capacity(Device.gd, get_capacity(target_device->bd_disk));
-  strcpy(Device.gd->disk_name, "hwm");
-  Device.gd->fops = &disk_wrapper_ops;
+  dev->gd->private_data = dev;
+  dev->gd->major = major_num;
+  // Leave room for the partitions of each wrapped device.
+  dev->gd->first_minor = i * DISK_MAX_PARTS;
+  dev->gd->minors = target_device->bd_disk->minors;
+  set_capacity(dev->gd, get_capacity(target_device->bd_disk));
+  snprintf(dev->gd->disk_name, DISK_NAME_LEN, "hwm%d", i);
+  dev->gd->fops = &disk_wrapper_ops;
 
   // Get a request queue.
-  Device.gd->queue = blk_alloc_queue(GFP_KERNEL);
-  if (Device.gd->queue == NULL) {
-    goto out;
+  dev->gd->queue = blk_alloc_queue(GFP_KERNEL);
+  if (dev->gd->queue == NULL) {
+    return -ENOMEM;
   }
-  blk_queue_make_request(Device.gd->queue, disk_wrapper_bio);
+  blk_queue_make_request(dev->gd->queue, disk_wrapper_bio);
+  // Use the limits of the device we wrap so bios aren't split up any more than
+  // they would be going straight to it.
+  blk_set_stacking_limits(&dev->gd->queue->limits);
+  blk_queue_stack_limits(dev->gd->queue, bdev_get_queue(target_device));
   // Make this queue have the same flags as the queue we're feeding into.
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
@@ -895,12 +2205,12 @@ static int __init disk_wrapper_init(void) {
     LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)) || \
   (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0))
-  Device.gd->queue->flush_flags = flush_flags;
+  dev->gd->queue->flush_flags = flush_flags;
 #endif
-  Device.gd->queue->queue_flags = queue_flags;
-  Device.gd->queue->queuedata = &Device;
-  printk(KERN_INFO "hwm: working with queue with:\n\tflags 0x%lx\n",
-      Device.gd->queue->queue_flags);
+  dev->gd->queue->queue_flags = queue_flags;
+  dev->gd->queue->queuedata = dev;
+  printk(KERN_INFO "hwm%d: working with queue with:\n\tflags 0x%lx\n", i,
+      dev->gd->queue->queue_flags);
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
   (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0) && \
@@ -909,47 +2219,109 @@ static int __init disk_wrapper_init(void) {
     LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)) || \
   (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0) && \
     LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0))
-  printk(KERN_INFO "hwm: working with queue with:\n\tflush flags 0x%lx\n",
-      Device.gd->queue->flush_flags);
+  printk(KERN_INFO "hwm%d: working with queue with:\n\tflush flags 0x%lx\n",
+      i, dev->gd->queue->flush_flags);
 #endif
 
-  add_disk(Device.gd);
+  if (i < num_spill_paths && strlen(spill_path[i]) > 0) {
+    dev->spill_file = filp_open(spill_path[i],
+        O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(dev->spill_file)) {
+      printk(KERN_WARNING "hwm%d: unable to open spill file %s\n", i,
+          spill_path[i]);
+      dev->spill_file = NULL;
+    } else {
+      INIT_WORK(&dev->spill_work, spill_logs);
+      dev->spill_wq = alloc_ordered_workqueue("hwm%d_spill", WQ_MEM_RECLAIM,
+          i);
+      if (dev->spill_wq == NULL) {
+        printk(KERN_WARNING "hwm%d: unable to start log spilling\n", i);
+      }
+    }
+  }
+
+  add_disk(dev->gd);
+  dev->disk_added = true;
+
+  if (ring_size_kb > 0) {
+    dev->ring_size = roundup_pow_of_two((unsigned long) ring_size_kb << 10);
+    if (dev->ring_size < PAGE_SIZE) {
+      dev->ring_size = PAGE_SIZE;
+    }
+    snprintf(dev->ring_name, sizeof(dev->ring_name), "hwm_ring%d", i);
+    dev->ring_dev.minor = MISC_DYNAMIC_MINOR;
+    dev->ring_dev.name = dev->ring_name;
+    dev->ring_dev.fops = &hwm_ring_fops;
+    if (misc_register(&dev->ring_dev)) {
+      printk(KERN_WARNING "hwm%d: unable to register log ring, entries will "
+          "only be kept in kernel memory\n", i);
+      dev->ring_size = 0;
+    }
+  }
 
-  printk(KERN_NOTICE "hwm: initialized\n");
+  printk(KERN_NOTICE "hwm%d: initialized\n", i);
   return 0;
+}
 
-  out:
+static int __init disk_wrapper_init(void) {
+  int ret;
+  int i;
+
+  printk(KERN_INFO "hwm: Hello World from module\n");
+  if (num_target_devices == 0) {
+    return -ENOTTY;
+  }
+  if (num_flags_devices != 1 && num_flags_devices != num_target_devices) {
+    printk(KERN_WARNING "hwm: need one flags device or one per target\n");
+    return -ENOTTY;
+  }
+
+  // Get registered.
+  major_num = register_blkdev(major_num, "hwm");
+  if (major_num <= 0) {
+    printk(KERN_WARNING "hwm: unable to get major number\n");
+    return -EBUSY;
+  }
+  hwm_hook_cache = KMEM_CACHE(hwm_bio_hook, 0);
+  if (hwm_hook_cache == NULL) {
+    unregister_blkdev(major_num, "hwm");
+    return -ENOMEM;
+  }
+  devices = vzalloc(num_target_devices * sizeof(struct hwm_device));
+  if (devices == NULL) {
+    kmem_cache_destroy(hwm_hook_cache);
     unregister_blkdev(major_num, "hwm");
     return -ENOMEM;
+  }
+
+  for (i = 0; i < num_target_devices; ++i) {
+    num_devices = i + 1;
+    ret = hwm_device_init(&devices[i], i);
+    if (ret) {
+      goto out;
+    }
+  }
+  return 0;
+
+  out:
+    for (i = 0; i < num_devices; ++i) {
+      hwm_device_cleanup(&devices[i]);
+    }
+    vfree(devices);
+    num_devices = 0;
+    kmem_cache_destroy(hwm_hook_cache);
+    unregister_blkdev(major_num, "hwm");
+    return ret;
 }
 
 static void __exit hello_cleanup(void) {
-  free_logs();
-#if (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 12, 0) && \
-    LINUX_VERSION_CODE < KERNEL_VERSION(3, 14, 0)) || \
-  (LINUX_VERSION_CODE >= KERNEL_VERSION(3, 16, 0) && \
-    LINUX_VERSION_CODE < KERNEL_VERSION(3, 17, 0)) || \
-  (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0) && \
-    LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)) || \
-  (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0) && \
-    LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)) || \
-  (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0) && \
-    LINUX_VERSION_CODE < KERNEL_VERSION(4, 10, 0))
-  blkdev_put(Device.target_dev, FMODE_READ);
-#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0) && \
-    LINUX_VERSION_CODE < KERNEL_VERSION(4, 17, 0) || \
-     LINUX_VERSION_CODE >= KERNEL_VERSION(5, 5, 0) && \
-     LINUX_VERSION_CODE < KERNEL_VERSION(5, 5, 3) || \
-  (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0) && \
-    LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 7))
-  blkdev_put(Device.target_bd, FMODE_READ);
-#else
-#error "Unsupported kernel version: CrashMonkey has not been tested with " \
-  "your kernel version."
-#endif
-  blk_cleanup_queue(Device.gd->queue);
-  del_gendisk(Device.gd);
-  put_disk(Device.gd);
+  int i;
+
+  for (i = 0; i < num_devices; ++i) {
+    hwm_device_cleanup(&devices[i]);
+  }
+  vfree(devices);
+  kmem_cache_destroy(hwm_hook_cache);
   unregister_blkdev(major_num, "hwm");
 
   printk(KERN_INFO "hwm: Cleaning up bye!\n");
@@ -8,11 +8,37 @@
 #define HWM_NEXT_ENT              0xff04
 #define HWM_CLR_LOG               0xff05
 #define HWM_CHECKPOINT            0xff06
+#define HWM_GET_LOG_BATCH         0xff0a
+#define HWM_GET_STATS             0xff0b
+#define HWM_SET_FILTER            0xff0c
+#define HWM_GET_DONE              0xff0d
 
 #define COW_BRD_SNAPSHOT          0xff06
 #define COW_BRD_UNSNAPSHOT        0xff07
 #define COW_BRD_RESTORE_SNAPSHOT  0xff08
 #define COW_BRD_WIPE              0xff09
+// Argument is an open fd of the frozen cow_brd device to branch off of.
+#define COW_BRD_SET_PARENT        0xff0e
+// Issued on a base cow_ram device. NEW fills in a struct cow_brd_snapshot for
+// the snapshot device it made. DEL takes the number of the device to remove.
+#define COW_BRD_NEW_SNAPSHOT      0xff0f
+#define COW_BRD_DEL_SNAPSHOT      0xff10
+// Bulk copy of the populated pages of a device, see struct cow_brd_page_batch.
+#define COW_BRD_GET_PAGES         0xff11
+#define COW_BRD_PUT_PAGES         0xff12
+// Shares the chunks of a snapshot device that other snapshot devices also
+// have. Needs cow_brd loaded with dedupe=1.
+#define COW_BRD_DEDUPE            0xff13
+// Fills in a struct cow_brd_stats for the device.
+#define COW_BRD_GET_STATS         0xff14
+// Applies a struct cow_brd_write_vec straight to the device's pages.
+#define COW_BRD_WRITE_VEC         0xff15
+// REGISTER_LOG takes a struct cow_brd_write_vec of a whole recorded workload
+// and keeps a copy of it with the base cow_ram device it is issued on, or
+// drops the copy if count is 0. APPLY_STATE then takes a struct cow_brd_state
+// made of pieces of that log and writes it to a device based on that disk.
+#define COW_BRD_REGISTER_LOG      0xff16
+#define COW_BRD_APPLY_STATE       0xff17
 
 // Defines that are separate from the kernel because these values aren't stable.
 // Based on 4.4 kernel flags. Comments below sourced from 4.4 Linux kernel.
@@ -125,6 +151,19 @@ enum flag_shifts {
 #define HWM_WRITE_ZEROES_FLAG (1ULL << REQ_OP_WRITE_ZEROES_)
 
 #define HWM_CHECKPOINT_FLAG       (1ULL << 63)
+// Never set by the wrapper. Marks an entry in a saved profile whose data is the
+// struct hwm_filter the log was recorded with.
+#define HWM_FILTER_NOTE_FLAG      (1ULL << 62)
+
+// What a log entry describes. Everything but discards and write zeroes
+// (including flushes and checkpoints) is a HWM_OP_WRITE. Discard and write
+// zeroes entries only record the range they cover, size bytes starting at
+// write_sector, and carry no data. HWM_OP_WRITE_STUB entries are writes the
+// capture filter left out; instead of the data they carry a 64-bit hash of it.
+#define HWM_OP_WRITE          0
+#define HWM_OP_DISCARD        1
+#define HWM_OP_WRITE_ZEROES   2
+#define HWM_OP_WRITE_STUB     3
 
 // For ease of transferring data to user-land.
 struct disk_write_op_meta {
@@ -132,7 +171,245 @@ struct disk_write_op_meta {
   unsigned long long bi_rw;
   unsigned long write_sector;
   unsigned int size;
+  unsigned int op;
   unsigned long long time_ns;
+  // Submits and completions of logged bios are numbered from one counter, so
+  // bio a completed before bio b was submitted iff
+  // a.done_order < b.submit_order. The wrapper only fills in submit_order and
+  // inflight, the done fields come from HWM_GET_DONE and are 0 if the bio's
+  // completion was not seen.
+  unsigned long long submit_order;
+  unsigned long long done_order;
+  unsigned long long done_ns;
+  // Other logged bios that had been submitted but not completed when this one
+  // was submitted.
+  unsigned long long inflight;
+};
+
+// Bytes of data that follow a log entry's metadata.
+#define HWM_DATA_SIZE(meta) \
+  ((meta).op == HWM_OP_WRITE ? (meta).size : \
+   (meta).op == HWM_OP_WRITE_STUB ? sizeof(unsigned long long) : 0)
+
+// Argument for HWM_SET_FILTER, which picks the bios that get logged. A bio is
+// logged if its op is in ops (a mask of 1 << HWM_OP_*, 0 for all), its bi_rw
+// has all of required_flags and none of excluded_flags, and it touches one of
+// the first nr_ranges sector ranges [start, end) (any sector if nr_ranges is
+// 0). Flushes and FUA writes are always logged since they are what splits the
+// log into epochs. With HWM_FILTER_META_ONLY, writes that pass the filter but
+// are not marked as metadata are logged as HWM_OP_WRITE_STUB entries. The
+// filter can only be changed while logging is off and a NULL argument removes
+// it.
+#define HWM_FILTER_MAX_RANGES 8
+#define HWM_FILTER_META_ONLY  (1U << 0)
+
+struct hwm_filter_range {
+  unsigned long long start;
+  unsigned long long end;
+};
+
+struct hwm_filter {
+  unsigned long long required_flags;
+  unsigned long long excluded_flags;
+  unsigned int ops;
+  unsigned int flags;
+  unsigned int nr_ranges;
+  struct hwm_filter_range ranges[HWM_FILTER_MAX_RANGES];
+};
+
+// Records returned by HWM_GET_LOG_BATCH are a struct disk_write_op_meta
+// immediately followed by HWM_DATA_SIZE(metadata) bytes of data, padded so that
+// the next record starts on a HWM_LOG_BATCH_ALIGN byte boundary.
+#define HWM_LOG_BATCH_ALIGN 8ULL
+#define HWM_LOG_BATCH_RECORD_SIZE(data_size) \
+  ((sizeof(struct disk_write_op_meta) + (data_size) + \
+    (HWM_LOG_BATCH_ALIGN - 1)) & ~(HWM_LOG_BATCH_ALIGN - 1))
+
+// Argument for HWM_GET_LOG_BATCH. The caller provides buf and buf_size, the
+// wrapper fills in count and bytes. If not even the next record fits in buf,
+// the ioctl fails with ENOSPC and bytes is set to the size that record needs.
+struct disk_write_op_batch {
+  unsigned long long buf;
+  unsigned long long buf_size;
+  unsigned long long bytes;
+  unsigned int count;
+};
+
+// Completion of the logged bio with the given submit_order.
+struct hwm_done {
+  unsigned long long submit_order;
+  unsigned long long done_order;
+  unsigned long long done_ns;
+};
+
+// Argument for HWM_GET_DONE. Up to max struct hwm_done records for bios that
+// completed since the last call are copied to buf and count is set to how many
+// were. Records are handed out once, in no particular order.
+struct hwm_done_batch {
+  unsigned long long buf;
+  unsigned int max;
+  unsigned int count;
+};
+
+// Bios are counted in size bucket 0 if they carry no data, in bucket i if they
+// are at most HWM_STATS_MIN_BUCKET_SIZE << (i - 1) bytes, and in the last
+// bucket otherwise.
+#define HWM_STATS_SIZE_BUCKETS    8
+#define HWM_STATS_MIN_BUCKET_SIZE 4096
+#define HWM_STATS_NR_FLAGS        64
+
+// Counters returned by HWM_GET_STATS. They are reset by HWM_CLR_LOG. Every
+// field is an unsigned long long so the wrapper can sum them as an array.
+struct hwm_stats {
+  // Bios put in the log and the bytes of data they carried. Discards and write
+  // zeroes carry none.
+  unsigned long long logged;
+  unsigned long long bytes;
+  // Bios passed through without being logged because logging was off or they
+  // were not writes.
+  unsigned long long passthrough;
+  // Bios passed through unlogged because memory for the entry ran out.
+  unsigned long long alloc_failures;
+  unsigned long long checkpoints;
+  // Times a bio had to wait for user-land to make room in the log ring, and
+  // entries put on the list because they were too big for the ring or the ring
+  // was full.
+  unsigned long long ring_waits;
+  unsigned long long ring_spills;
+  // Logged pages that were all zeros or had the same contents as a page
+  // already in the log, so no memory was kept for them.
+  unsigned long long zero_pages;
+  unsigned long long dedupe_pages;
+  // Logged pages written out to the spill file to stay under log_mem_kb.
+  unsigned long long spilled_pages;
+  // Logged bios not deduped because dedupe_data was set along with log_mem_kb.
+  unsigned long long dedupe_refused;
+  // Bios passed through unlogged because of the HWM_SET_FILTER filter.
+  unsigned long long filtered;
+  // Logged bios whose completion could not be tracked for lack of memory.
+  unsigned long long untracked;
+  // Logged bios with each HWM_*_FLAG bit set in bi_rw.
+  unsigned long long flags[HWM_STATS_NR_FLAGS];
+  unsigned long long sizes[HWM_STATS_SIZE_BUCKETS];
+};
+
+// Layout of the log ring exported by /dev/hwm_ring<i>. The first page of the
+// mapping holds a struct hwm_ring_header, the data area starts at data_offset
+// and is data_size bytes long (always a power of two). producer and consumer
+// are free running byte counts into the data area, so the byte at count c lives
+// at data_offset + (c & (data_size - 1)). Only the wrapper moves producer and
+// only user-land moves consumer.
+struct hwm_ring_header {
+  unsigned long long producer;
+  unsigned long long consumer;
+  unsigned long long data_size;
+  unsigned long long data_offset;
+};
+
+// Record states. A record is reserved in the BUSY state and switched to one of
+// the others once it is complete. PAD records only fill the space at the end
+// of the data area that was too small for the next record. SPILLED records
+// carry only metadata and mean the entry was too big for the ring or the ring
+// was full, so its data should be fetched from the regular log with
+// HWM_GET_LOG_BATCH.
+#define HWM_RING_REC_BUSY     0
+#define HWM_RING_REC_READY    1
+#define HWM_RING_REC_PAD      2
+#define HWM_RING_REC_SPILLED  3
+
+// Every record in the ring starts with this header and is immediately followed
+// by HWM_DATA_SIZE(metadata) bytes of data (none for PAD and SPILLED records).
+// length covers the header, data, and padding up to HWM_RING_ALIGN.
+struct hwm_ring_record {
+  unsigned int length;
+  unsigned int state;
+  struct disk_write_op_meta metadata;
+};
+
+#define HWM_RING_ALIGN 64ULL
+#define HWM_RING_RECORD_SIZE(data_size) \
+  ((sizeof(struct hwm_ring_record) + (data_size) + \
+    (HWM_RING_ALIGN - 1)) & ~(HWM_RING_ALIGN - 1))
+
+// A cow_brd snapshot device made by COW_BRD_NEW_SNAPSHOT. It shows up as
+// /dev/<name>.
+#define COW_BRD_NAME_LEN 32
+struct cow_brd_snapshot {
+  unsigned int number;
+  char name[COW_BRD_NAME_LEN];
+};
+
+// Pages of a cow_brd device moved by COW_BRD_GET_PAGES and COW_BRD_PUT_PAGES.
+// offsets and data are user pointers to room for max byte offsets and max
+// pages of the system page size. GET fills in up to max pages that hold data,
+// the first at or after byte start, sets count and moves start past the last
+// page it looked at, so fewer than max pages means the end was reached. PUT
+// writes count pages to the device.
+struct cow_brd_page_batch {
+  unsigned long long offsets;
+  unsigned long long data;
+  unsigned long long start;
+  unsigned int max;
+  unsigned int count;
+};
+
+// Memory use and copy on write activity of a cow_brd device, from
+// COW_BRD_GET_STATS. Sizes are in system pages.
+struct cow_brd_stats {
+  unsigned long long capacity_pages;
+  // Pages per chunk the device allocates at a time.
+  unsigned long long chunk_pages;
+  // Pages the device holds data for itself, pages that read as zeros or are
+  // shared with other snapshot devices without memory of their own, and pages
+  // of a snapshot device still read from its parent.
+  unsigned long long own_pages;
+  unsigned long long zero_pages;
+  unsigned long long shared_pages;
+  unsigned long long inherited_pages;
+  // Pages kept after restores to be reused.
+  unsigned long long free_pages;
+  // Chunks a snapshot device has had to make for itself because of writes.
+  unsigned long long cow_copies;
+  // Restores through COW_BRD_RESTORE_SNAPSHOT or COW_BRD_SET_PARENT and the
+  // total time spent doing them.
+  unsigned long long restores;
+  unsigned long long restore_ns;
+  // Pages of a base disk that are only in the spill file.
+  unsigned long long spilled_pages;
+};
+
+// One entry of a crash state for COW_BRD_WRITE_VEC. op is one of the HWM_OP_*
+// values and only HWM_OP_WRITE has data, a user pointer to size bytes. offset
+// and size must be multiples of 512.
+struct cow_brd_write {
+  unsigned long long offset;
+  unsigned long long data;
+  unsigned int size;
+  unsigned int op;
+};
+
+// writes is a user pointer to count struct cow_brd_write, applied in order.
+// done is set to how many were applied, even if one of them failed.
+struct cow_brd_write_vec {
+  unsigned long long writes;
+  unsigned int count;
+  unsigned int done;
+};
+
+// size bytes starting offset bytes into entry index of the registered log.
+// Both must be multiples of 512.
+struct cow_brd_state_piece {
+  unsigned int index;
+  unsigned int offset;
+  unsigned int size;
+};
+
+// pieces is a user pointer to count struct cow_brd_state_piece, applied in
+// order. done is set to how many were applied, even if one of them failed.
+struct cow_brd_state {
+  unsigned long long pieces;
+  unsigned int count;
+  unsigned int done;
 };
 
 #endif
@@ -1,7 +1,10 @@
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -19,6 +22,7 @@
 #include <iostream>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <utility>
 
 #include "FsSpecific.h"
@@ -34,13 +38,28 @@
 #define DIRTY_EXPIRE_TIME_PATH "/proc/sys/vm/dirty_expire_centisecs"
 #define DROP_CACHES_PATH       "/proc/sys/vm/drop_caches"
 
+// Wrapper instance i is /dev/hwm<i> with its log ring at /dev/hwm_ring<i>.
 #define FULL_WRAPPER_PATH "/dev/hwm"
+// Size of the buffer handed to the wrapper for each bulk log drain.
+#define LOG_BATCH_BUF_SIZE (4 * 1024 * 1024)
+#define WRAPPER_RING_PATH "/dev/hwm_ring"
+// Completion records fetched from the wrapper per HWM_GET_DONE call.
+#define DONE_BATCH_SIZE 4096
+// Pages moved per COW_BRD_GET_PAGES or COW_BRD_PUT_PAGES call when saving or
+// loading a disk snapshot.
+#define SNAPSHOT_BATCH_PAGES 256
+// Start of a disk snapshot that only holds the pages with data in them.
+#define SNAPSHOT_SPARSE_MAGIC "CMSPARSE"
+// Most crash state entries handed to COW_BRD_WRITE_VEC or COW_BRD_APPLY_STATE
+// at once.
+#define WRITE_VEC_BATCH     1024
+// How long the ring thread sleeps between checks when the ring is empty.
+#define RING_POLL_TIMEOUT_MS 100
 
 // TODO(ashmrtn): Make a quiet and regular version of commands.
 // TODO(ashmrtn): Make so that commands work with user given device path.
 #define SILENT              " > /dev/null 2>&1"
 
-#define MNT_WRAPPER_DEV_PATH FULL_WRAPPER_PATH
 #define MNT_MNT_POINT        "/mnt/snapshot"
 
 #define PART_PART_DRIVE   "fdisk "
@@ -57,16 +76,37 @@
 #define COW_BRD_INSMOD      "insmod " COW_BRD_MODULE_NAME " num_disks="
 #define COW_BRD_INSMOD2      " num_snapshots="
 #define COW_BRD_INSMOD3      " disk_size="
+#define COW_BRD_INSMOD4      " dedupe="
+#define COW_BRD_INSMOD5      " budget="
+#define COW_BRD_INSMOD6      " spill_file="
 #define COW_BRD_RMMOD       "rmmod " COW_BRD_MODULE_NAME
 #define NUM_DISKS           "1"
-#define NUM_SNAPSHOTS       "20"
+// Snapshot devices are made with COW_BRD_NEW_SNAPSHOT as they are needed.
+#define NUM_SNAPSHOTS       "0"
+// Lets snapshot devices that are done being written share identical pages.
+#define DEDUPE_SNAPSHOTS    "1"
 #define COW_BRD_PATH        "/dev/cow_ram0"
+#define COW_BRD_DEV_PATH    "/dev/"
+// Most snapshot devices to use for frozen images of the persisted prefix of
+// crash states.
+#define NUM_PREFIX_IMAGES   4
+// Only make an image if it saves the crash state that makes it at least this
+// many writes.
+#define PREFIX_IMAGE_MIN_WRITES 32
 
 #define DEV_SECTORS_PATH    "/sys/block/"
 #define DEV_SECTORS_PATH_2  "/size"
 
 #define SECTOR_SIZE 512
 
+// <linux/fs.h> conflicts with <sys/mount.h>.
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12, 119)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12, 127)
+#endif
+
 namespace fs_testing {
 
 using std::calloc;
@@ -98,10 +138,42 @@ using fs_testing::utils::disk_write;
 using fs_testing::utils::DiskMod;
 using fs_testing::utils::DiskWriteData;
 
+namespace {
+
+// Keeps reading until size bytes are read or the end of the file. Returns the
+// number of bytes read or -1 on error.
+ssize_t read_all(const int fd, void* buf, const size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t res = read(fd, (char*) buf + done, size - done);
+    if (res < 0) {
+      return -1;
+    } else if (res == 0) {
+      break;
+    }
+    done += res;
+  }
+  return done;
+}
+
+bool write_all(const int fd, const void* buf, const size_t size) {
+  size_t done = 0;
+  while (done < size) {
+    const ssize_t res = write(fd, (const char*) buf + done, size - done);
+    if (res < 0) {
+      return false;
+    }
+    done += res;
+  }
+  return true;
+}
+
+}  // namespace
+
 Tester::Tester(const unsigned int dev_size, const unsigned int sector_size,
     const bool verbosity)
   : device_size(dev_size), sector_size_(sector_size), verbose(verbosity) {
-  snapshot_path_ = "/dev/cow_ram_snapshot1_0";
+  set_wrapper_instance(0);
 }
 
 Tester::~Tester() {
@@ -116,6 +188,21 @@ void Tester::set_fs_type(const string type) {
   assert(fs_specific_ops_ != NULL);
 }
 
+void Tester::set_wrapper_instance(const unsigned int instance) {
+  wrapper_path_ = FULL_WRAPPER_PATH + to_string(instance);
+  wrapper_ring_path_ = WRAPPER_RING_PATH + to_string(instance);
+}
+
+void Tester::set_memory_budget(const unsigned int kbytes,
+    const string spill_file) {
+  memory_budget_ = kbytes;
+  spill_file_ = spill_file;
+}
+
+void Tester::set_completion_pruning(const bool prune) {
+  completion_pruning_ = prune;
+}
+
 void Tester::set_device(const string device_path) {
   device_raw = device_path;
   device_mount = device_raw;
@@ -148,6 +235,30 @@ int Tester::clone_device() {
   return SUCCESS;
 }
 
+/*
+ * Makes a new snapshot device of the base disk and returns its path and, if
+ * number is not NULL, the number to remove it with.
+ */
+int Tester::new_snapshot(string& path, unsigned int* number) {
+  cow_brd_snapshot snap;
+  if (ioctl(cow_brd_fd, COW_BRD_NEW_SNAPSHOT, &snap) < 0) {
+    return DRIVE_CLONE_ERR;
+  }
+  path = COW_BRD_DEV_PATH;
+  path += snap.name;
+  if (number != NULL) {
+    *number = snap.number;
+  }
+  return SUCCESS;
+}
+
+int Tester::delete_snapshot(const unsigned int number) {
+  if (ioctl(cow_brd_fd, COW_BRD_DEL_SNAPSHOT, number) < 0) {
+    return DRIVE_CLONE_ERR;
+  }
+  return SUCCESS;
+}
+
 int Tester::clone_device_restore(int snapshot_fd, bool reread) {
   if (ioctl(snapshot_fd, COW_BRD_RESTORE_SNAPSHOT) < 0) {
     return DRIVE_CLONE_RESTORE_ERR;
@@ -167,6 +278,114 @@ int Tester::clone_device_restore(int snapshot_fd, bool reread) {
   return SUCCESS;
 }
 
+/*
+ * Makes image the parent of the snapshot device, or the base disk if image is
+ * -1. This also drops everything written to the snapshot device.
+ */
+bool Tester::set_snapshot_parent(const int snapshot_fd, const int image) {
+  if (image < 0) {
+    return ioctl(snapshot_fd, COW_BRD_SET_PARENT, cow_brd_fd) == 0;
+  }
+  const int image_fd = open(prefix_images_.at(image).path.c_str(), O_RDONLY);
+  if (image_fd < 0) {
+    return false;
+  }
+  const int res = ioctl(snapshot_fd, COW_BRD_SET_PARENT, image_fd);
+  close(image_fd);
+  return res == 0;
+}
+
+/*
+ * Restores the snapshot device to the deepest prefix image that crash_state
+ * starts with, first making a new image of its persisted prefix if that would
+ * save enough writes and a device is free for it. prefix_written is set to
+ * the number of entries of crash_state already on the snapshot device.
+ */
+int Tester::clone_device_restore_prefix(const int snapshot_fd,
+    vector<DiskWriteData>& crash_state, const unsigned int persisted_prefix,
+    unsigned int& prefix_written) {
+  int parent = -1;
+  for (unsigned int i = 0; i < prefix_images_.size(); ++i) {
+    if (prefix_images_.at(i).prefix_size <= persisted_prefix &&
+        (parent < 0 || prefix_images_.at(i).prefix_size >
+          prefix_images_.at(parent).prefix_size)) {
+      parent = i;
+    }
+  }
+  prefix_written = (parent < 0) ? 0 : prefix_images_.at(parent).prefix_size;
+
+  if (persisted_prefix - prefix_written >= PREFIX_IMAGE_MIN_WRITES &&
+      prefix_images_.size() < NUM_PREFIX_IMAGES) {
+    PrefixImage image;
+    image.prefix_size = persisted_prefix;
+    if (new_snapshot(image.path, &image.number) == SUCCESS) {
+      bool made = false;
+      const int image_fd = open(image.path.c_str(), O_WRONLY);
+      if (image_fd >= 0) {
+        // The writes have to reach the device before it is frozen.
+        made = set_snapshot_parent(image_fd, parent) &&
+          write_crash_state(image_fd, crash_state.begin() + prefix_written,
+              crash_state.begin() + persisted_prefix) &&
+          fsync(image_fd) == 0 && ioctl(image_fd, COW_BRD_SNAPSHOT) == 0;
+        if (made) {
+          // Only saves memory, so it doesn't matter if it fails.
+          ioctl(image_fd, COW_BRD_DEDUPE);
+        }
+        close(image_fd);
+      }
+      if (made) {
+        prefix_images_.push_back(image);
+        parent = prefix_images_.size() - 1;
+        prefix_written = persisted_prefix;
+      } else {
+        delete_snapshot(image.number);
+      }
+    }
+  }
+
+  if (!set_snapshot_parent(snapshot_fd, parent)) {
+    return DRIVE_CLONE_RESTORE_ERR;
+  }
+  return SUCCESS;
+}
+
+void Tester::sample_snapshot_stats(const int snapshot_fd) {
+  cow_brd_stats stats;
+  if (ioctl(snapshot_fd, COW_BRD_GET_STATS, &stats) < 0) {
+    return;
+  }
+  snapshot_stats_ = stats;
+  snapshot_stats_valid_ = true;
+  // Pages kept for reuse are still memory the device is holding on to.
+  snapshot_peak_pages_ = std::max(snapshot_peak_pages_,
+      stats.own_pages + stats.free_pages);
+}
+
+/*
+ * Puts the current snapshot device back on top of the base disk and removes
+ * the prefix images.
+ */
+void Tester::drop_prefix_images() {
+  if (prefix_images_.empty()) {
+    return;
+  }
+  const int snapshot_fd = open(snapshot_path_.c_str(), O_WRONLY);
+  if (snapshot_fd >= 0) {
+    set_snapshot_parent(snapshot_fd, -1);
+    close(snapshot_fd);
+  }
+  // An image's parent always has a shorter prefix, so going from the longest
+  // prefix down removes children before their parents.
+  std::sort(prefix_images_.begin(), prefix_images_.end(),
+      [](const PrefixImage& a, const PrefixImage& b) {
+        return a.prefix_size > b.prefix_size;
+      });
+  for (const PrefixImage& image : prefix_images_) {
+    delete_snapshot(image.number);
+  }
+  prefix_images_.clear();
+}
+
 int Tester::mount_device_raw(const char* opts) {
   if (device_mount.empty()) {
     return MNT_BAD_DEV_ERR;
@@ -177,7 +396,7 @@ int Tester::mount_device_raw(const char* opts) {
 int Tester::mount_wrapper_device(const char* opts) {
   // TODO(ashmrtn): Make some sort of boolean that tracks if we should use the
   // first parition or not?
-  string dev(MNT_WRAPPER_DEV_PATH);
+  string dev(wrapper_path_);
   //dev += "1";
   return mount_device(dev.c_str(), opts);
 }
@@ -225,14 +444,19 @@ int Tester::mapCheckpointToSnapshot(int checkpoint) {
   return 0;
 }
 
-int Tester::getNewDiskClone(int checkpoint) {
+int Tester::getNewDiskClone() {
+  // Nothing writes to the last checkpoint's snapshot until it is checked, so
+  // it can share pages with the others. This only saves memory, so failures
+  // are ignored.
+  const int old_fd = open(snapshot_path_.c_str(), O_RDONLY);
+  if (old_fd >= 0) {
+    ioctl(old_fd, COW_BRD_DEDUPE);
+    close(old_fd);
+  }
   string new_snapshot_path;
-  string path(snapshot_path_);
-  string device_number = path.substr(path.rfind('_'));
-  string snapshot_number = to_string(checkpoint + 2);
-  new_snapshot_path = "/dev/cow_ram_snapshot";
-  new_snapshot_path += snapshot_number;
-  new_snapshot_path += device_number;
+  if (new_snapshot(new_snapshot_path, NULL) != SUCCESS) {
+    return DRIVE_CLONE_ERR;
+  }
   // Finally set snapshot_path_ to the new snapshot path
   snapshot_path_ = new_snapshot_path;
   string command = fs_specific_ops_->GetNewUUIDCommand(new_snapshot_path);
@@ -252,6 +476,14 @@ int Tester::insert_cow_brd() {
     command += NUM_SNAPSHOTS;
     command += COW_BRD_INSMOD3;
     command += std::to_string(device_size);
+    command += COW_BRD_INSMOD4;
+    command += DEDUPE_SNAPSHOTS;
+    if (memory_budget_ > 0) {
+      command += COW_BRD_INSMOD5;
+      command += std::to_string(memory_budget_);
+      command += COW_BRD_INSMOD6;
+      command += spill_file_;
+    }
     if (!verbose) {
       command += SILENT;
     }
@@ -269,6 +501,10 @@ int Tester::insert_cow_brd() {
       return WRAPPER_REMOVE_ERR;
     }
   }
+  // Snapshot device crash states (and the first checkpoint) are written to.
+  if (cow_brd_fd >= 0 && new_snapshot(snapshot_path_, NULL) != SUCCESS) {
+    return DRIVE_CLONE_ERR;
+  }
   return SUCCESS;
 }
 
@@ -306,6 +542,12 @@ int Tester::remove_cow_brd() {
 }
 
 int Tester::insert_wrapper() {
+  struct stat st;
+  // Several testers can record at once on instances of a module that was loaded
+  // with more than one target. Leave removing it to whoever loaded it.
+  if (!wrapper_inserted && stat(wrapper_path_.c_str(), &st) == 0) {
+    return SUCCESS;
+  }
   if (!wrapper_inserted) {
     string command(WRAPPER_INSMOD);
     // TODO(ashmrtn): Make this much MUCH cleaner...
@@ -352,7 +594,7 @@ int Tester::remove_wrapper() {
 }
 
 int Tester::get_wrapper_ioctl() {
-  ioctl_fd = open(FULL_WRAPPER_PATH, O_RDONLY | O_CLOEXEC);
+  ioctl_fd = open(wrapper_path_.c_str(), O_RDONLY | O_CLOEXEC);
   if (ioctl_fd == -1) {
     return WRAPPER_OPEN_DEV_ERR;
   }
@@ -366,8 +608,24 @@ void Tester::put_wrapper_ioctl() {
   }
 }
 
+int Tester::set_wrapper_filter(const hwm_filter& filter) {
+  if (ioctl_fd == -1 || ioctl(ioctl_fd, HWM_SET_FILTER, &filter) != 0) {
+    return WRAPPER_FILTER_ERR;
+  }
+  wrapper_filter_ = filter;
+  wrapper_filter_set_ = true;
+  return SUCCESS;
+}
+
 void Tester::begin_wrapper_logging() {
   if (ioctl_fd != -1) {
+    // Anything already in the log (the leading checkpoint) has to be fetched
+    // before entries start coming through the ring so the order is kept.
+    if (drain_wrapper_log() != SUCCESS) {
+      cerr << "Error getting log entries, not using the log ring\n";
+    } else {
+      start_wrapper_ring();
+    }
     ioctl(ioctl_fd, HWM_LOG_ON);
   }
 }
@@ -375,61 +633,209 @@ void Tester::begin_wrapper_logging() {
 void Tester::end_wrapper_logging() {
   if (ioctl_fd != -1) {
     ioctl(ioctl_fd, HWM_LOG_OFF);
+    stop_wrapper_ring();
   }
 }
 
-int Tester::get_wrapper_log() {
-  if (ioctl_fd != -1) {
-    while (1) {
-      disk_write_op_meta meta;
-
-      int result = ioctl(ioctl_fd, HWM_GET_LOG_META, &meta);
-      if (result == -1) {
-        if (errno == ENODATA) {
-          break;
-        } else if (errno == EFAULT) {
-          cerr << "efault occurred\n";
-          log_data.clear();
-          return WRAPPER_DATA_ERR;
-        }
+/*
+ * Fetches the next entries in the wrapper's in-kernel log into log_data, using
+ * a buffer of at least buf_size bytes. Returns the number of entries fetched or
+ * an error code.
+ */
+int Tester::get_wrapper_log_batch(unsigned long long buf_size) {
+  while (1) {
+    // Each batch gets its own buffer so that the disk_writes carved out of it
+    // can share it instead of copying their data out again.
+    shared_ptr<char> buf(new char[buf_size], [](char *c) {delete[] c;});
+    disk_write_op_batch batch;
+    batch.buf = (unsigned long long) buf.get();
+    batch.buf_size = buf_size;
+    batch.bytes = 0;
+    batch.count = 0;
+
+    const int result = ioctl(ioctl_fd, HWM_GET_LOG_BATCH, &batch);
+    if (result == -1) {
+      if (errno == ENOSPC) {
+        // The next log entry is larger than our buffer.
+        buf_size = batch.bytes;
+        continue;
+      } else if (errno == EFAULT) {
+        cerr << "efault occurred\n";
+        return WRAPPER_MEM_ERR;
       }
+      cerr << "Error getting log entries\n";
+      return WRAPPER_DATA_ERR;
+    }
 
-      char* data = new char[meta.size];
-      result = ioctl(ioctl_fd, HWM_GET_LOG_DATA, data);
-      if (result == -1) {
-        if (errno == ENODATA) {
-          // Should never reach here as loop will break when getting the size
-          // above.
-          break;
-        } else if (errno == EFAULT) {
-          cerr << "efault occurred\n";
-          delete[] data;
-          log_data.clear();
-          return WRAPPER_MEM_ERR;
-        }
-      }
+    unsigned long long offset = 0;
+    for (unsigned int i = 0; i < batch.count; ++i) {
+      disk_write_op_meta meta;
+      memcpy(&meta, buf.get() + offset, sizeof(disk_write_op_meta));
+      // Aliases buf so the data lives as long as any entry that uses it.
+      shared_ptr<char> data(buf,
+          buf.get() + offset + sizeof(disk_write_op_meta));
       log_data.emplace_back(meta, data);
-      delete[] data;
-
-      result = ioctl(ioctl_fd, HWM_NEXT_ENT);
-      if (result == -1) {
-        if (errno == ENODATA) {
-          // Should never reach here as loop will break when getting the size
-          // above.
-          break;
-        } else {
-          cerr << "Error getting next log entry\n";
-          log_data.clear();
-          break;
-        }
-      }
+      offset += HWM_LOG_BATCH_RECORD_SIZE(HWM_DATA_SIZE(meta));
+    }
+    return result;
+  }
+}
+
+// Fetches everything left in the wrapper's in-kernel log into log_data.
+int Tester::drain_wrapper_log() {
+  int result;
+  do {
+    result = get_wrapper_log_batch(LOG_BATCH_BUF_SIZE);
+  } while (result > 0);
+  if (result < 0) {
+    log_data.clear();
+    return result;
+  }
+  return SUCCESS;
+}
+
+int Tester::get_wrapper_log() {
+  if (ioctl_fd != -1) {
+    const int result = drain_wrapper_log();
+    if (result != SUCCESS) {
+      return result;
     }
+    get_wrapper_done();
+    wrapper_stats_valid_ =
+      ioctl(ioctl_fd, HWM_GET_STATS, &wrapper_stats_) == 0;
   }
   std::cout << "fetched " << log_data.size() << " log data entries"
       << std::endl;
   return SUCCESS;
 }
 
+/*
+ * Fills in when each entry in log_data completed from the records the wrapper
+ * kept. Entries whose completion wasn't seen keep a done_order of 0.
+ */
+void Tester::get_wrapper_done() {
+  std::unordered_map<unsigned long long, hwm_done> done;
+  vector<hwm_done> buf(DONE_BATCH_SIZE);
+  hwm_done_batch batch;
+  do {
+    batch.buf = (unsigned long long) buf.data();
+    batch.max = buf.size();
+    batch.count = 0;
+    if (ioctl(ioctl_fd, HWM_GET_DONE, &batch) == -1) {
+      break;
+    }
+    for (unsigned int i = 0; i < batch.count; ++i) {
+      done[buf[i].submit_order] = buf[i];
+    }
+  } while (batch.count == batch.max);
+
+  for (disk_write& dw : log_data) {
+    if (dw.metadata.submit_order == 0) {
+      continue;
+    }
+    const auto record = done.find(dw.metadata.submit_order);
+    if (record != done.end()) {
+      dw.metadata.done_order = record->second.done_order;
+      dw.metadata.done_ns = record->second.done_ns;
+    }
+  }
+}
+
+/*
+ * Maps the wrapper's log ring and starts a thread that moves entries from it
+ * into log_data while the workload runs. If the ring can't be used, entries
+ * stay in kernel memory until get_wrapper_log() is called.
+ */
+void Tester::start_wrapper_ring() {
+  ring_fd_ = open(wrapper_ring_path_.c_str(), O_RDWR | O_CLOEXEC);
+  if (ring_fd_ == -1) {
+    return;
+  }
+
+  // The header page says how big the rest of the ring is.
+  const long page_size = sysconf(_SC_PAGESIZE);
+  void *header = mmap(NULL, page_size, PROT_READ, MAP_SHARED, ring_fd_, 0);
+  if (header == MAP_FAILED) {
+    cerr << "Unable to map wrapper log ring header\n";
+    close(ring_fd_);
+    ring_fd_ = -1;
+    return;
+  }
+  ring_map_size_ = page_size + ((hwm_ring_header *) header)->data_size;
+  munmap(header, page_size);
+
+  ring_map_ = mmap(NULL, ring_map_size_, PROT_READ | PROT_WRITE, MAP_SHARED,
+      ring_fd_, 0);
+  if (ring_map_ == MAP_FAILED) {
+    cerr << "Unable to map wrapper log ring\n";
+    ring_map_ = NULL;
+    close(ring_fd_);
+    ring_fd_ = -1;
+    return;
+  }
+
+  ring_stop_ = false;
+  ring_thread_ = std::thread(&Tester::drain_wrapper_ring, this);
+}
+
+void Tester::stop_wrapper_ring() {
+  if (ring_map_ == NULL) {
+    return;
+  }
+  ring_stop_ = true;
+  ring_thread_.join();
+  // Unmapping and closing tells the wrapper to go back to its in-kernel log.
+  munmap(ring_map_, ring_map_size_);
+  ring_map_ = NULL;
+  close(ring_fd_);
+  ring_fd_ = -1;
+}
+
+// Body of the ring thread.
+void Tester::drain_wrapper_ring() {
+  hwm_ring_header *header = (hwm_ring_header *) ring_map_;
+  char *data = (char *) ring_map_ + header->data_offset;
+  const unsigned long long mask = header->data_size - 1;
+  unsigned long long consumer = header->consumer;
+  struct pollfd pfd = {ring_fd_, POLLIN, 0};
+
+  while (true) {
+    // Checked before reading the producer count so that everything logged
+    // before logging was turned off is still picked up.
+    const bool stop = ring_stop_.load();
+    const unsigned long long producer =
+      __atomic_load_n(&header->producer, __ATOMIC_ACQUIRE);
+    bool busy = false;
+
+    while (consumer != producer) {
+      hwm_ring_record *rec = (hwm_ring_record *) (data + (consumer & mask));
+      const unsigned int state =
+        __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+      if (state == HWM_RING_REC_BUSY) {
+        // The wrapper is still copying data into this one.
+        busy = true;
+        break;
+      } else if (state == HWM_RING_REC_READY) {
+        log_data.emplace_back(rec->metadata, (const char *) (rec + 1));
+      } else if (state == HWM_RING_REC_SPILLED) {
+        // Too big for the ring or the ring was full, it is the next entry in
+        // the in-kernel log.
+        if (get_wrapper_log_batch(HWM_LOG_BATCH_RECORD_SIZE(
+                HWM_DATA_SIZE(rec->metadata))) != 1) {
+          cerr << "Error getting spilled log entry\n";
+        }
+      }
+      consumer += rec->length;
+      __atomic_store_n(&header->consumer, consumer, __ATOMIC_RELEASE);
+    }
+
+    if (stop && !busy) {
+      break;
+    }
+    poll(&pfd, 1, RING_POLL_TIMEOUT_MS);
+  }
+}
+
 void Tester::clear_wrapper_log() {
   if (ioctl_fd != -1) {
     ioctl(ioctl_fd, HWM_CLR_LOG);
@@ -814,7 +1220,9 @@ int Tester::test_check_random_permutations(bool full_bio_replay,
   assert(current_test_suite_ != NULL);
   time_point<steady_clock> start_time = steady_clock::now();
   Permuter *p = permuter_loader.get_instance();
+  p->SetCompletionPruning(completion_pruning_);
   p->InitDataVector(sector_size_, log_data);
+  register_log();
   vector<DiskWriteData> permutes;
   for (int rounds = 0; rounds < num_rounds; ++rounds) {
     // Print status every 1024 iterations.
@@ -857,7 +1265,10 @@ int Tester::test_check_random_permutations(bool full_bio_replay,
     }
     // Begin snapshot timing.
     time_point<steady_clock> snapshot_start_time = steady_clock::now();
-    if (clone_device_restore(cow_brd_snapshot_fd, false) != SUCCESS) {
+    unsigned int prefix_written = 0;
+    if (clone_device_restore_prefix(cow_brd_snapshot_fd, permutes,
+          test_info.permute_data.persisted_prefix, prefix_written)
+        != SUCCESS) {
       test_info.fs_test.SetError(FileSystemTestResult::kSnapshotRestore);
       test_info.PrintResults(log);
       current_test_suite_->TallyReorderingResult(test_info);
@@ -869,10 +1280,11 @@ int Tester::test_check_random_permutations(bool full_bio_replay,
     // End snapshot timing.
 
     // Write recorded data out to block device in different orders so that we
-    // can if they are all valid or not.
+    // can if they are all valid or not. The restore already put the start of
+    // the crash state on the device.
     time_point<steady_clock> bio_write_start_time = steady_clock::now();
-    const int write_data_res =
-      test_write_data(cow_brd_snapshot_fd, permutes.begin(), permutes.end());
+    const int write_data_res = write_crash_state(cow_brd_snapshot_fd,
+        permutes.begin() + prefix_written, permutes.end());
     time_point<steady_clock> bio_write_end_time = steady_clock::now();
     timing_stats[BIO_WRITE_TIME] +=
         duration_cast<milliseconds>(bio_write_end_time - bio_write_start_time);
@@ -883,6 +1295,7 @@ int Tester::test_check_random_permutations(bool full_bio_replay,
       current_test_suite_->TallyReorderingResult(test_info);
       continue;
     }
+    sample_snapshot_stats(cow_brd_snapshot_fd);
     close(cow_brd_snapshot_fd);
 
     // Test the crash state that was just written out.
@@ -903,6 +1316,9 @@ int Tester::test_check_random_permutations(bool full_bio_replay,
     }
   }
 
+  drop_prefix_images();
+  unregister_log();
+
   time_point<steady_clock> end_time = steady_clock::now();
   timing_stats[TOTAL_TIME] = duration_cast<milliseconds>(end_time - start_time);
 
@@ -953,7 +1369,8 @@ int Tester::test_check_log_replay(std::ofstream& log, bool automate_check_test)
     while (log_iter != log_data.end() && !log_iter->is_checkpoint()) {
       DiskWriteData wd = DiskWriteData(true, op_index, 0,
           log_iter->metadata.write_sector * SECTOR_SIZE,
-          log_iter->metadata.size, log_iter->get_data(), 0);
+          log_iter->metadata.size, log_iter->get_data(), 0,
+          log_iter->metadata.op);
       crash_state.push_back(wd);
       ++log_iter;
       ++op_index;
@@ -1093,10 +1510,37 @@ int Tester::test_restore_log() {
   return SUCCESS;
 }
 
+/*
+ * Replay a discard or write zeroes log entry by handing the whole range to the
+ * device instead of writing it out. Devices without discard support keep the
+ * old data, which is one of the states a discard can leave behind anyway.
+ * Stubs of writes the capture filter left out have no data and are skipped.
+ */
+bool Tester::replay_range_op(const int disk_fd, const unsigned int op,
+    const unsigned long long offset, const unsigned long long size) {
+  if (op == HWM_OP_WRITE_STUB) {
+    // The data was never recorded, so there is nothing to write.
+    return true;
+  }
+  uint64_t range[2] = {offset, size};
+  if (op == HWM_OP_DISCARD) {
+    return ioctl(disk_fd, BLKDISCARD, &range) == 0 || errno == EOPNOTSUPP;
+  }
+  return ioctl(disk_fd, BLKZEROOUT, &range) == 0;
+}
+
 bool Tester::test_write_data_dw(const int disk_fd,
     const vector<disk_write>::iterator& start,
     const vector<disk_write>::iterator& end) {
   for (auto current = start; current != end; ++current) {
+    if (current->is_range_op()) {
+      if (!replay_range_op(disk_fd, current->metadata.op,
+            current->metadata.write_sector * SECTOR_SIZE,
+            current->metadata.size)) {
+        return false;
+      }
+      continue;
+    }
     // Operation is not a write so skip it.
     if (!current->has_write_flag()) {
       continue;
@@ -1122,15 +1566,163 @@ bool Tester::test_write_data_dw(const int disk_fd,
   return true;
 }
 
+/*
+ * Writes a crash state straight into the pages of a cow_brd device with
+ * COW_BRD_WRITE_VEC, skipping the block layer and the page cache. Returns 1
+ * on success, 0 if disk_fd doesn't support it and -1 on error.
+ */
+int Tester::write_data_vec(const int disk_fd,
+    const vector<DiskWriteData>::iterator &start,
+    const vector<DiskWriteData>::iterator &end) {
+  vector<cow_brd_write> writes;
+  writes.reserve(WRITE_VEC_BATCH);
+  for (auto current = start; current != end; ++current) {
+    if (current->size != 0) {
+      cow_brd_write w;
+      w.offset = current->disk_offset;
+      w.size = current->size;
+      w.op = current->op;
+      w.data = (current->op == HWM_OP_WRITE) ?
+        (unsigned long long) (uintptr_t) current->GetData() : 0;
+      writes.push_back(w);
+    }
+    if (writes.size() < WRITE_VEC_BATCH && current + 1 != end) {
+      continue;
+    }
+    if (writes.empty()) {
+      break;
+    }
+
+    cow_brd_write_vec vec;
+    vec.writes = (unsigned long long) (uintptr_t) writes.data();
+    vec.count = writes.size();
+    vec.done = 0;
+    if (ioctl(disk_fd, COW_BRD_WRITE_VEC, &vec) < 0) {
+      // Devices that don't know the ioctl fail it with either of these.
+      return (errno == ENOTTY || errno == EINVAL) ? 0 : -1;
+    }
+    writes.clear();
+  }
+  return 1;
+}
+
+/*
+ * Hands log_data to cow_brd so crash states can be built from pieces of it
+ * with COW_BRD_APPLY_STATE instead of copying their data in each time. It is
+ * fine if this fails, write_crash_state() just falls back to copying.
+ */
+void Tester::register_log() {
+  log_registered_ = false;
+  if (cow_brd_fd < 0 || log_data.empty()) {
+    return;
+  }
+  vector<cow_brd_write> writes(log_data.size());
+  for (unsigned int i = 0; i < log_data.size(); ++i) {
+    disk_write& dw = log_data.at(i);
+    cow_brd_write& w = writes.at(i);
+    w.op = dw.metadata.op;
+    w.size = dw.metadata.size;
+    // Flushes and the like can have any sector, and are never applied.
+    w.offset = (w.size == 0) ? 0 :
+      dw.metadata.write_sector * SECTOR_SIZE;
+    w.data = (w.op == HWM_OP_WRITE) ?
+      (unsigned long long) (uintptr_t) dw.get_data().get() : 0;
+  }
+
+  cow_brd_write_vec vec;
+  vec.writes = (unsigned long long) (uintptr_t) writes.data();
+  vec.count = writes.size();
+  vec.done = 0;
+  log_registered_ = ioctl(cow_brd_fd, COW_BRD_REGISTER_LOG, &vec) == 0;
+}
+
+void Tester::unregister_log() {
+  if (!log_registered_) {
+    return;
+  }
+  cow_brd_write_vec vec;
+  vec.writes = 0;
+  vec.count = 0;
+  vec.done = 0;
+  ioctl(cow_brd_fd, COW_BRD_REGISTER_LOG, &vec);
+  log_registered_ = false;
+}
+
+/*
+ * Builds a crash state on disk_fd out of the log registered by
+ * register_log(), passing only which part of which log entry each piece is.
+ * Returns 1 on success, 0 if that can't be done and -1 on error.
+ */
+int Tester::apply_crash_state(const int disk_fd,
+    const vector<DiskWriteData>::iterator &start,
+    const vector<DiskWriteData>::iterator &end) {
+  if (!log_registered_) {
+    return 0;
+  }
+  vector<cow_brd_state_piece> pieces;
+  pieces.reserve(WRITE_VEC_BATCH);
+  for (auto current = start; current != end; ++current) {
+    if (current->size != 0) {
+      const disk_write& dw = log_data.at(current->bio_index);
+      cow_brd_state_piece piece;
+      piece.index = current->bio_index;
+      piece.offset = current->disk_offset -
+        dw.metadata.write_sector * SECTOR_SIZE;
+      piece.size = current->size;
+      pieces.push_back(piece);
+    }
+    if (pieces.size() < WRITE_VEC_BATCH && current + 1 != end) {
+      continue;
+    }
+    if (pieces.empty()) {
+      break;
+    }
+
+    cow_brd_state state;
+    state.pieces = (unsigned long long) (uintptr_t) pieces.data();
+    state.count = pieces.size();
+    state.done = 0;
+    if (ioctl(disk_fd, COW_BRD_APPLY_STATE, &state) < 0) {
+      return (errno == ENOTTY || errno == EINVAL || errno == ENOENT) ? 0 : -1;
+    }
+    pieces.clear();
+  }
+  return 1;
+}
+
+bool Tester::write_crash_state(const int disk_fd,
+    const vector<DiskWriteData>::iterator &start,
+    const vector<DiskWriteData>::iterator &end) {
+  const int apply_res = apply_crash_state(disk_fd, start, end);
+  if (apply_res != 0) {
+    return apply_res > 0;
+  }
+  // Pieces are applied in order, so writing them all again is fine.
+  return test_write_data(disk_fd, start, end);
+}
+
 bool Tester::test_write_data(const int disk_fd,
     const vector<DiskWriteData>::iterator &start,
     const vector<DiskWriteData>::iterator &end) {
+  const int vec_res = write_data_vec(disk_fd, start, end);
+  if (vec_res != 0) {
+    return vec_res > 0;
+  }
+  // Not a cow_brd device. Entries are applied in order, so starting over
+  // from the beginning gives the same result even if some were written.
   for (auto current = start; current != end; ++current) {
     if (current->size == 0) {
       // It's *possible* that zero length sectors could have an invalid
       // disk_offset (I have not tested/confirmed).
       continue;
     }
+    if (current->op != HWM_OP_WRITE) {
+      if (!replay_range_op(disk_fd, current->op, current->disk_offset,
+            current->size)) {
+        return false;
+      }
+      continue;
+    }
     if (lseek(disk_fd, current->disk_offset, SEEK_SET) < 0) {
       return false;
     }
@@ -1214,6 +1806,16 @@ int Tester::log_profile_save(string log_file) {
   // don't break our logging system.
   std::cout << "saving " << log_data.size() << " disk operations" << endl;
   ofstream log(log_file, std::ofstream::trunc | ios::binary);
+  if (wrapper_filter_set_) {
+    // Leading note with the filter the log was recorded with.
+    disk_write_op_meta meta;
+    memset(&meta, 0, sizeof(meta));
+    meta.bi_rw = HWM_FILTER_NOTE_FLAG;
+    meta.size = sizeof(wrapper_filter_);
+    meta.op = HWM_OP_WRITE;
+    disk_write::serialize(log,
+        disk_write(meta, (const char *) &wrapper_filter_));
+  }
   for (const disk_write& dw : log_data) {
     disk_write::serialize(log, dw);
   }
@@ -1226,6 +1828,14 @@ int Tester::log_profile_load(string log_file) {
   while (log.peek() != EOF) {
     log_data.push_back(disk_write::deserialize(log));
   }
+  if (!log_data.empty() &&
+      (log_data.front().metadata.bi_rw & HWM_FILTER_NOTE_FLAG)) {
+    memcpy(&wrapper_filter_, log_data.front().get_data().get(),
+        sizeof(wrapper_filter_));
+    wrapper_filter_set_ = true;
+    log_data.erase(log_data.begin());
+    std::cout << "profile was recorded with a capture filter" << endl;
+  }
   bool err = log.fail();
   int errnum = errno;
   log.close();
@@ -1237,57 +1847,108 @@ int Tester::log_profile_load(string log_file) {
   return SUCCESS;
 }
 
+/*
+ * Saves the pages of the base disk that hold data as a sparse snapshot:
+ * SNAPSHOT_SPARSE_MAGIC and the page size, then batches of a page count, that
+ * many byte offsets and that many pages.
+ */
 int Tester::log_snapshot_save(string log_file) {
-  // TODO(ashmrtn): What happens if this fails?
-  // TODO(ashmrtn): Change device_clone to be an mmap of the disk we need to get
-  // stuff on.
-  // device_size happens to be the number of 1k blocks on cow_brd (from original
-  // brd behavior...), so convert it to a number of bytes.
-  unsigned int dev_bytes = device_size * 2 * 512;
-  unsigned int bytes_done = 0;
-  const unsigned int buf_size = 4096;
-  unsigned int buf[buf_size];
+  const unsigned long long page_size = sysconf(_SC_PAGESIZE);
   int log_fd =
     open(log_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
   if (log_fd < 0) {
     cerr << "error opening log file" << endl;
     return LOG_CLONE_ERR;
   }
+  if (!write_all(log_fd, SNAPSHOT_SPARSE_MAGIC,
+        sizeof(SNAPSHOT_SPARSE_MAGIC) - 1) ||
+      !write_all(log_fd, &page_size, sizeof(page_size))) {
+    cerr << "error writing disk snapshot header" << endl;
+    close(log_fd);
+    return LOG_CLONE_ERR;
+  }
 
-  int res = lseek(cow_brd_fd, 0, SEEK_SET);
-  if (res < 0) {
-    cerr << "error seeking to start of test device" << endl;
+  // cow_brd only sees what has left the page cache.
+  fsync(cow_brd_fd);
+  vector<unsigned long long> offsets(SNAPSHOT_BATCH_PAGES);
+  vector<char> data(SNAPSHOT_BATCH_PAGES * page_size);
+  cow_brd_page_batch batch;
+  batch.offsets = (uintptr_t) offsets.data();
+  batch.data = (uintptr_t) data.data();
+  batch.start = 0;
+  batch.max = SNAPSHOT_BATCH_PAGES;
+  do {
+    if (ioctl(cow_brd_fd, COW_BRD_GET_PAGES, &batch) < 0) {
+      cerr << "error reading pages from raw device to log disk snapshot"
+        << endl;
+      close(log_fd);
+      return LOG_CLONE_ERR;
+    }
+    if (batch.count == 0) {
+      break;
+    }
+    if (!write_all(log_fd, &batch.count, sizeof(batch.count)) ||
+        !write_all(log_fd, offsets.data(),
+          batch.count * sizeof(unsigned long long)) ||
+        !write_all(log_fd, data.data(), batch.count * page_size)) {
+      cerr << "error writing pages to log disk snapshot" << endl;
+      close(log_fd);
+      return LOG_CLONE_ERR;
+    }
+  } while (batch.count == batch.max);
+
+  fsync(log_fd);
+  close(log_fd);
+  return SUCCESS;
+}
+
+/*
+ * Writes the pages of a sparse snapshot saved by log_snapshot_save, read from
+ * just after the magic, to the wiped base disk and snapshots it.
+ */
+int Tester::log_snapshot_load_sparse(const int log_fd) {
+  unsigned long long page_size;
+  if (read_all(log_fd, &page_size, sizeof(page_size)) !=
+        (ssize_t) sizeof(page_size) ||
+      page_size != (unsigned long long) sysconf(_SC_PAGESIZE)) {
+    cerr << "disk snapshot was saved with a different page size" << endl;
     return LOG_CLONE_ERR;
   }
-  while (bytes_done < dev_bytes) {
-    // Read a block of data from the base disk image.
-    unsigned int bytes = 0;
-    unsigned int new_amount = (dev_bytes < bytes_done + buf_size)
-                            ? dev_bytes - bytes_done
-                            : buf_size;
-    do {
-      int res = read(cow_brd_fd, buf + bytes, new_amount - bytes);
-      if (res < 0) {
-        cerr << "error reading from raw device to log disk snapshot" << endl;
-        return LOG_CLONE_ERR;
-      }
-      bytes += res;
-    } while (bytes < new_amount);
 
-    // Write a block of data to the log file.
-    bytes = 0;
-    do {
-      int res = write(log_fd, buf + bytes, new_amount - bytes);
-      if (res < 0) {
-        cerr << "error reading from raw device to log disk snapshot" << endl;
-        return LOG_CLONE_ERR;
-      }
-      bytes += res;
-    } while (bytes < new_amount);
-    bytes_done += new_amount;
+  vector<unsigned long long> offsets(SNAPSHOT_BATCH_PAGES);
+  vector<char> data(SNAPSHOT_BATCH_PAGES * page_size);
+  cow_brd_page_batch batch;
+  batch.offsets = (uintptr_t) offsets.data();
+  batch.data = (uintptr_t) data.data();
+  batch.start = 0;
+  batch.max = SNAPSHOT_BATCH_PAGES;
+  while (true) {
+    const ssize_t res = read_all(log_fd, &batch.count, sizeof(batch.count));
+    if (res == 0) {
+      break;
+    }
+    const size_t offsets_size = batch.count * sizeof(unsigned long long);
+    const size_t data_size = batch.count * page_size;
+    if (res != (ssize_t) sizeof(batch.count) || batch.count > batch.max ||
+        read_all(log_fd, offsets.data(), offsets_size) !=
+          (ssize_t) offsets_size ||
+        read_all(log_fd, data.data(), data_size) != (ssize_t) data_size) {
+      cerr << "error reading pages from log disk snapshot" << endl;
+      return LOG_CLONE_ERR;
+    }
+    if (ioctl(cow_brd_fd, COW_BRD_PUT_PAGES, &batch) < 0) {
+      cerr << "error writing pages from log disk snapshot to raw device"
+        << endl;
+      return LOG_CLONE_ERR;
+    }
   }
 
-  fsync(log_fd);
+  // The pages went around the page cache, so drop anything it held.
+  ioctl(cow_brd_fd, BLKFLSBUF, 0);
+  if (ioctl(cow_brd_fd, COW_BRD_SNAPSHOT) < 0) {
+    cerr << "error restoring snapshot from log" << endl;
+    return LOG_CLONE_ERR;
+  }
   return SUCCESS;
 }
 
@@ -1313,6 +1974,16 @@ int Tester::log_snapshot_load(string log_file) {
     return LOG_CLONE_ERR;
   }
 
+  // Snapshots saved by log_snapshot_save are sparse. Older ones are a copy of
+  // the whole device, which the rest of this handles.
+  char magic[sizeof(SNAPSHOT_SPARSE_MAGIC) - 1];
+  if (read_all(log_fd, magic, sizeof(magic)) == (ssize_t) sizeof(magic) &&
+      memcmp(magic, SNAPSHOT_SPARSE_MAGIC, sizeof(magic)) == 0) {
+    res = log_snapshot_load_sparse(log_fd);
+    close(log_fd);
+    return res;
+  }
+
   // cow_brd_fd is RDONLY.
   int device_path = open(COW_BRD_PATH, O_WRONLY);
   if (device_path < 0) {
@@ -1382,6 +2053,75 @@ void Tester::log_disk_write_data(std::ostream &log) {
   log.flags(fflags);
 }
 
+void Tester::PrintWrapperStats(std::ostream& os) {
+  if (!wrapper_stats_valid_) {
+    return;
+  }
+  os << "wrapper stats:" << endl
+    << "\tlogged bios: " << wrapper_stats_.logged << endl
+    << "\tlogged bytes: " << wrapper_stats_.bytes << endl
+    << "\tpassthrough bios: " << wrapper_stats_.passthrough << endl
+    << "\tallocation failures: " << wrapper_stats_.alloc_failures << endl
+    << "\tcheckpoints: " << wrapper_stats_.checkpoints << endl
+    << "\tlog ring waits: " << wrapper_stats_.ring_waits << endl
+    << "\tlog ring spills: " << wrapper_stats_.ring_spills << endl
+    << "\tzero pages elided: " << wrapper_stats_.zero_pages << endl
+    << "\tduplicate pages elided: " << wrapper_stats_.dedupe_pages << endl
+    << "\tpages spilled to disk: " << wrapper_stats_.spilled_pages << endl
+    << "\tbios not deduped for log_mem_kb: " << wrapper_stats_.dedupe_refused
+    << endl
+    << "\tfiltered bios: " << wrapper_stats_.filtered << endl
+    << "\tuntracked completions: " << wrapper_stats_.untracked << endl;
+
+  os << "\tbios by flag:" << endl;
+  for (unsigned int i = 0; i < HWM_STATS_NR_FLAGS; ++i) {
+    if (wrapper_stats_.flags[i] == 0) {
+      continue;
+    }
+    string name = fs_testing::utils::disk_write::flags_to_string(1ULL << i);
+    if (name.size() > 2 && name.compare(name.size() - 2, 2, ", ") == 0) {
+      name.erase(name.size() - 2);
+    }
+    os << "\t\t" << name << ": " << wrapper_stats_.flags[i] << endl;
+  }
+
+  os << "\tbios by size:" << endl
+    << "\t\tno data: " << wrapper_stats_.sizes[0] << endl;
+  for (unsigned int i = 1; i < HWM_STATS_SIZE_BUCKETS - 1; ++i) {
+    os << "\t\t<= " << (HWM_STATS_MIN_BUCKET_SIZE << (i - 1)) << " bytes: "
+      << wrapper_stats_.sizes[i] << endl;
+  }
+  os << "\t\t> "
+    << (HWM_STATS_MIN_BUCKET_SIZE << (HWM_STATS_SIZE_BUCKETS - 3))
+    << " bytes: " << wrapper_stats_.sizes[HWM_STATS_SIZE_BUCKETS - 1] << endl;
+}
+
+void Tester::PrintSnapshotStats(std::ostream& os) {
+  if (!snapshot_stats_valid_) {
+    return;
+  }
+  const unsigned long long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+  os << "snapshot stats (pages of " << page_kb << " KB):" << endl
+    << "\tpages written by the last crash state: "
+    << snapshot_stats_.own_pages << endl
+    << "\tpages inherited from the base disk or prefix images: "
+    << snapshot_stats_.inherited_pages << endl
+    << "\tzero pages: " << snapshot_stats_.zero_pages << endl
+    << "\tshared pages: " << snapshot_stats_.shared_pages << endl
+    << "\tpages kept for reuse: " << snapshot_stats_.free_pages << endl
+    << "\tpeak pages in use: " << snapshot_peak_pages_ << " ("
+    << snapshot_peak_pages_ * page_kb / 1024 << " MB)" << endl
+    << "\tcopy on write chunks: " << snapshot_stats_.cow_copies << endl
+    << "\trestores: " << snapshot_stats_.restores << " taking "
+    << snapshot_stats_.restore_ns / 1000000 << " ms" << endl;
+
+  cow_brd_stats base_stats;
+  if (cow_brd_fd >= 0 &&
+      ioctl(cow_brd_fd, COW_BRD_GET_STATS, &base_stats) == 0) {
+    os << "\tbase disk pages: " << base_stats.own_pages << endl;
+  }
+}
+
 void Tester::PrintTestStats(std::ostream& os) {
   for (const auto& suite : test_results_) {
     suite.PrintResults(os);
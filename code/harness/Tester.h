@@ -1,15 +1,18 @@
 #ifndef TESTER_H
 #define TESTER_H
 
+#include <atomic>
 #include <chrono>
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 #include <map>
 
 #include "FsSpecific.h"
+#include "../disk_wrapper_ioctl.h"
 #include "../permuter/Permuter.h"
 #include "../results/TestSuiteResult.h"
 #include "../tests/BaseTestCase.h"
@@ -35,6 +38,7 @@
 #define WRAPPER_MEM_ERR          -20
 #define CLEAR_CACHE_ERR          -21
 #define PART_PART_ERR            -22
+#define WRAPPER_FILTER_ERR       -23
 
 #define FMT_EXT4               0
 
@@ -71,6 +75,14 @@ class Tester {
   void set_fs_type(const std::string type);
   void set_device(const std::string device_path);
   void set_flag_device(const std::string device_path);
+  // Which /dev/hwm<instance> to record with. Defaults to 0.
+  void set_wrapper_instance(const unsigned int instance);
+  // Most memory in kbytes cow_brd keeps the base disk in, with the rest
+  // written to spill_file. Must be set before insert_cow_brd().
+  void set_memory_budget(const unsigned int kbytes,
+      const std::string spill_file);
+  // Passed on to Permuter::SetCompletionPruning(). Off by default.
+  void set_completion_pruning(const bool prune);
 
   const char* update_dirty_expire_time(const char* time);
 
@@ -79,6 +91,10 @@ class Tester {
   int format_drive();
   int clone_device();
   int clone_device_restore(int snapshot_fd, bool reread);
+  int clone_device_restore_prefix(const int snapshot_fd,
+      std::vector<fs_testing::utils::DiskWriteData>& crash_state,
+      const unsigned int persisted_prefix, unsigned int& prefix_written);
+  void drop_prefix_images();
 
   int permuter_load_class(const char* path);
   void permuter_unload_class();
@@ -102,7 +118,7 @@ class Tester {
   int umount_snapshot();
 
   int mapCheckpointToSnapshot(int checkpoint);
-  int getNewDiskClone(int checkpoint);
+  int getNewDiskClone();
   void getCompleteRunDiskClone();
 
   int insert_cow_brd();
@@ -116,6 +132,7 @@ class Tester {
   void end_wrapper_logging();
   int get_wrapper_log();
   void clear_wrapper_log();
+  int set_wrapper_filter(const hwm_filter& filter);
   int GetChangeData(const int fd);
 
   int CreateCheckpoint();
@@ -132,6 +149,8 @@ class Tester {
 
   std::chrono::milliseconds get_timing_stat(time_stats timing_stat);
   void PrintTimingStats(std::ostream& os);
+  void PrintWrapperStats(std::ostream& os);
+  void PrintSnapshotStats(std::ostream& os);
   void PrintTestStats(std::ostream& os);
   void StartTestSuite();
   void EndTestSuite();
@@ -155,8 +174,31 @@ class Tester {
   TestSuiteResult *current_test_suite_ = NULL;
 
   bool wrapper_inserted = false;
+  std::string wrapper_path_;
+  std::string wrapper_ring_path_;
   bool cow_brd_inserted = false;
   int cow_brd_fd = -1;
+  unsigned int memory_budget_ = 0;
+  std::string spill_file_;
+  bool completion_pruning_ = false;
+
+  // Frozen cow_brd snapshots holding the first prefix_size entries of the
+  // crash states. Each one branches off of a shallower image or the base disk.
+  struct PrefixImage {
+    std::string path;
+    unsigned int number;
+    unsigned int prefix_size;
+  };
+  std::vector<PrefixImage> prefix_images_;
+
+  // cow_brd counters for the crash state snapshot device as of the last crash
+  // state, and the most memory it has used with a crash state on it.
+  cow_brd_stats snapshot_stats_;
+  bool snapshot_stats_valid_ = false;
+  unsigned long long snapshot_peak_pages_ = 0;
+
+  // Whether log_data is registered with cow_brd for COW_BRD_APPLY_STATE.
+  bool log_registered_ = false;
 
   bool disk_mounted = false;
 
@@ -165,17 +207,60 @@ class Tester {
   std::vector<fs_testing::utils::disk_write> log_data;
   std::vector<std::vector<fs_testing::utils::DiskMod>> mods_;
 
+  // Log ring the wrapper streams entries through while logging is on. Only the
+  // ring thread touches log_data until it is joined.
+  int ring_fd_ = -1;
+  void *ring_map_ = NULL;
+  size_t ring_map_size_ = 0;
+  std::thread ring_thread_;
+  std::atomic<bool> ring_stop_{false};
+
+  // Wrapper counters as of the last get_wrapper_log().
+  hwm_stats wrapper_stats_;
+  bool wrapper_stats_valid_ = false;
+
+  // Capture filter log_data was recorded with. Saved with the profile so the
+  // stub entries it made can be told apart when the profile is reloaded.
+  hwm_filter wrapper_filter_;
+  bool wrapper_filter_set_ = false;
+
   int mount_device(const char* dev, const char* opts);
+  int log_snapshot_load_sparse(const int log_fd);
+
+  int new_snapshot(std::string& path, unsigned int* number);
+  int delete_snapshot(const unsigned int number);
+  bool set_snapshot_parent(const int snapshot_fd, const int image);
+  void sample_snapshot_stats(const int snapshot_fd);
+
+  int get_wrapper_log_batch(unsigned long long buf_size);
+  int drain_wrapper_log();
+  void get_wrapper_done();
+  void start_wrapper_ring();
+  void stop_wrapper_ring();
+  void drain_wrapper_ring();
 
   bool read_dirty_expire_time(int fd);
   bool write_dirty_expire_time(int fd, const char* time);
 
+  bool replay_range_op(const int disk_fd, const unsigned int op,
+      const unsigned long long offset, const unsigned long long size);
   bool test_write_data_dw(const int disk_fd,
       const std::vector<fs_testing::utils::disk_write>::iterator& start,
       const std::vector<fs_testing::utils::disk_write>::iterator& end);
   bool test_write_data(const int disk_fd,
       const std::vector<fs_testing::utils::DiskWriteData>::iterator &start,
       const std::vector<fs_testing::utils::DiskWriteData>::iterator &end);
+  int write_data_vec(const int disk_fd,
+      const std::vector<fs_testing::utils::DiskWriteData>::iterator &start,
+      const std::vector<fs_testing::utils::DiskWriteData>::iterator &end);
+  void register_log();
+  void unregister_log();
+  int apply_crash_state(const int disk_fd,
+      const std::vector<fs_testing::utils::DiskWriteData>::iterator &start,
+      const std::vector<fs_testing::utils::DiskWriteData>::iterator &end);
+  bool write_crash_state(const int disk_fd,
+      const std::vector<fs_testing::utils::DiskWriteData>::iterator &start,
+      const std::vector<fs_testing::utils::DiskWriteData>::iterator &end);
 
   std::vector<std::chrono::milliseconds> test_fsck_and_user_test(
       const std::string device_path, const unsigned int last_checkpoint,
@@ -35,7 +35,7 @@
 #define DIRECTORY_PERMS \
   (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH)
 
-#define OPTS_STRING "bd:cf:e:l:m:np:r:s:t:vFIPS:"
+#define OPTS_STRING "bd:cf:e:l:m:np:r:s:t:vw:B:CFIMO:PR:S:"
 
 namespace {
 
@@ -70,9 +70,15 @@ static const option long_options[] = {
   {"iterations", required_argument, NULL, 's'},
   {"fs-type", required_argument, NULL, 't'},
   {"verbose", no_argument, NULL, 'v'},
+  {"wrapper-instance", required_argument, NULL, 'w'},
+  {"memory-budget", required_argument, NULL, 'B'},
+  {"completion-order", no_argument, NULL, 'C'},
   {"full-bio-replay", no_argument, NULL, 'F'},
   {"no-in-order-replay", no_argument, NULL, 'I'},
+  {"meta-only", no_argument, NULL, 'M'},
+  {"spill-file", required_argument, NULL, 'O'},
   {"no-permuted-order-replay", no_argument, NULL, 'P'},
+  {"capture-range", required_argument, NULL, 'R'},
   {"sector-size", required_argument, NULL, 'S'},
   {0, 0, 0, 0},
 };
@@ -96,12 +102,20 @@ int main(int argc, char** argv) {
   bool in_order_replay = true;
   bool permuted_order_replay = true;
   bool full_bio_replay = false;
+  bool completion_pruning = false;
   int iterations = 10000;
   int disk_size = 10240;
+  int memory_budget = 0;
+  string spill_file("/tmp/cow_brd_spill");
   unsigned int sector_size = 512;
+  unsigned int wrapper_instance = 0;
+  hwm_filter capture_filter;
+  bool use_capture_filter = false;
   int option_idx = 0;
   ServerSocket* background_com = NULL;
 
+  memset(&capture_filter, 0, sizeof(capture_filter));
+
   // Parse command line arguments.
   for (int c = getopt_long(argc, argv, OPTS_STRING, long_options, &option_idx);
         c != -1;
@@ -152,18 +166,54 @@ int main(int argc, char** argv) {
       case 'v':
         verbose = true;
         break;
+      case 'C':
+        // Only for devices without a volatile write cache, which can lose
+        // bios after they complete.
+        completion_pruning = true;
+        break;
       case 'F':
         full_bio_replay = true;
         break;
       case 'I':
         in_order_replay = false;
         break;
+      case 'M':
+        capture_filter.flags |= HWM_FILTER_META_ONLY;
+        use_capture_filter = true;
+        break;
       case 'P':
         permuted_order_replay = false;
         break;
+      case 'R': {
+        // Sector range to record as <start>:<end>, may be given more than
+        // once.
+        char* end = NULL;
+        hwm_filter_range range;
+        range.start = strtoull(optarg, &end, 0);
+        if (*end != ':' ||
+            capture_filter.nr_ranges == HWM_FILTER_MAX_RANGES) {
+          cerr << "Bad capture range " << optarg << endl;
+          return -1;
+        }
+        range.end = strtoull(end + 1, NULL, 0);
+        capture_filter.ranges[capture_filter.nr_ranges++] = range;
+        use_capture_filter = true;
+        break;
+      }
       case 'S':
         sector_size = atoi(optarg);
         break;
+      case 'w':
+        wrapper_instance = atoi(optarg);
+        break;
+      case 'B':
+        // In kbytes like disk_size. The part of the disk past it is kept in
+        // the spill file instead of memory.
+        memory_budget = atoi(optarg);
+        break;
+      case 'O':
+        spill_file = string(optarg);
+        break;
       case '?':
       default:
         return -1;
@@ -222,6 +272,12 @@ int main(int argc, char** argv) {
     return -1;
   }
 
+  if (memory_budget < 0) {
+    cerr << "Please give a positive number for the memory budget to use"
+      << endl;
+    return -1;
+  }
+
   if (sector_size <= 0) {
     cerr << "Please give a positive number for the sector size" << endl;
     return -1;
@@ -274,6 +330,8 @@ int main(int argc, char** argv) {
 
 
   Tester test_harness(disk_size, sector_size, verbose);
+  test_harness.set_memory_budget(memory_budget, spill_file);
+  test_harness.set_completion_pruning(completion_pruning);
   test_harness.StartTestSuite();
 
   cout << "Inserting RAM disk module" << endl;
@@ -284,6 +342,7 @@ int main(int argc, char** argv) {
   }
   test_harness.set_fs_type(fs_type);
   test_harness.set_device(test_dev);
+  test_harness.set_wrapper_instance(wrapper_instance);
   FILE *input;
   char buf[512];
   if(!(input = popen(("fdisk -l " + test_dev + " | grep " + test_dev + ": ").c_str(), "r"))){
@@ -556,6 +615,15 @@ int main(int argc, char** argv) {
     cout << "Clearing wrapper device logs" << endl;
     logfile << "Clearing wrapper device logs" << endl;
     test_harness.clear_wrapper_log();
+    if (use_capture_filter) {
+      cout << "Setting wrapper capture filter" << endl;
+      logfile << "Setting wrapper capture filter" << endl;
+      if (test_harness.set_wrapper_filter(capture_filter) != SUCCESS) {
+        cerr << "Error setting wrapper capture filter" << endl;
+        test_harness.cleanup_harness();
+        return -1;
+      }
+    }
     cout << "Enabling wrapper device logging" << endl;
     logfile << "Enabling wrapper device logging" << endl;
     test_harness.begin_wrapper_logging();
@@ -826,7 +894,7 @@ int main(int argc, char** argv) {
             }
           }
           // get a new diskclone and mount it for next the checkpoint
-          test_harness.getNewDiskClone(checkpoint);
+          test_harness.getNewDiskClone();
           if (!last_checkpoint) {
             if (test_harness.mount_snapshot() != SUCCESS) {
               test_harness.cleanup_harness();
@@ -1027,6 +1095,8 @@ int main(int argc, char** argv) {
         test_harness.get_timing_stat((Tester::time_stats) i).count() <<
         " ms" << endl;
     }
+    test_harness.PrintSnapshotStats(cout);
+    test_harness.PrintSnapshotStats(logfile);
   }
 
   if (in_order_replay) {
@@ -1039,6 +1109,8 @@ int main(int argc, char** argv) {
 
   cout << endl;
   logfile << endl;
+  test_harness.PrintWrapperStats(cout);
+  test_harness.PrintWrapperStats(logfile);
   test_harness.PrintTestStats(cout);
   test_harness.PrintTestStats(logfile);
   test_harness.EndTestSuite();
@@ -53,6 +53,14 @@ bool BioVectorEqual::operator() (const std::vector<unsigned int>& a,
 }
 
 vector<EpochOpSector> epoch_op::ToSectors(unsigned int sector_size) {
+  // Discards and write zeroes have no data to tear, so they are kept as a
+  // single range instead of being replayed sector by sector.
+  if (op.is_range_op()) {
+    return {EpochOpSector(this, 0,
+        kKernelSectorSize * op.metadata.write_sector, op.metadata.size,
+        op.metadata.size)};
+  }
+
   const unsigned int num_sectors =
     (op.metadata.size + (sector_size - 1)) / sector_size;
   vector<EpochOpSector> res(num_sectors);
@@ -78,7 +86,7 @@ vector<EpochOpSector> epoch_op::ToSectors(unsigned int sector_size) {
 DiskWriteData epoch_op::ToWriteData() {
   return DiskWriteData(true, abs_index, 0,
       op.metadata.write_sector * kKernelSectorSize, op.metadata.size,
-      op.get_data(), 0);
+      op.get_data(), 0, op.metadata.op);
 }
 
 EpochOpSector::EpochOpSector() :
@@ -121,7 +129,37 @@ void * EpochOpSector::GetData() {
 DiskWriteData EpochOpSector::ToWriteData() {
   return DiskWriteData(false, parent->abs_index, parent_sector_index,
       disk_offset, size, parent->op.get_data(),
-      (max_sector_size * parent_sector_index));
+      (max_sector_size * parent_sector_index), parent->op.metadata.op);
+}
+
+// A zero done_order means completion wasn't tracked for a.
+bool Permuter::CompletedBefore(const epoch_op &a, const epoch_op &b) {
+  return a.op.metadata.done_order != 0 &&
+    a.op.metadata.done_order < b.op.metadata.submit_order;
+}
+
+// Pull in whole every op that completed before an op already in bitmap.
+void Permuter::AddCompletedBefore(const epoch &epoch,
+    vector<unsigned int> &bitmap) {
+  vector<unsigned int> todo;
+  for (unsigned int i = 0; i < bitmap.size(); ++i) {
+    if (bitmap[i]) {
+      todo.push_back(i);
+    }
+  }
+  // Ops pulled in go back on the list so that what they depend on is pulled in
+  // as well.
+  while (!todo.empty()) {
+    const unsigned int later = todo.back();
+    todo.pop_back();
+    for (unsigned int i = 0; i < bitmap.size(); ++i) {
+      if (i != later && bitmap[i] != kOpWhole &&
+          CompletedBefore(epoch.ops.at(i), epoch.ops.at(later))) {
+        bitmap[i] = kOpWhole;
+        todo.push_back(i);
+      }
+    }
+  }
 }
 
 /*
@@ -309,6 +347,10 @@ vector<epoch>* Permuter::GetEpochs() {
   return &epochs_;
 }
 
+void Permuter::SetCompletionPruning(const bool prune) {
+  completion_pruning_ = prune;
+}
+
 
 bool Permuter::GenerateCrashState(vector<DiskWriteData> &res,
     PermuteTestResult &log_data) {
@@ -352,6 +394,7 @@ bool Permuter::GenerateCrashState(vector<DiskWriteData> &res,
 
   // Messy bit to add everything to the logging data struct.
   log_data.crash_state = res;
+  log_data.completion_pruning = completion_pruning_;
 
   if (exists == 0) {
     completed_permutations_.insert(crash_state_hash);
@@ -403,6 +446,7 @@ bool Permuter::GenerateSectorCrashState(std::vector<DiskWriteData> &res,
   // Move the permuted crash state data over into the returned crash state
   // vector.
   log_data.crash_state = res;
+  log_data.completion_pruning = completion_pruning_;
 
   if (exists == 0) {
     completed_permutations_.insert(crash_state_hash);
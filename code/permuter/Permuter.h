@@ -75,6 +75,13 @@ class Permuter {
   bool GenerateSectorCrashState(
       std::vector<fs_testing::utils::DiskWriteData> &res,
       fs_testing::PermuteTestResult &log_data);
+  /*
+   * Only generate crash states where every bio that had completed before a
+   * bio in the state was submitted is in it too. A completed bio can still be
+   * lost from a volatile write cache, so this is only right for devices
+   * without one. Off by default.
+   */
+  void SetCompletionPruning(const bool prune);
 
  protected:
   std::vector<epoch>* GetEpochs();
@@ -86,8 +93,26 @@ class Permuter {
    */
   std::vector<EpochOpSector> CoalesceSectors(
       std::vector<EpochOpSector> &sector_list);
+  /*
+   * True if the device had completed a before b was submitted. Without a
+   * volatile write cache, a crash state with b but without all of a could not
+   * have happened. Always false for logs recorded without completion
+   * tracking.
+   */
+  static bool CompletedBefore(const epoch_op &a, const epoch_op &b);
+  /*
+   * Given a bitmap of the ops of epoch that are in a crash state (kOpPicked),
+   * set every op that completed before a set op was submitted to kOpWhole,
+   * meaning all of its data must be in the crash state too.
+   */
+  static void AddCompletedBefore(const epoch &epoch,
+      std::vector<unsigned int> &bitmap);
+
+  static const unsigned int kOpPicked = 1;
+  static const unsigned int kOpWhole = 2;
 
   unsigned int sector_size_;
+  bool completion_pruning_ = false;
 
  private:
   virtual void init_data(std::vector<epoch> *data) = 0;
@@ -28,6 +28,10 @@ int GenRandom::operator()(int max) {
   return uid(rand);
 }
 
+RandomPermuter::RandomPermuter() {
+  rand = mt19937(42);
+}
+
 RandomPermuter::RandomPermuter(vector<disk_write> *data) {
   // TODO(ashmrtn): Make a flag to make it random or not.
   rand = mt19937(42);
@@ -59,8 +63,9 @@ bool RandomPermuter::gen_one_state(vector<epoch_op>& res,
   for (unsigned int i = 0; i < num_epochs - 1; ++i) {
     total_elements += GetEpochs()->at(i).ops.size();
   }
-  total_elements += num_requests;
-  res.resize(total_elements);
+  // Leave room for the whole final epoch since the bios picked from it can pull
+  // in others. The extra space is trimmed once the subset is known.
+  res.resize(total_elements + GetEpochs()->at(num_epochs - 1).ops.size());
 
   // Tell CrashMonkey the most recently seen checkpoint for the crash state
   // we're generating. We can't just pull the last epoch because it could be the
@@ -79,6 +84,9 @@ bool RandomPermuter::gen_one_state(vector<epoch_op>& res,
   } else {
     log_data.last_checkpoint = target->checkpoint_epoch;
   }
+  log_data.persisted_prefix = (num_requests < target->ops.size())
+    ? total_elements
+    : total_elements + target->ops.size();
 
   auto curr_iter = res.begin();
   for (unsigned int i = 0; i < num_epochs; ++i) {
@@ -88,14 +96,8 @@ bool RandomPermuter::gen_one_state(vector<epoch_op>& res,
     // Only if num_req < ops in the target epoch, we need to pick a subset, else 
     // we'll just copy all the bios in this epoch
     if (i == num_epochs - 1 && num_requests < target->ops.size()) {
-
-      unsigned int size = num_requests;
-      auto res_end = curr_iter + size;
-
       //This should drop a subset of bios instead of permuting them
-      subset_epoch(curr_iter, res_end, GetEpochs()->at(i));
-
-      curr_iter = res_end;
+      curr_iter = subset_epoch(curr_iter, num_requests, GetEpochs()->at(i));
     } else {
       // Use a for loop since vector::insert inserts new elements and we
       // resized above to the exact size we will have.
@@ -108,6 +110,7 @@ bool RandomPermuter::gen_one_state(vector<epoch_op>& res,
       }
     }
   }
+  res.erase(curr_iter, res.end());
 
   return true;
 }
@@ -178,6 +181,7 @@ bool RandomPermuter::gen_one_sector_state(vector<DiskWriteData> &res,
     res.resize(total_elements);
     auto epoch_end_iterator = epochs->begin() + num_epochs - 1;
     AddEpochs(res.begin(), res.end(), epochs->begin(), epoch_end_iterator);
+    log_data.persisted_prefix = res.size();
     return true;
   } else if (num_requests == epochs->at(num_epochs - 1).ops.size() &&
       epochs->at(num_epochs - 1).ops.back().op.is_barrier()) {
@@ -187,6 +191,7 @@ bool RandomPermuter::gen_one_sector_state(vector<DiskWriteData> &res,
     // + 1 because we also add the full epoch we "crash" in.
     auto epoch_end_iterator = epochs->begin() + num_epochs;
     AddEpochs(res.begin(), res.end(), epochs->begin(), epoch_end_iterator);
+    log_data.persisted_prefix = res.size();
     return true;
   }
 
@@ -201,13 +206,6 @@ bool RandomPermuter::gen_one_sector_state(vector<DiskWriteData> &res,
 
   final_epoch = CoalesceSectors(final_epoch);
 
-  // Result size is now a known quantity.
-  res.resize(total_elements + num_sectors);
-  // Add the requests not in the final epoch to the result.
-  auto epoch_end_iterator = epochs->begin() + (num_epochs - 1);
-  auto res_end = res.begin() + total_elements;
-  AddEpochs(res.begin(), res_end, epochs->begin(), epoch_end_iterator);
-
   // Randomly drop some sectors.
   vector<unsigned int> indices(final_epoch.size());
   iota(indices.begin(), indices.end(), 0);
@@ -217,10 +215,42 @@ bool RandomPermuter::gen_one_sector_state(vector<DiskWriteData> &res,
   // Populate the bitmap to set req_set number of bios. This is required to keep
   // sectors in temporal order when we generate the crash state.
   vector<unsigned char> sector_bitmap(final_epoch.size());
-  for (int i = 0; i < num_sectors; ++i) {
+  unsigned int kept_sectors = 0;
+  for (unsigned int i = 0; i < num_sectors && i < final_epoch.size(); ++i) {
     sector_bitmap[indices[i]] = 1;
+    ++kept_sectors;
+  }
+
+  // Keep every sector of the bios that had completed before a bio with a kept
+  // sector was submitted.
+  epoch &crash_epoch = epochs->at(num_epochs - 1);
+  vector<unsigned int> op_bitmap(crash_epoch.ops.size());
+  for (unsigned int i = 0; i < final_epoch.size(); ++i) {
+    if (sector_bitmap[i]) {
+      op_bitmap[final_epoch.at(i).parent - &crash_epoch.ops.front()] =
+        kOpPicked;
+    }
+  }
+  if (completion_pruning_) {
+    AddCompletedBefore(crash_epoch, op_bitmap);
+  }
+  for (unsigned int i = 0; i < final_epoch.size(); ++i) {
+    const unsigned int op_index =
+      final_epoch.at(i).parent - &crash_epoch.ops.front();
+    if (!sector_bitmap[i] && op_bitmap[op_index] == kOpWhole) {
+      sector_bitmap[i] = 1;
+      ++kept_sectors;
+    }
   }
 
+  // Result size is now a known quantity.
+  res.resize(total_elements + kept_sectors);
+  log_data.persisted_prefix = total_elements;
+  // Add the requests not in the final epoch to the result.
+  auto epoch_end_iterator = epochs->begin() + (num_epochs - 1);
+  auto res_end = res.begin() + total_elements;
+  AddEpochs(res.begin(), res_end, epochs->begin(), epoch_end_iterator);
+
   // Add the sectors corresponding to bitmap indexes to the result.
   auto next_index = res.begin() + total_elements;
   for (unsigned int i = 0; i < sector_bitmap.size(); ++i) {
@@ -236,12 +266,9 @@ bool RandomPermuter::gen_one_sector_state(vector<DiskWriteData> &res,
   return true;
 }
 
-void RandomPermuter::subset_epoch(
-      vector<epoch_op>::iterator &res_start,
-      vector<epoch_op>::iterator &res_end,
+vector<epoch_op>::iterator RandomPermuter::subset_epoch(
+      vector<epoch_op>::iterator res_start, const unsigned int req_size,
       epoch &epoch) {
-
-  unsigned int req_size = distance(res_start, res_end);
   assert(req_size <= epoch.ops.size());
 
   // Even if the number of bios we're placing is less than the number in the
@@ -266,22 +293,26 @@ void RandomPermuter::subset_epoch(
   std::random_shuffle(indices.begin(), indices.end(), subset_random_);
 
   // Populate the bitmap to set req_set number of bios.
-  for (int i = 0; i < req_size; i++) {
-    epoch_op_bitmap[indices[i]] = 1;
+  for (unsigned int i = 0; i < req_size && i < slots; i++) {
+    epoch_op_bitmap[indices[i]] = kOpPicked;
+  }
+  // Bios the device had finished before a picked bio was sent have to be there
+  // too if it has no volatile write cache to lose them from.
+  if (completion_pruning_) {
+    AddCompletedBefore(epoch, epoch_op_bitmap);
   }
 
   // Return the bios corresponding to bitmap indexes.
-  for (unsigned int filled = 0;
-      filled < epoch_op_bitmap.size() && res_start != res_end; filled++) {
-    if (epoch_op_bitmap[filled] == 1) {
+  for (unsigned int filled = 0; filled < epoch_op_bitmap.size(); filled++) {
+    if (epoch_op_bitmap[filled]) {
       *res_start = epoch.ops.at(filled);
       ++res_start;
     }
   }
 
   // We are only placing part of an epoch so we need to return here.
-  if (res_start == res_end) {
-    return;
+  if (req_size <= slots) {
+    return res_start;
   }
 
   assert(epoch.has_barrier);
@@ -290,6 +321,7 @@ void RandomPermuter::subset_epoch(
   // exists (i.e. we won't cause extra shifting when adding the other elements).
   // Decrement out count of empty slots since we have filled one.
   *res_start = epoch.ops.back();
+  return ++res_start;
 }
 
 void RandomPermuter::AddEpochs(const vector<DiskWriteData>::iterator &res_start,
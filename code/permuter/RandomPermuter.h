@@ -35,9 +35,14 @@ class RandomPermuter : public Permuter {
       std::vector<fs_testing::utils::DiskWriteData> &res,
       PermuteTestResult &log_data) override;
 
-  void subset_epoch(
-      std::vector<epoch_op>::iterator &res_start,
-      std::vector<epoch_op>::iterator &res_end, epoch &epoch);
+  /*
+   * Place req_size randomly picked bios of epoch, and any bios they depend on
+   * when completion pruning is on, starting at res_start. Returns the end of
+   * the bios placed.
+   */
+  std::vector<epoch_op>::iterator subset_epoch(
+      std::vector<epoch_op>::iterator res_start, const unsigned int req_size,
+      epoch &epoch);
   /*
    * Add the operations in the epoch_ops contained in the epochs [start, end).
    */
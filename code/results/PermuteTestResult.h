@@ -16,6 +16,12 @@ class PermuteTestResult {
   std::ostream& PrintCrashState(std::ostream& os) const;
 
   unsigned int last_checkpoint;
+  // Number of leading entries in crash_state that are whole epochs written in
+  // log order. Every crash state with at least as long a persisted prefix
+  // starts with the same entries, so they can be written once and shared.
+  unsigned int persisted_prefix = 0;
+  // Whether the permuter left out states that break bio completion order.
+  bool completion_pruning = false;
   std::vector<fs_testing::utils::DiskWriteData> crash_state;
 
 };
@@ -45,6 +45,9 @@ void SingleTestInfo::PrintResults(ostream& os) const {
   os << "): ";
   permute_data.PrintCrashState(os) << endl;
   os << "\tlast checkpoint: " << permute_data.last_checkpoint << endl;
+  if (permute_data.completion_pruning) {
+    os << "\tpruned by bio completion order" << endl;
+  }
   os << "\tfsck result: ";
   fs_test.PrintErrors(os);
   os << endl;
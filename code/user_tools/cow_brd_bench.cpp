@@ -0,0 +1,237 @@
+/*
+ * Measures how reading cow_brd snapshot devices scales when several of them
+ * are used at once, like the harness does when checking crash states in
+ * parallel. Fills the base disk, freezes it, and then has 1, 2, 4, ... threads
+ * each hammer a snapshot device of their own with random O_DIRECT reads. Every
+ * so often each thread writes a small crash state to its device and restores
+ * it. Everything on the base disk is overwritten.
+ *
+ * Usage: cow_brd_bench <base device> [max devices] [seconds] [read size]
+ */
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../disk_wrapper_ioctl.h"
+
+#define DEFAULT_DEVICES    8
+#define DEFAULT_SECONDS    5
+#define DEFAULT_READ_SIZE  4096
+#define BUF_ALIGN          4096
+#define FILL_SIZE          (1024 * 1024)
+// Reads between crash states, and blocks written for each one.
+#define RESTORE_INTERVAL   1024
+#define CRASH_STATE_WRITES 16
+#define DEV_PATH           "/dev/"
+
+using std::atomic;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::thread;
+using std::vector;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::steady_clock;
+
+namespace {
+
+struct BenchResult {
+  unsigned long long reads;
+  unsigned long long restores;
+  double seconds;
+};
+
+// Writes something other than zeros over the whole base disk so reads through
+// the snapshot devices have to find real chunks in it.
+int FillBase(const int fd, const unsigned long long dev_bytes) {
+  void *buf;
+  if (posix_memalign(&buf, BUF_ALIGN, FILL_SIZE) != 0) {
+    return -1;
+  }
+  unsigned long long off = 0;
+  int res = 0;
+  while (off < dev_bytes) {
+    const size_t len = (dev_bytes - off < FILL_SIZE) ?
+      dev_bytes - off : FILL_SIZE;
+    memset(buf, (off / FILL_SIZE) % 255 + 1, len);
+    if (pwrite(fd, buf, len, off) != (ssize_t) len) {
+      res = -1;
+      break;
+    }
+    off += len;
+  }
+  free(buf);
+  return (res < 0) ? res : fsync(fd);
+}
+
+// Each thread reads read_size byte blocks at random aligned offsets of its
+// own snapshot device until told to stop, writing and restoring a crash state
+// every RESTORE_INTERVAL reads.
+void ReadLoop(const string path, const unsigned long long num_blocks,
+    const unsigned int read_size, const unsigned int seed,
+    const atomic<bool>& stop, atomic<unsigned long long>& reads,
+    atomic<unsigned long long>& restores) {
+  const int fd = open(path.c_str(), O_RDWR | O_DIRECT | O_CLOEXEC);
+  if (fd < 0) {
+    cerr << "error opening " << path << endl;
+    return;
+  }
+  void *buf;
+  if (posix_memalign(&buf, BUF_ALIGN, read_size) != 0) {
+    close(fd);
+    return;
+  }
+
+  std::mt19937_64 gen(seed);
+  std::uniform_int_distribution<unsigned long long> block(0, num_blocks - 1);
+  unsigned long long done = 0;
+  unsigned long long restored = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    if (pread(fd, buf, read_size, block(gen) * read_size) != read_size) {
+      cerr << "error reading " << path << endl;
+      break;
+    }
+    if (++done % RESTORE_INTERVAL != 0) {
+      continue;
+    }
+    memset(buf, seed & 0xff, read_size);
+    for (unsigned int i = 0; i < CRASH_STATE_WRITES; ++i) {
+      if (pwrite(fd, buf, read_size, block(gen) * read_size) != read_size) {
+        cerr << "error writing " << path << endl;
+        break;
+      }
+    }
+    if (ioctl(fd, COW_BRD_RESTORE_SNAPSHOT) < 0) {
+      cerr << "error restoring " << path << endl;
+      break;
+    }
+    ++restored;
+  }
+  reads += done;
+  restores += restored;
+  free(buf);
+  close(fd);
+}
+
+void RunBench(const vector<string>& paths, const unsigned int num_devices,
+    const unsigned long long dev_bytes, const unsigned int seconds,
+    const unsigned int read_size, BenchResult& res) {
+  atomic<bool> stop(false);
+  atomic<unsigned long long> reads(0);
+  atomic<unsigned long long> restores(0);
+  vector<thread> threads;
+  const steady_clock::time_point start = steady_clock::now();
+  for (unsigned int i = 0; i < num_devices; ++i) {
+    threads.emplace_back(ReadLoop, paths.at(i), dev_bytes / read_size,
+        read_size, i + 1, std::cref(stop), std::ref(reads),
+        std::ref(restores));
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  stop = true;
+  for (thread& t : threads) {
+    t.join();
+  }
+  const steady_clock::time_point end = steady_clock::now();
+
+  res.reads = reads;
+  res.restores = restores;
+  res.seconds = duration_cast<duration<double>>(end - start).count();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    cerr << "Usage: " << argv[0] << " <base device> [max devices] [seconds] "
+      "[read size]" << endl;
+    return -1;
+  }
+  const string base = argv[1];
+  const unsigned int max_devices =
+    (argc > 2) ? strtoul(argv[2], NULL, 10) : DEFAULT_DEVICES;
+  const unsigned int seconds =
+    (argc > 3) ? strtoul(argv[3], NULL, 10) : DEFAULT_SECONDS;
+  const unsigned int read_size =
+    (argc > 4) ? strtoul(argv[4], NULL, 10) : DEFAULT_READ_SIZE;
+  if (max_devices == 0 || read_size == 0 || read_size % 512 != 0) {
+    cerr << "max devices must be > 0 and read size a multiple of 512" << endl;
+    return -1;
+  }
+
+  const int base_fd = open(base.c_str(), O_RDWR | O_CLOEXEC);
+  if (base_fd < 0) {
+    cerr << "error opening " << base << endl;
+    return -1;
+  }
+  unsigned long long dev_bytes;
+  if (ioctl(base_fd, BLKGETSIZE64, &dev_bytes) < 0 || dev_bytes < read_size) {
+    cerr << "error getting size of " << base << endl;
+    close(base_fd);
+    return -1;
+  }
+  ioctl(base_fd, COW_BRD_UNSNAPSHOT);
+  if (FillBase(base_fd, dev_bytes) < 0) {
+    cerr << "error filling " << base << endl;
+    close(base_fd);
+    return -1;
+  }
+  ioctl(base_fd, BLKFLSBUF, 0);
+  if (ioctl(base_fd, COW_BRD_SNAPSHOT) < 0) {
+    cerr << "error freezing " << base << endl;
+    close(base_fd);
+    return -1;
+  }
+
+  vector<string> paths;
+  vector<unsigned int> numbers;
+  for (unsigned int i = 0; i < max_devices; ++i) {
+    cow_brd_snapshot snap;
+    if (ioctl(base_fd, COW_BRD_NEW_SNAPSHOT, &snap) < 0) {
+      cerr << "error making snapshot device " << i << endl;
+      break;
+    }
+    paths.push_back(string(DEV_PATH) + snap.name);
+    numbers.push_back(snap.number);
+  }
+
+  double single_rate = 0;
+  for (unsigned int n = 1; n <= paths.size(); n *= 2) {
+    BenchResult res;
+    RunBench(paths, n, dev_bytes, seconds, read_size, res);
+    const double rate = res.reads / res.seconds;
+    if (n == 1) {
+      single_rate = rate;
+    }
+    cout << n << " devices: " << res.reads << " reads and " << res.restores
+      << " restores in " << res.seconds << " s, " << rate << " reads/s, "
+      << rate * read_size / (1024 * 1024) << " MiB/s, scaling "
+      << (single_rate > 0 ? rate / single_rate : 0) << "x" << endl;
+  }
+
+  for (const unsigned int number : numbers) {
+    ioctl(base_fd, COW_BRD_DEL_SNAPSHOT, number);
+  }
+
+  cow_brd_stats stats;
+  if (ioctl(base_fd, COW_BRD_GET_STATS, &stats) == 0) {
+    cout << "base disk holds " << stats.own_pages << " pages in memory and "
+      << stats.spilled_pages << " in its spill file" << endl;
+  }
+  close(base_fd);
+  return paths.empty() ? -1 : 0;
+}
@@ -0,0 +1,182 @@
+/*
+ * Measures how much recording with the wrapper module slows down writes.
+ * Hammers the raw target device with random O_DIRECT writes from several
+ * threads, then does the same through the wrapper device with logging on, and
+ * reports the throughput of each. Everything on the target device is
+ * overwritten.
+ *
+ * Usage: wrapper_bench <target device> <wrapper device> [threads] [seconds]
+ *            [write size]
+ */
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <linux/fs.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../disk_wrapper_ioctl.h"
+
+#define DEFAULT_THREADS    4
+#define DEFAULT_SECONDS    5
+#define DEFAULT_WRITE_SIZE 4096
+#define BUF_ALIGN          4096
+
+using std::atomic;
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::thread;
+using std::vector;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+namespace {
+
+struct BenchResult {
+  unsigned long long writes;
+  double seconds;
+};
+
+// Each thread writes write_size byte blocks at random aligned offsets on the
+// device until told to stop.
+void WriteLoop(const int fd, const unsigned long long num_blocks,
+    const unsigned int write_size, const unsigned int seed,
+    const atomic<bool>& stop, atomic<unsigned long long>& writes) {
+  void *buf;
+  if (posix_memalign(&buf, BUF_ALIGN, write_size) != 0) {
+    return;
+  }
+  memset(buf, seed & 0xff, write_size);
+
+  std::mt19937_64 gen(seed);
+  std::uniform_int_distribution<unsigned long long> block(0, num_blocks - 1);
+  unsigned long long done = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    if (pwrite(fd, buf, write_size, block(gen) * write_size) != write_size) {
+      cerr << "error writing to device" << endl;
+      break;
+    }
+    ++done;
+  }
+  writes += done;
+  free(buf);
+}
+
+int RunBench(const string& path, const unsigned int num_threads,
+    const unsigned int seconds, const unsigned int write_size,
+    BenchResult& res) {
+  const int fd = open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+  if (fd < 0) {
+    cerr << "error opening " << path << endl;
+    return -1;
+  }
+  unsigned long long dev_bytes;
+  if (ioctl(fd, BLKGETSIZE64, &dev_bytes) < 0 || dev_bytes < write_size) {
+    cerr << "error getting size of " << path << endl;
+    close(fd);
+    return -1;
+  }
+
+  atomic<bool> stop(false);
+  atomic<unsigned long long> writes(0);
+  vector<thread> threads;
+  const steady_clock::time_point start = steady_clock::now();
+  for (unsigned int i = 0; i < num_threads; ++i) {
+    threads.emplace_back(WriteLoop, fd, dev_bytes / write_size, write_size,
+        i + 1, std::cref(stop), std::ref(writes));
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(seconds));
+  stop = true;
+  for (thread& t : threads) {
+    t.join();
+  }
+  // Include the time for the writes to reach the device.
+  fsync(fd);
+  const steady_clock::time_point end = steady_clock::now();
+  close(fd);
+
+  res.writes = writes;
+  res.seconds = duration_cast<duration<double>>(end - start).count();
+  return 0;
+}
+
+void PrintResult(const string& name, const BenchResult& res,
+    const unsigned int write_size) {
+  cout << name << ": " << res.writes << " writes in " << res.seconds << " s, "
+    << res.writes / res.seconds << " writes/s, "
+    << res.writes * write_size / res.seconds / (1024 * 1024) << " MiB/s"
+    << endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    cerr << "Usage: " << argv[0] << " <target device> <wrapper device> "
+      "[threads] [seconds] [write size]" << endl;
+    return -1;
+  }
+  const string target = argv[1];
+  const string wrapper = argv[2];
+  const unsigned int num_threads =
+    (argc > 3) ? strtoul(argv[3], NULL, 10) : DEFAULT_THREADS;
+  const unsigned int seconds =
+    (argc > 4) ? strtoul(argv[4], NULL, 10) : DEFAULT_SECONDS;
+  const unsigned int write_size =
+    (argc > 5) ? strtoul(argv[5], NULL, 10) : DEFAULT_WRITE_SIZE;
+  if (num_threads == 0 || write_size == 0 || write_size % 512 != 0) {
+    cerr << "threads must be > 0 and write size a multiple of 512" << endl;
+    return -1;
+  }
+
+  BenchResult raw;
+  if (RunBench(target, num_threads, seconds, write_size, raw) < 0) {
+    return -1;
+  }
+
+  const int wrapper_fd = open(wrapper.c_str(), O_RDONLY | O_CLOEXEC);
+  if (wrapper_fd < 0) {
+    cerr << "error opening " << wrapper << endl;
+    return -1;
+  }
+  ioctl(wrapper_fd, HWM_CLR_LOG);
+  ioctl(wrapper_fd, HWM_LOG_ON);
+  BenchResult logged;
+  const int res = RunBench(wrapper, num_threads, seconds, write_size, logged);
+  ioctl(wrapper_fd, HWM_LOG_OFF);
+
+  hwm_stats stats;
+  const bool have_stats = ioctl(wrapper_fd, HWM_GET_STATS, &stats) == 0;
+  // Don't leave a huge log sitting in kernel memory.
+  ioctl(wrapper_fd, HWM_CLR_LOG);
+  close(wrapper_fd);
+  if (res < 0) {
+    return -1;
+  }
+
+  PrintResult("raw device", raw, write_size);
+  PrintResult("wrapper   ", logged, write_size);
+  if (have_stats) {
+    cout << "wrapper logged " << stats.logged << " bios, "
+      << stats.alloc_failures << " allocation failures" << endl;
+  }
+  const double raw_rate = raw.writes / raw.seconds;
+  const double logged_rate = logged.writes / logged.seconds;
+  cout << "recording overhead: "
+    << (raw_rate > 0 ? (1 - logged_rate / raw_rate) * 100 : 0) << "%" << endl;
+  return 0;
+}
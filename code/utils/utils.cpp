@@ -36,6 +36,24 @@ using std::vector;
 namespace {
 
 const unsigned int kSerializeBufSize = 4096;
+// The metadata block of a serialized disk_write may hold a bitmap of the data
+// chunks that are all zeros, which are then left out of the file. Older files
+// have no format flags set.
+const unsigned int kFormatFlagsOffset = 5 * sizeof(uint64_t);
+const unsigned int kZeroChunkMapOffset = kFormatFlagsOffset + sizeof(uint64_t);
+// The submit and completion order of the bio sit at the end of the block.
+const unsigned int kOrderOffset = kSerializeBufSize - 4 * sizeof(uint64_t);
+const unsigned int kZeroChunkMapBits = (kOrderOffset - kZeroChunkMapOffset) * 8;
+const uint64_t kZeroChunkMapFlag = 1;
+const uint64_t kOrderFlag = 2;
+// The HWM_OP_* value of the entry is kept in the format flags above this shift
+// so older files read back as HWM_OP_WRITE.
+const unsigned int kFormatOpShift = 8;
+const uint64_t kFormatOpMask = 0xff;
+
+bool is_zero_chunk(const char *data, const unsigned int size) {
+  return data[0] == 0 && memcmp(data, data + 1, size - 1) == 0;
+}
 
 static const char* const flag_names[] = {
   "write", "fail fast dev", "fail fast transport", "fail fast driver", "sync",
@@ -74,6 +92,10 @@ bool disk_write::is_checkpoint() {
   return !!(metadata.bi_rw & HWM_CHECKPOINT_FLAG);
 }
 
+bool disk_write::is_range_op() {
+  return metadata.op != HWM_OP_WRITE;
+}
+
 disk_write::disk_write() {
   // Apparently contained structs aren't set to 0 on default initialization
   // unless their constructors are defined too. But, we have a struct that is
@@ -82,31 +104,44 @@ disk_write::disk_write() {
   metadata.bi_rw = 0;
   metadata.write_sector = 0;
   metadata.size = 0;
+  metadata.op = HWM_OP_WRITE;
   metadata.time_ns = 0;
+  metadata.submit_order = 0;
+  metadata.done_order = 0;
+  metadata.done_ns = 0;
+  metadata.inflight = 0;
   data.reset();
 }
 
 disk_write::disk_write(const struct disk_write_op_meta& m,
     const char *d) {
   metadata = m;
-  if (metadata.size > 0 && d != NULL) {
-    data.reset(new char[metadata.size], [](char* c) {delete[] c;});
-    memcpy(data.get(), d, metadata.size);
+  if (HWM_DATA_SIZE(metadata) > 0 && d != NULL) {
+    data.reset(new char[HWM_DATA_SIZE(metadata)], [](char* c) {delete[] c;});
+    memcpy(data.get(), d, HWM_DATA_SIZE(metadata));
+  }
+}
+
+disk_write::disk_write(const struct disk_write_op_meta& m,
+    shared_ptr<char> d) {
+  metadata = m;
+  if (HWM_DATA_SIZE(metadata) > 0) {
+    data = d;
   }
 }
 
 bool operator==(const disk_write& a, const disk_write& b) {
   if (tie(a.metadata.bi_flags, a.metadata.bi_rw, a.metadata.write_sector,
-        a.metadata.size) ==
+        a.metadata.size, a.metadata.op) ==
       tie(b.metadata.bi_flags, b.metadata.bi_rw, b.metadata.write_sector,
-        b.metadata.size)) {
+        b.metadata.size, b.metadata.op)) {
     if ((a.data.get() == NULL && b.data.get() != NULL) ||
         (a.data.get() != NULL && b.data.get() == NULL)) {
       return false;
     } else if (a.data.get() == NULL && b.data.get() == NULL) {
       return true;
     }
-    if (memcmp(a.data.get(), b.data.get(), a.metadata.size) == 0) {
+    if (memcmp(a.data.get(), b.data.get(), HWM_DATA_SIZE(a.metadata)) == 0) {
       return true;
     }
   }
@@ -141,6 +176,40 @@ void disk_write::serialize(std::ofstream& fs, const disk_write& dw) {
   memcpy(buffer + buf_offset, &time_ns, sizeof(const uint64_t));
   buf_offset += sizeof(const uint64_t);
 
+  // Mark the chunks of data that are all zeros so they can be skipped.
+  const char *data = (char *) dw.data.get();
+  const unsigned int data_size = HWM_DATA_SIZE(dw.metadata);
+  const unsigned int num_chunks =
+    (data_size + kSerializeBufSize - 1) / kSerializeBufSize;
+  uint64_t format_flags = (uint64_t) dw.metadata.op << kFormatOpShift;
+  if (dw.metadata.submit_order != 0) {
+    format_flags |= kOrderFlag;
+    const uint64_t order[] = {
+      htobe64(dw.metadata.submit_order),
+      htobe64(dw.metadata.done_order),
+      htobe64(dw.metadata.done_ns),
+      htobe64(dw.metadata.inflight),
+    };
+    memcpy(buffer + kOrderOffset, order, sizeof(order));
+  }
+  if (data != NULL && num_chunks <= kZeroChunkMapBits) {
+    format_flags |= kZeroChunkMapFlag;
+    for (unsigned int c = 0; c < num_chunks; ++c) {
+      const unsigned int i = c * kSerializeBufSize;
+      const unsigned int chunk_size =
+        ((i + kSerializeBufSize) > data_size)
+          ? (data_size - i)
+          : kSerializeBufSize;
+      if (is_zero_chunk(data + i, chunk_size)) {
+        buffer[kZeroChunkMapOffset + c / 8] |= 1 << (c % 8);
+      }
+    }
+  }
+  const uint64_t write_format_flags = htobe64(format_flags);
+  memcpy(buffer + kFormatFlagsOffset, &write_format_flags,
+      sizeof(const uint64_t));
+  const char *zero_map = buffer + kZeroChunkMapOffset;
+
   // Write out the 4K buffer containing metadata for this log entry
   fs.write(buffer, kSerializeBufSize);
   if (!fs.good()) {
@@ -150,16 +219,21 @@ void disk_write::serialize(std::ofstream& fs, const disk_write& dw) {
 
   // Write out the actual data for this log entry. Data could be larger than
   // buf_size so loop through this.
-  const char *data = (char *) dw.data.get();
-  for (unsigned int i = 0; i < dw.metadata.size; i += kSerializeBufSize) {
+  char data_buffer[kSerializeBufSize];
+  for (unsigned int i = 0; i < data_size; i += kSerializeBufSize) {
+    const unsigned int c = i / kSerializeBufSize;
+    if ((format_flags & kZeroChunkMapFlag) &&
+        (zero_map[c / 8] & (1 << (c % 8)))) {
+      continue;
+    }
     const unsigned int copy_amount =
-      ((i + kSerializeBufSize) > dw.metadata.size)
-        ? (dw.metadata.size - i)
+      ((i + kSerializeBufSize) > data_size)
+        ? (data_size - i)
         : kSerializeBufSize;
     // Not strictly needed, but it makes it easier.
-    memset(buffer, 0, kSerializeBufSize);
-    memcpy(buffer, data + i, copy_amount);
-    fs.write(buffer, kSerializeBufSize);
+    memset(data_buffer, 0, kSerializeBufSize);
+    memcpy(data_buffer, data + i, copy_amount);
+    fs.write(data_buffer, kSerializeBufSize);
     if (!fs.good()) {
       std::cerr << "some error writing to file" << std::endl;
       return;
@@ -200,12 +274,39 @@ disk_write disk_write::deserialize(ifstream& is) {
   meta.size = be64toh(write_size);
   meta.time_ns = be64toh(time_ns);
 
-  char *data = new char[meta.size];
-  for (unsigned int i = 0; i < meta.size; i += kSerializeBufSize) {
+  uint64_t format_flags;
+  memcpy(&format_flags, buffer + kFormatFlagsOffset, sizeof(uint64_t));
+  format_flags = be64toh(format_flags);
+  meta.op = (format_flags >> kFormatOpShift) & kFormatOpMask;
+  meta.submit_order = 0;
+  meta.done_order = 0;
+  meta.done_ns = 0;
+  meta.inflight = 0;
+  if (format_flags & kOrderFlag) {
+    uint64_t order[4];
+    memcpy(order, buffer + kOrderOffset, sizeof(order));
+    meta.submit_order = be64toh(order[0]);
+    meta.done_order = be64toh(order[1]);
+    meta.done_ns = be64toh(order[2]);
+    meta.inflight = be64toh(order[3]);
+  }
+  // Keep the zero chunk map since buffer is reused to read the data.
+  char zero_map[kSerializeBufSize - kZeroChunkMapOffset];
+  memcpy(zero_map, buffer + kZeroChunkMapOffset, sizeof(zero_map));
+
+  const unsigned int data_size = HWM_DATA_SIZE(meta);
+  char *data = new char[data_size];
+  for (unsigned int i = 0; i < data_size; i += kSerializeBufSize) {
     const unsigned int read_amount =
-      ((i + kSerializeBufSize) > meta.size)
-        ? (meta.size - i)
+      ((i + kSerializeBufSize) > data_size)
+        ? (data_size - i)
         : kSerializeBufSize;
+    const unsigned int c = i / kSerializeBufSize;
+    if ((format_flags & kZeroChunkMapFlag) &&
+        (zero_map[c / 8] & (1 << (c % 8)))) {
+      memset(data + i, 0, read_amount);
+      continue;
+    }
     is.read(buffer, kSerializeBufSize);
     // check if read was successful
     assert(is);
@@ -278,9 +379,9 @@ void disk_write::clear_flush_seq_flag() {
 }
 
 shared_ptr<char> disk_write::set_data(const char *d) {
-  if (metadata.size > 0 && d != NULL) {
-    data.reset(new char[metadata.size], [](char* c) {delete[] c;});
-    memcpy(data.get(), d, metadata.size);
+  if (HWM_DATA_SIZE(metadata) > 0 && d != NULL) {
+    data.reset(new char[HWM_DATA_SIZE(metadata)], [](char* c) {delete[] c;});
+    memcpy(data.get(), d, HWM_DATA_SIZE(metadata));
   }
   return data;
 }
@@ -296,17 +397,17 @@ void disk_write::clear_data() {
 
 DiskWriteData::DiskWriteData() :
       full_bio(false), bio_index(0), bio_sector_index(0), disk_offset(0),
-      size(0), data_offset_(0) {
+      size(0), op(HWM_OP_WRITE), data_offset_(0) {
   data_base_.reset();
 }
 
 DiskWriteData::DiskWriteData(bool full_bio, unsigned int bio_index,
     unsigned int bio_sector_index ,unsigned int disk_offset,
     unsigned int size, std::shared_ptr<char> data_base,
-    unsigned int data_offset) :
+    unsigned int data_offset, unsigned int op) :
       full_bio(full_bio), bio_index(bio_index),
       bio_sector_index(bio_sector_index), disk_offset(disk_offset),
-      size(size), data_offset_(data_offset) {
+      size(size), op(op), data_offset_(data_offset) {
   data_base_ = data_base;
 }
 
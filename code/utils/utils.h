@@ -16,6 +16,9 @@ class disk_write {
  public:
   disk_write();
   disk_write(const struct disk_write_op_meta& m, const char *d);
+  // Shares the given data instead of copying it. Used when many log entries
+  // are carved out of a single buffer filled by the wrapper module.
+  disk_write(const struct disk_write_op_meta& m, std::shared_ptr<char> d);
 
   struct disk_write_op_meta metadata;
 
@@ -26,6 +29,9 @@ class disk_write {
   bool is_barrier();
   bool is_async_write();
   bool is_checkpoint();
+  // Discards, write zeroes and stubs of writes left out by the capture filter
+  // only describe a range of the disk and have no data to write.
+  bool is_range_op();
   bool is_meta();
   bool has_flush_flag();
   bool has_flush_seq_flag();
@@ -74,7 +80,7 @@ struct DiskWriteData {
   DiskWriteData(bool full_bio, unsigned int bio_index,
       unsigned int bio_sector_index ,unsigned int disk_offset,
       unsigned int size, std::shared_ptr<char> data_base,
-      unsigned int data_offset);
+      unsigned int data_offset, unsigned int op);
 
   void * GetData();
   // Denotes whether or not this represents the entire epoch_op and not just one
@@ -86,6 +92,10 @@ struct DiskWriteData {
   unsigned int bio_sector_index;
   unsigned int disk_offset;
   unsigned int size;
+  // One of the HWM_OP_* values. For anything but HWM_OP_WRITE there is no data
+  // and size bytes at disk_offset should be discarded or zeroed instead (or
+  // left alone for HWM_OP_WRITE_STUB).
+  unsigned int op;
 
  private:
   // Pointer to the start of the data region for this data. There could still be
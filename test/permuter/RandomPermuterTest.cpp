@@ -40,13 +40,11 @@
 // your tests organized.  You may also throw in additional tests as
 // needed.
 
-// Hack to allow us to determine different bio flags based on kernel code. This
-// mus now be compiled with kernel headers.
-#include <linux/blk_types.h>
-
 #include <vector>
 
+#include "../../code/disk_wrapper_ioctl.h"
 #include "../../code/permuter/RandomPermuter.h"
+#include "../../code/results/PermuteTestResult.h"
 #include "../../code/utils/utils.h"
 #include "gtest/gtest.h"
 
@@ -54,8 +52,67 @@ namespace fs_testing {
 namespace test {
 using std::vector;
 
-using fs_testing::utils::disk_write;
+using fs_testing::PermuteTestResult;
+using fs_testing::permuter::epoch;
+using fs_testing::permuter::epoch_op;
 using fs_testing::permuter::RandomPermuter;
+using fs_testing::utils::disk_write;
+using fs_testing::utils::DiskWriteData;
+
+namespace {
+
+const unsigned int kSectorSize = 512;
+const unsigned int kWriteSize = 4096;
+// Crash states to generate in tests that check something of every state.
+const unsigned int kNumStates = 200;
+
+}  // namespace
+
+// Exposes the completion ordering helpers to the tests below.
+class CompletedBeforePermuter : public RandomPermuter {
+ public:
+  using RandomPermuter::AddCompletedBefore;
+  using RandomPermuter::kOpPicked;
+  using RandomPermuter::kOpWhole;
+};
+
+// Exposes the epochs built from a log to check crash states against.
+class EpochsPermuter : public RandomPermuter {
+ public:
+  using RandomPermuter::GetEpochs;
+};
+
+// Makes an op numbered from the same counter as the wrapper uses. A done_order
+// of 0 means its completion was not seen.
+epoch_op MakeOrderedOp(unsigned int index, unsigned long long submit_order,
+    unsigned long long done_order) {
+  epoch_op op;
+  op.abs_index = index;
+  op.op.metadata.write_sector = 8 * index;
+  op.op.metadata.size = kWriteSize;
+  op.op.metadata.submit_order = submit_order;
+  op.op.metadata.done_order = done_order;
+  return op;
+}
+
+// Makes a kWriteSize byte write at write_sector with the given bi_rw flags.
+disk_write MakeWrite(unsigned long write_sector, unsigned long long flags) {
+  disk_write write;
+  write.metadata.write_sector = write_sector;
+  write.metadata.size = kWriteSize;
+  write.metadata.bi_rw = flags;
+  return write;
+}
+
+// Every recorded log starts with a checkpoint, so the bios after it are
+// numbered from 1.
+disk_write MakeCheckpoint() {
+  disk_write checkpoint;
+  checkpoint.metadata.bi_flags = HWM_CHECKPOINT_FLAG;
+  checkpoint.metadata.bi_rw = HWM_CHECKPOINT_FLAG;
+  checkpoint.metadata.size = 0;
+  return checkpoint;
+}
 
 // Tests the default c'tor.
 TEST(RandomPermuter, DefaultConstructor) {
@@ -65,101 +122,248 @@ TEST(RandomPermuter, DefaultConstructor) {
 TEST(RandomPermuter, PermuteSingleEpoch) {
   unsigned int num_regular_writes = 9;
   vector<disk_write> test_epoch;
+  test_epoch.push_back(MakeCheckpoint());
 
   for (unsigned int i = 0; i < num_regular_writes; ++i) {
-    disk_write write;
-    write.metadata.write_sector = 50 * i;
-    write.metadata.size = 4096;
-    write.metadata.bi_flags = REQ_WRITE;
-    write.metadata.bi_rw = REQ_WRITE;
-
     // Make a sync operation.
-    if (i % 3 == 0) {
-      write.metadata.bi_flags |= REQ_SYNC;
-      write.metadata.bi_rw |= REQ_SYNC;
-    }
-    test_epoch.push_back(write);
+    test_epoch.push_back(MakeWrite(50 * i,
+          HWM_WRITE_FLAG | ((i % 3 == 0) ? HWM_SYNC_FLAG : 0)));
   }
 
-  disk_write barrier;
-  barrier.metadata.bi_flags = REQ_FUA | REQ_WRITE;
-  barrier.metadata.bi_rw = REQ_FUA | REQ_WRITE;
-  barrier.metadata.write_sector = 42;
+  disk_write barrier = MakeWrite(42, HWM_FUA_FLAG | HWM_WRITE_FLAG);
   barrier.metadata.size = 8192;
   test_epoch.push_back(barrier);
 
   RandomPermuter rp;
-  rp.init_data(&test_epoch);
-  vector<disk_write> result;
-  rp.gen_one_state(result);
+  rp.InitDataVector(kSectorSize, test_epoch);
+  vector<DiskWriteData> result;
+  PermuteTestResult log_data;
+  EXPECT_TRUE(rp.GenerateCrashState(result, log_data));
+  EXPECT_FALSE(result.empty());
+  EXPECT_LE(result.size(), num_regular_writes + 1);
 }
 
+// Whatever is dropped, the bios kept stay in log order so writes to the same
+// sectors land in the order they were sent.
 TEST(RandomPermuter, FindOverlaps) {
   unsigned int num_regular_writes = 9;
   vector<disk_write> test_epoch;
-  unsigned int write_size = 4096;
+  test_epoch.push_back(MakeCheckpoint());
 
   for (unsigned int i = 0; i < num_regular_writes; ++i) {
-    disk_write write;
-    write.metadata.write_sector = write_size * i;
-    write.metadata.size = write_size;
-    write.metadata.bi_flags = REQ_WRITE;
-    write.metadata.bi_rw = REQ_WRITE;
-
-    test_epoch.push_back(write);
+    test_epoch.push_back(MakeWrite(8 * i, HWM_WRITE_FLAG));
   }
 
-  disk_write barrier;
-  barrier.metadata.bi_flags = REQ_FUA | REQ_WRITE;
-  barrier.metadata.bi_rw = REQ_FUA | REQ_WRITE;
-  barrier.metadata.write_sector = 0;
-  barrier.metadata.size = 2 * write_size;
+  disk_write barrier = MakeWrite(0, HWM_FUA_FLAG | HWM_WRITE_FLAG);
+  barrier.metadata.size = 2 * kWriteSize;
   test_epoch.push_back(barrier);
 
   RandomPermuter rp;
-  rp.init_data(&test_epoch);
-  vector<disk_write> result;
-  rp.gen_one_state(result);
-
-  EXPECT_NE(test_epoch, result);
+  rp.InitDataVector(kSectorSize, test_epoch);
+  for (unsigned int i = 0; i < kNumStates; ++i) {
+    vector<DiskWriteData> result;
+    PermuteTestResult log_data;
+    rp.GenerateCrashState(result, log_data);
+    for (unsigned int j = 1; j < result.size(); ++j) {
+      EXPECT_LT(result.at(j - 1).bio_index, result.at(j).bio_index);
+    }
+  }
 }
 
 TEST(RandomPermuter, FindNoOverlapsMultiEpoch) {
   unsigned int num_epochs = 3;
   unsigned int num_regular_writes = 9;
   vector<disk_write> test_epoch;
-  unsigned int write_size = 4096;
+  test_epoch.push_back(MakeCheckpoint());
 
   for (unsigned int epoch = 0; epoch < num_epochs; ++epoch) {
     for (unsigned int i = 0; i < num_regular_writes; ++i) {
-      disk_write write;
-      write.metadata.write_sector = write_size * i;
-      write.metadata.size = write_size;
-      write.metadata.bi_flags = REQ_WRITE;
-      write.metadata.bi_rw = REQ_WRITE;
-
-      test_epoch.push_back(write);
+      test_epoch.push_back(MakeWrite(8 * i, HWM_WRITE_FLAG));
     }
 
-    disk_write barrier;
-    barrier.metadata.bi_flags = REQ_FUA | REQ_WRITE;
-    barrier.metadata.bi_rw = REQ_FUA | REQ_WRITE;
-    barrier.metadata.write_sector = (num_regular_writes + 1) * write_size;
-    barrier.metadata.size = 2 * write_size;
+    disk_write barrier =
+      MakeWrite(8 * (num_regular_writes + 1), HWM_FUA_FLAG | HWM_WRITE_FLAG);
+    barrier.metadata.size = 2 * kWriteSize;
     test_epoch.push_back(barrier);
   }
 
   RandomPermuter rp;
-  rp.init_data(&test_epoch);
-  vector<disk_write> result;
-  rp.gen_one_state(result);
+  rp.InitDataVector(kSectorSize, test_epoch);
 
   // The very first epoch should be the same since we have no overlaps in it as
   // long as multiple epochs are written to disk.
-  EXPECT_TRUE(result.size() > num_regular_writes + 1);
-  for (unsigned int i = 0; i < num_regular_writes + 1; ++i) {
-    EXPECT_EQ(test_epoch.at(i), result.at(i));
+  bool saw_multi_epoch = false;
+  for (unsigned int i = 0; i < kNumStates; ++i) {
+    vector<DiskWriteData> result;
+    PermuteTestResult log_data;
+    rp.GenerateCrashState(result, log_data);
+    if (result.size() <= num_regular_writes + 1) {
+      continue;
+    }
+    saw_multi_epoch = true;
+    for (unsigned int j = 0; j < num_regular_writes + 1; ++j) {
+      EXPECT_EQ(j + 1, result.at(j).bio_index);
+      EXPECT_EQ(test_epoch.at(j + 1).metadata.write_sector * kSectorSize,
+          result.at(j).disk_offset);
+    }
+  }
+  EXPECT_TRUE(saw_multi_epoch);
+}
+
+// Picking an op pulls in whole the ops that completed before it was submitted,
+// but not ones that were still in flight or whose completion was not seen.
+TEST(RandomPermuter, AddCompletedBefore) {
+  const unsigned int picked = CompletedBeforePermuter::kOpPicked;
+  const unsigned int whole = CompletedBeforePermuter::kOpWhole;
+  epoch test_epoch;
+  test_epoch.ops.push_back(MakeOrderedOp(0, 1, 2));
+  test_epoch.ops.push_back(MakeOrderedOp(1, 3, 6));
+  test_epoch.ops.push_back(MakeOrderedOp(2, 4, 0));
+  test_epoch.ops.push_back(MakeOrderedOp(3, 5, 7));
+
+  vector<unsigned int> bitmap(test_epoch.ops.size());
+  bitmap.at(3) = picked;
+  CompletedBeforePermuter::AddCompletedBefore(test_epoch, bitmap);
+  EXPECT_EQ(whole, bitmap.at(0));
+  EXPECT_EQ(0U, bitmap.at(1));
+  EXPECT_EQ(0U, bitmap.at(2));
+  EXPECT_EQ(picked, bitmap.at(3));
+}
+
+// Ops pulled in pull in what completed before them too.
+TEST(RandomPermuter, AddCompletedBeforeTransitive) {
+  const unsigned int picked = CompletedBeforePermuter::kOpPicked;
+  const unsigned int whole = CompletedBeforePermuter::kOpWhole;
+  epoch test_epoch;
+  test_epoch.ops.push_back(MakeOrderedOp(0, 1, 2));
+  test_epoch.ops.push_back(MakeOrderedOp(1, 3, 4));
+  test_epoch.ops.push_back(MakeOrderedOp(2, 5, 6));
+  test_epoch.ops.push_back(MakeOrderedOp(3, 7, 0));
+
+  vector<unsigned int> bitmap(test_epoch.ops.size());
+  bitmap.at(3) = picked;
+  CompletedBeforePermuter::AddCompletedBefore(test_epoch, bitmap);
+  for (unsigned int i = 0; i < 3; ++i) {
+    EXPECT_EQ(whole, bitmap.at(i));
   }
+  EXPECT_EQ(picked, bitmap.at(3));
+
+  // A picked op that completed before another picked op is needed whole, and
+  // nothing submitted after the last picked op is pulled in.
+  bitmap.assign(test_epoch.ops.size(), 0);
+  bitmap.at(0) = picked;
+  bitmap.at(1) = picked;
+  CompletedBeforePermuter::AddCompletedBefore(test_epoch, bitmap);
+  EXPECT_EQ(whole, bitmap.at(0));
+  EXPECT_EQ(picked, bitmap.at(1));
+  EXPECT_EQ(0U, bitmap.at(2));
+  EXPECT_EQ(0U, bitmap.at(3));
+}
+
+// Without completion pruning a bio can be in a crash state without the bios
+// that completed before it was sent, since a volatile write cache could have
+// lost them. With it those bios are always pulled in.
+TEST(RandomPermuter, CompletionPruning) {
+  const unsigned int num_writes = 6;
+  vector<disk_write> test_epoch;
+  test_epoch.push_back(MakeCheckpoint());
+  for (unsigned int i = 0; i < num_writes; ++i) {
+    // Each write completes before the next one is sent.
+    disk_write write = MakeWrite(8 * i, HWM_WRITE_FLAG);
+    write.metadata.submit_order = 2 * i + 1;
+    write.metadata.done_order = 2 * i + 2;
+    test_epoch.push_back(write);
+  }
+
+  for (unsigned int prune = 0; prune < 2; ++prune) {
+    RandomPermuter rp;
+    rp.SetCompletionPruning(prune);
+    rp.InitDataVector(kSectorSize, test_epoch);
+    bool saw_gap = false;
+    for (unsigned int i = 0; i < kNumStates; ++i) {
+      vector<DiskWriteData> result;
+      PermuteTestResult log_data;
+      rp.GenerateCrashState(result, log_data);
+      EXPECT_EQ(prune == 1, log_data.completion_pruning);
+      for (unsigned int j = 0; j < result.size(); ++j) {
+        if (result.at(j).bio_index != j + 1) {
+          saw_gap = true;
+        }
+      }
+    }
+    EXPECT_EQ(prune == 0, saw_gap);
+  }
+}
+
+// Checks that the first persisted_prefix entries of crash states generated
+// from log are whole bios in log order, so a prefix image written from one
+// crash state can stand in for the start of any other.
+static void VerifyPersistedPrefix(vector<disk_write> &log,
+    const bool sector_states) {
+  EpochsPermuter rp;
+  rp.InitDataVector(kSectorSize, log);
+  vector<DiskWriteData> expected;
+  for (epoch &e : *rp.GetEpochs()) {
+    for (epoch_op &op : e.ops) {
+      expected.push_back(op.ToWriteData());
+    }
+  }
+
+  // The flush and data halves of a split bio share its abs_index.
+  unsigned int split = 0;
+  for (unsigned int i = 1; i < expected.size(); ++i) {
+    if (expected.at(i - 1).bio_index == expected.at(i).bio_index) {
+      split = i;
+    }
+  }
+  ASSERT_NE(0, split);
+
+  bool saw_split = false;
+  for (unsigned int i = 0; i < kNumStates; ++i) {
+    vector<DiskWriteData> result;
+    PermuteTestResult log_data;
+    if (sector_states) {
+      rp.GenerateSectorCrashState(result, log_data);
+    } else {
+      rp.GenerateCrashState(result, log_data);
+    }
+    ASSERT_LE(log_data.persisted_prefix, result.size());
+    ASSERT_LE(log_data.persisted_prefix, expected.size());
+    saw_split |= log_data.persisted_prefix > split;
+    for (unsigned int j = 0; j < log_data.persisted_prefix; ++j) {
+      EXPECT_TRUE(result.at(j).full_bio);
+      EXPECT_EQ(expected.at(j).bio_index, result.at(j).bio_index);
+      EXPECT_EQ(expected.at(j).bio_sector_index,
+          result.at(j).bio_sector_index);
+      EXPECT_EQ(expected.at(j).disk_offset, result.at(j).disk_offset);
+      EXPECT_EQ(expected.at(j).size, result.at(j).size);
+      EXPECT_EQ(expected.at(j).op, result.at(j).op);
+    }
+  }
+  EXPECT_TRUE(saw_split);
+}
+
+// Prefix images are built from the persisted prefix of one crash state and
+// reused for later ones, which is only right if every crash state starts with
+// the same entries.
+TEST(RandomPermuter, PersistedPrefixInLogOrder) {
+  vector<disk_write> log;
+  log.push_back(MakeCheckpoint());
+  for (unsigned int epoch = 0; epoch < 4; ++epoch) {
+    // Overlapping writes so sector states have something to coalesce.
+    for (unsigned int i = 0; i < 3; ++i) {
+      log.push_back(MakeWrite(4 * i, HWM_WRITE_FLAG));
+    }
+    if (epoch == 1) {
+      // Split into a flush ending this epoch and a write starting the next.
+      log.push_back(MakeWrite(64, HWM_FLUSH_FLAG | HWM_WRITE_FLAG));
+    } else if (epoch < 3) {
+      log.push_back(MakeWrite(64, HWM_FUA_FLAG | HWM_WRITE_FLAG));
+    }
+  }
+
+  VerifyPersistedPrefix(log, false);
+  VerifyPersistedPrefix(log, true);
 }
 
 }  // namespace test
@@ -138,5 +138,174 @@ TEST(DiskWrite, Serialize_Deserialize_Epoch) {
   }
 }
 
+TEST(DiskWrite, Serialize_Deserialize_ZeroChunks) {
+  disk_write test_write;
+
+  test_write.metadata.write_sector = 50;
+  test_write.metadata.size = 3 * 4096 + 512;
+  test_write.metadata.bi_flags = REQ_WRITE;
+  test_write.metadata.bi_rw = REQ_WRITE;
+  // Second and last chunks are all zeros and shouldn't be written out.
+  char data[test_write.metadata.size];
+  memset(data, 0, test_write.metadata.size);
+  memset(data, 0x20, 4096);
+  memset(data + 2 * 4096, 0x30, 4096);
+  test_write.set_data(data);
+
+  char *temp_file = strdup("/tmp/disk_write_serializeXXXXXX");
+  int temp_fd = mkstemp(temp_file);
+  EXPECT_TRUE(temp_fd > 0);
+
+  ofstream output(temp_file);
+  close(temp_fd);
+  disk_write::serialize(output, test_write);
+  disk_write::serialize(output, test_write);
+  output.close();
+
+  ifstream input(temp_file);
+  free(temp_file);
+  input.seekg(0, std::ios::end);
+  // Metadata block plus two data chunks per entry.
+  EXPECT_EQ(2 * 3 * 4096, input.tellg());
+  input.seekg(0, std::ios::beg);
+  for (unsigned int i = 0; i < 2; ++i) {
+    disk_write read = disk_write::deserialize(input);
+    EXPECT_EQ(test_write.metadata.size, read.metadata.size);
+    EXPECT_EQ(0,
+        memcmp(test_write.get_data().get(), read.get_data().get(),
+            test_write.metadata.size));
+  }
+  input.close();
+}
+
+TEST(DiskWrite, Serialize_Deserialize_RangeOp) {
+  disk_write_op_meta meta;
+  memset(&meta, 0, sizeof(meta));
+  meta.bi_rw = HWM_DISCARD_FLAG;
+  meta.write_sector = 50;
+  // Far larger than any data we could hold for it.
+  meta.size = 1U << 30;
+  meta.op = HWM_OP_DISCARD;
+  disk_write test_write(meta, (const char *) NULL);
+  EXPECT_TRUE(test_write.is_range_op());
+  EXPECT_EQ(NULL, test_write.get_data().get());
+
+  char *temp_file = strdup("/tmp/disk_write_serializeXXXXXX");
+  int temp_fd = mkstemp(temp_file);
+  EXPECT_TRUE(temp_fd > 0);
+
+  ofstream output(temp_file);
+  close(temp_fd);
+  disk_write::serialize(output, test_write);
+  output.close();
+
+  ifstream input(temp_file);
+  free(temp_file);
+  input.seekg(0, std::ios::end);
+  // Only the metadata block is written.
+  EXPECT_EQ(4096, input.tellg());
+  input.seekg(0, std::ios::beg);
+  disk_write read = disk_write::deserialize(input);
+  input.close();
+
+  EXPECT_EQ(HWM_OP_DISCARD, read.metadata.op);
+  EXPECT_EQ(test_write.metadata.size, read.metadata.size);
+  EXPECT_EQ(test_write.metadata.write_sector, read.metadata.write_sector);
+  EXPECT_TRUE(test_write == read);
+}
+
+TEST(DiskWrite, Serialize_Deserialize_Order) {
+  disk_write_op_meta meta;
+  memset(&meta, 0, sizeof(meta));
+  meta.bi_rw = HWM_WRITE_FLAG;
+  meta.write_sector = 50;
+  meta.size = 4096;
+  meta.op = HWM_OP_WRITE;
+  meta.submit_order = 7;
+  meta.done_order = 12;
+  meta.done_ns = 123456789ULL;
+  meta.inflight = 3;
+  char data[4096];
+  memset(data, 0x5a, sizeof(data));
+  disk_write test_write(meta, data);
+
+  char *temp_file = strdup("/tmp/disk_write_serializeXXXXXX");
+  int temp_fd = mkstemp(temp_file);
+  EXPECT_TRUE(temp_fd > 0);
+
+  ofstream output(temp_file);
+  close(temp_fd);
+  disk_write::serialize(output, test_write);
+  output.close();
+
+  ifstream input(temp_file);
+  free(temp_file);
+  disk_write read = disk_write::deserialize(input);
+  input.close();
+  EXPECT_EQ(meta.submit_order, read.metadata.submit_order);
+  EXPECT_EQ(meta.done_order, read.metadata.done_order);
+  EXPECT_EQ(meta.done_ns, read.metadata.done_ns);
+  EXPECT_EQ(meta.inflight, read.metadata.inflight);
+  EXPECT_TRUE(test_write == read);
+}
+
+TEST(DiskWrite, WriteStub) {
+  disk_write_op_meta meta;
+  memset(&meta, 0, sizeof(meta));
+  meta.bi_rw = HWM_WRITE_FLAG;
+  meta.write_sector = 50;
+  meta.size = 1U << 20;
+  meta.op = HWM_OP_WRITE_STUB;
+  const unsigned long long hash = 0x1234abcdULL;
+  // Only the hash is copied, not size bytes.
+  disk_write test_write(meta, (const char *) &hash);
+  EXPECT_TRUE(test_write.is_range_op());
+  EXPECT_EQ(0, memcmp(&hash, test_write.get_data().get(), sizeof(hash)));
+
+  char *temp_file = strdup("/tmp/disk_write_serializeXXXXXX");
+  int temp_fd = mkstemp(temp_file);
+  EXPECT_TRUE(temp_fd > 0);
+
+  ofstream output(temp_file);
+  close(temp_fd);
+  disk_write::serialize(output, test_write);
+  output.close();
+
+  ifstream input(temp_file);
+  free(temp_file);
+  disk_write read = disk_write::deserialize(input);
+  input.close();
+  EXPECT_EQ(HWM_OP_WRITE_STUB, read.metadata.op);
+  EXPECT_TRUE(test_write == read);
+}
+
+TEST(DiskWrite, SharedDataConstructor) {
+  disk_write_op_meta meta;
+  meta.bi_flags = HWM_WRITE_FLAG;
+  meta.bi_rw = HWM_WRITE_FLAG;
+  meta.write_sector = 50;
+  meta.size = 4096;
+  meta.op = HWM_OP_WRITE;
+  meta.time_ns = 0;
+
+  std::shared_ptr<char> buf(new char[2 * meta.size],
+      [](char *c) {delete[] c;});
+  memset(buf.get(), 0x20, 2 * meta.size);
+  std::shared_ptr<char> second(buf, buf.get() + meta.size);
+
+  disk_write test_write(meta, second);
+  // Data should be shared with the original buffer, not copied.
+  EXPECT_EQ(buf.get() + meta.size, test_write.get_data().get());
+
+  buf.reset();
+  second.reset();
+  // The disk_write keeps the underlying buffer alive.
+  EXPECT_EQ(0x20, test_write.get_data().get()[meta.size - 1]);
+
+  meta.size = 0;
+  disk_write checkpoint(meta, std::shared_ptr<char>());
+  EXPECT_EQ(NULL, checkpoint.get_data().get());
+}
+
 }  // namespace test
 }  // namespace fs_testing